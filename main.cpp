@@ -5,15 +5,24 @@
  ********************************************************************************************/
 // win64:
 //	@echo "Building for Win64"
-//	g++ -o apps.exe main.cpp lodepng.cpp -lraylib -lgdi32 -lwinmm
+//	g++ -o apps.exe -DLODEPNG_NO_COMPILE_ALLOCATORS -DLODEPNG_NO_COMPILE_ENCODER -DLODEPNG_NO_COMPILE_DISK
+//	    -DLODEPNG_NO_COMPILE_ANCILLARY_CHUNKS -DLODEPNG_NO_COMPILE_CPP main.cpp lodepng.cpp -lraylib -lgdi32 -lwinmm
 
 #include "raylib.h"
 #include "rlgl.h"
+#include "raymath.h"
 #include "lodepng.h"
+#ifdef SFF_SPRITE_EXPORT
+#include "sff_export.h"
+#endif
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include <map>
 #include <unordered_map>
 #include <vector>
@@ -22,9 +31,30 @@
 #include <algorithm>
 #include <stdexcept>
 #include <memory>
+#include <functional>
 #include <fstream>
+#include <filesystem>
+#include <future>
+#include <mutex>
 #include <stdint.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SFF_SIMD_SSE2
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SFF_SIMD_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SFF_SIMD_NEON
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 // #ifdef _WIN32
 //     #define WIN32_LEAN_AND_MEAN
 //     #define NOGDI
@@ -61,6 +91,158 @@ public:
                   NumberOfSprites(0), NumberOfPalettes(0) {}
 };
 
+enum VramCategory {
+    VRAM_INDEXED_SPRITES = 0,  // GRAYSCALE index planes and atlas pages
+    VRAM_RGBA_SPRITES,
+    VRAM_PALETTES,
+    VRAM_CATEGORY_COUNT
+};
+
+enum VramBudgetPolicy {
+    VRAM_BUDGET_REFUSE = 0,    // Uploads that would exceed the limit fail
+    VRAM_BUDGET_EVICT          // Least recently drawn evictable textures are unloaded to make room
+};
+
+struct VramUsage {
+    size_t bytes[VRAM_CATEGORY_COUNT];  // Resident texture bytes per category
+    size_t sharedBytes;                 // Bytes never uploaded thanks to links and deduplication
+
+    VramUsage() : bytes(), sharedBytes(0) {}
+
+    size_t Total() const {
+        size_t total = 0;
+        for (size_t b : bytes) total += b;
+        return total;
+    }
+};
+
+// Shared state behind the copies of one TextureHandle
+struct TextureRecord {
+    Texture2D texture;                          // id is 0 while evicted, size and format are kept
+    int refs;
+    VramCategory category;
+    size_t bytes;
+    uint64_t lastUsed;                          // VramBudget frame of the last Use()
+    std::function<bool(Texture2D&)> reloader;   // Re-creates an evicted texture, empty when pinned
+    TextureRecord* prev;                        // VramBudget list of evictable textures
+    TextureRecord* next;
+};
+
+// Process-wide texture memory accounting and the optional budget enforced on uploads.
+// Like the textures themselves it is only touched from the thread owning the GL context.
+class VramBudget {
+public:
+    static VramBudget& Instance();
+
+    // limit 0 (the default) disables the budget, usage is tracked either way
+    void SetLimit(size_t bytes, VramBudgetPolicy policy);
+    size_t GetLimit() const { return limit_; }
+    VramBudgetPolicy GetPolicy() const { return policy_; }
+
+    // Checks that bytes more fit within the limit, evicting textures not drawn during the
+    // current frame when the policy allows it. Call before uploading.
+    bool Reserve(size_t bytes);
+
+    // Textures used since the last NextFrame() are never evicted, call once per frame
+    void NextFrame() { frame_++; }
+    uint64_t GetFrame() const { return frame_; }
+
+    const VramUsage& GetUsage() const { return usage_; }
+    size_t GetEvictionCount() const { return evictions_; }
+    void AddSharedBytes(size_t bytes) { usage_.sharedBytes += bytes; }
+    void RemoveSharedBytes(size_t bytes) { usage_.sharedBytes -= std::min(bytes, usage_.sharedBytes); }
+
+private:
+    friend class TextureHandle;
+
+    VramBudget() : limit_(0), policy_(VRAM_BUDGET_REFUSE), frame_(0), evictions_(0), evictable_(nullptr) {}
+
+    void OnCreate(TextureRecord* record);
+    void OnRelease(TextureRecord* record);
+    bool OnUse(TextureRecord* record);
+    void SetReloader(TextureRecord* record, std::function<bool(Texture2D&)> reloader);
+    void Evict(TextureRecord* record);
+
+    size_t limit_;
+    VramBudgetPolicy policy_;
+    uint64_t frame_;
+    size_t evictions_;
+    VramUsage usage_;
+    TextureRecord* evictable_;
+};
+
+// Reference-counted owner of a GPU texture. Copies share the texture, the last handle to go
+// away unloads it. Counts are not atomic: handles belong to the thread owning the GL context.
+class TextureHandle {
+public:
+    TextureHandle() : shared_(nullptr) {}
+    // Takes ownership of texture and accounts it under category (an id of 0 gives an empty handle)
+    TextureHandle(const Texture2D& texture, VramCategory category) : shared_(nullptr) {
+        if (texture.id != 0) {
+            shared_ = new TextureRecord{texture, 1, category, 0, 0, nullptr, nullptr, nullptr};
+            VramBudget::Instance().OnCreate(shared_);
+        }
+    }
+    TextureHandle(const TextureHandle& other) : shared_(other.shared_) {
+        if (shared_) shared_->refs++;
+    }
+    TextureHandle(TextureHandle&& other) noexcept : shared_(other.shared_) { other.shared_ = nullptr; }
+    ~TextureHandle() { Reset(); }
+
+    TextureHandle& operator=(const TextureHandle& other) {
+        if (shared_ != other.shared_) {
+            Reset();
+            shared_ = other.shared_;
+            if (shared_) shared_->refs++;
+        }
+        return *this;
+    }
+
+    TextureHandle& operator=(TextureHandle&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            shared_ = other.shared_;
+            other.shared_ = nullptr;
+        }
+        return *this;
+    }
+
+    void Reset() {
+        if (shared_ && --shared_->refs == 0) {
+            VramBudget::Instance().OnRelease(shared_);
+            delete shared_;
+        }
+        shared_ = nullptr;
+    }
+
+    // Marks the texture as drawn this frame, re-creating it first if the budget evicted it.
+    // False when it is not available.
+    bool Use() const { return shared_ && VramBudget::Instance().OnUse(shared_); }
+
+    // Lets the budget evict the texture, reloader re-uploads it into the Texture2D it is given
+    // (size and format intact). An empty reloader pins the texture again.
+    void SetReloader(std::function<bool(Texture2D&)> reloader) {
+        if (shared_) VramBudget::Instance().SetReloader(shared_, std::move(reloader));
+    }
+
+    // An empty handle reads as a zeroed texture
+    const Texture2D& Get() const { return shared_ ? shared_->texture : Empty(); }
+    const Texture2D* operator->() const { return &Get(); }
+    explicit operator bool() const { return shared_ != nullptr; }
+    int UseCount() const { return shared_ ? shared_->refs : 0; }
+    bool IsResident() const { return shared_ && shared_->texture.id != 0; }
+    size_t GetBytes() const { return shared_ ? shared_->bytes : 0; }
+    VramCategory GetCategory() const { return shared_ ? shared_->category : VRAM_INDEXED_SPRITES; }
+
+private:
+    static const Texture2D& Empty() {
+        static const Texture2D empty = {};
+        return empty;
+    }
+
+    TextureRecord* shared_;
+};
+
 class Sprite {
 public:
     uint16_t Group;
@@ -70,12 +252,15 @@ public:
     int palidx;
     int rle;
     uint8_t coldepth;
-    Texture2D texture;
+    bool premultiplied;  // RGBA texels already multiplied by alpha, draw with BLEND_ALPHA_PREMULTIPLY
+    int atlasPage;       // Atlas page holding the sprite, -1 when it has a texture of its own
+    Rectangle atlasRect; // Source rectangle inside texture (the whole texture when not atlased)
+    TextureHandle texture;
 
-    Sprite() : Group(0), Number(0), palidx(0), rle(0), coldepth(0) {
+    Sprite() : Group(0), Number(0), palidx(0), rle(0), coldepth(0), premultiplied(false), atlasPage(-1) {
         Size[0] = Size[1] = 0;
         Offset[0] = Offset[1] = 0;
-        texture = {};
+        atlasRect = {};
     }
 
     void CopyFrom(const Sprite& other) {
@@ -88,9 +273,17 @@ public:
         palidx = other.palidx;
         rle = other.rle;
         coldepth = other.coldepth;
+        premultiplied = other.premultiplied;
+        atlasPage = other.atlasPage;
+        atlasRect = other.atlasRect;
         texture = other.texture;
     }
 
+    // Draws the sprite's pixels with their top-left corner at (x, y)
+    void Draw(float x, float y, Color tint) const {
+        DrawTextureRec(texture.Get(), atlasRect, Vector2{x, y}, tint);
+    }
+
     void Print() const {
         printf("Sprite: Group %d, Number %d, Size (%d,%d), Offset (%d,%d), palidx %d, rle %d, coldepth %d\n",
             Group, Number, Size[0], Size[1], Offset[0], Offset[1], palidx, -rle, coldepth);
@@ -103,31 +296,41 @@ public:
     bool IsRGBA() const {
         return (rle == -11 || rle == -12);
     }
+
+    bool IsPng() const {
+        return (rle == -10 || rle == -11 || rle == -12);
+    }
 };
 
 class Palette {
 public:
-    Texture2D texture;
+    TextureHandle texture;
+    int row;  // Row of texture holding this palette (palette atlases hold one palette per row)
+
+    Palette() : row(0) {}
+    explicit Palette(const TextureHandle& id, int atlasRow = 0) : texture(id), row(atlasRow) {}
+    explicit Palette(const std::string& actFilename) : texture(GenerateFromACT(actFilename)), row(0) {}
 
-    Palette() : texture({}) {}
-    explicit Palette(Texture2D id) : texture(id) {}
-    explicit Palette(const std::string& actFilename) : texture(GenerateFromACT(actFilename)) {}
+    // Texture v coordinate of the palette row centre, the paletteRow shader uniform
+    float GetRowCoord() const {
+        return texture->height > 0 ? (row + 0.5f) / texture->height : 0.5f;
+    }
 
 private:
-    static Texture2D GenerateFromACT(const std::string& filename) {
+    static TextureHandle GenerateFromACT(const std::string& filename) {
         Texture2D texture = {};
         std::array<RGB, 256> pal_rgb;
 
         std::ifstream file(filename, std::ios::binary);
         if (!file) {
             printf("Failed to open palette file: %s\n", filename.c_str());
-            return texture;
+            return TextureHandle();
         }
 
         file.read(reinterpret_cast<char*>(pal_rgb.data()), sizeof(RGB) * 256);
         if (!file) {
             printf("Failed to read palette data from file: %s\n", filename.c_str());
-            return texture;
+            return TextureHandle();
         }
 
         std::array<uint8_t, 256 * 4> pal_byte;
@@ -143,8 +346,335 @@ private:
         texture.height = 1;
         texture.mipmaps = 1;
         texture.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-        return texture;
+        return TextureHandle(texture, VRAM_PALETTES);
+    }
+};
+
+// 256 x N RGBA texture holding one palette per row, so switching palettes only changes
+// the row the shader samples. Can be shared by several SffFiles (see SffFile::SetPaletteAtlas()).
+class PaletteAtlas {
+public:
+    // capacity 0 sizes the texture to the rows added before the first Commit()
+    explicit PaletteAtlas(int capacity = 0) : capacity_(capacity), rows_(0), dirtyFrom_(0) {}
+
+    // Appends a palette (256 RGBA entries) and returns its row, -1 when the atlas is full
+    int AddRow(const uint8_t* rgba);
+
+    // Returns the row already holding exactly these colours, otherwise appends them like AddRow().
+    // added (if given) tells which happened.
+    int FindOrAddRow(const uint8_t* rgba, bool* added = nullptr);
+
+    // Uploads rows added since the last call, creating the texture the first time
+    void Commit();
+
+    // Palettes hold on to this handle, so the texture outlives the atlas while they are in use
+    const TextureHandle& GetTexture() const { return texture_; }
+    int GetRowCount() const { return rows_; }
+    int GetCapacity() const { return capacity_; }
+
+    // The 256 RGBA entries of row, nullptr if there is no such row. Adding rows may move them,
+    // so don't hold on to it while files sharing the atlas load.
+    const uint8_t* GetRow(int row) const {
+        return (row >= 0 && row < rows_) ? &pixels_[static_cast<size_t>(row) * 256 * 4] : nullptr;
+    }
+
+private:
+    int AddRowLocked(const uint8_t* rgba);
+
+    // Files sharing the atlas may add rows from SffManager's worker threads
+    std::mutex mutex_;
+    std::vector<uint8_t> pixels_;
+    std::unordered_map<uint64_t, std::vector<int>> rowsByHash_;  // Colour content hash -> rows
+    TextureHandle texture_;
+    int capacity_;
+    int rows_;
+    int dirtyFrom_;
+
+    PaletteAtlas(const PaletteAtlas&) = delete;
+    PaletteAtlas& operator=(const PaletteAtlas&) = delete;
+};
+
+// Scratch memory handed to lodepng through its allocator hooks (the Makefile builds
+// lodepng with LODEPNG_NO_COMPILE_ALLOCATORS). Individual frees are no-ops, Reset()
+// rewinds everything at once and keeps the capacity for the next sprite.
+class PngScratchArena {
+public:
+    PngScratchArena() {}
+    ~PngScratchArena() { Release(); }
+
+    void* Alloc(size_t size);
+    void* Realloc(void* ptr, size_t newSize);
+    bool Owns(const void* ptr) const;
+    void Reset();
+    void Release();
+
+private:
+    struct Block {
+        uint8_t* base;
+        size_t capacity;
+        size_t used;
+    };
+
+    static const size_t kHeaderSize = 16;            // Keeps allocations 16-byte aligned
+    static const size_t kMinBlockSize = 256 * 1024;
+    static const size_t kMaxRetainedSize = 16 * 1024 * 1024;
+
+    static size_t AlignUp(size_t size) { return (size + 15) & ~static_cast<size_t>(15); }
+
+    std::vector<Block> blocks_;
+
+    PngScratchArena(const PngScratchArena&) = delete;
+    PngScratchArena& operator=(const PngScratchArena&) = delete;
+};
+
+struct PngHeaderInfo {
+    unsigned width;
+    unsigned height;
+    uint8_t bitdepth;
+    uint8_t colortype;
+    uint8_t interlace;
+};
+
+struct PngImage {
+    const uint8_t* pixels;  // Owned by the decoder context, valid until its next Decode()
+    unsigned width;
+    unsigned height;
+    LodePNGColorType colortype;
+    unsigned bitdepth;
+    size_t size;            // Bytes of pixel data
+};
+
+// Per-thread PNG decoder. The lodepng state, the concatenated IDAT buffer, the inflated
+// scanlines and the Huffman tables all come from one arena that survives across sprites,
+// and every PNG is parsed in a single lodepng_decode pass (no separate lodepng_inspect).
+class PngDecoderContext {
+public:
+    static PngDecoderContext& ForThisThread();
+
+    PngDecoderContext();
+    ~PngDecoderContext();
+
+    // Decodes a PNG stream to LCT_PALETTE or LCT_RGBA, always 8 bits per channel. Images
+    // already stored in the requested layout are returned as-is, without a conversion copy.
+    // maxOutputSize bounds the inflated scanlines (0 = unbounded). RGBA output is
+    // optionally premultiplied by alpha in place.
+    unsigned Decode(const uint8_t* data, size_t size, LodePNGColorType colortype, size_t maxOutputSize,
+                    bool premultiply, PngImage& image);
+
+    // Parses the IHDR chunk only (the first 33 bytes of the stream), without touching any decoder state
+    static bool ReadHeader(const uint8_t* data, size_t size, PngHeaderInfo& info);
+
+    // Drops the retained scratch memory, e.g. once a whole file has been loaded
+    void ReleaseScratch();
+
+    // Entry points for the lodepng allocator hooks
+    void* Alloc(size_t size) { return arena_.Alloc(size); }
+    void* Realloc(void* ptr, size_t newSize) { return arena_.Realloc(ptr, newSize); }
+    bool Owns(const void* ptr) const { return arena_.Owns(ptr); }
+    bool IsActive() const { return active_; }
+
+private:
+    void ResetState();
+
+    PngScratchArena arena_;
+    LodePNGState state_;
+    bool active_;
+
+    PngDecoderContext(const PngDecoderContext&) = delete;
+    PngDecoderContext& operator=(const PngDecoderContext&) = delete;
+};
+
+// Ceilings applied while decoding sprites, so a corrupt or hostile file fails
+// before anything is allocated. A value of 0 disables the corresponding limit.
+struct SffLoadLimits {
+    size_t maxSpritePixels;  // Size[0] * Size[1] of a single sprite
+    size_t maxLoadBytes;     // Decoded pixel bytes summed over one Load()
+
+    SffLoadLimits() : maxSpritePixels(4096 * 4096), maxLoadBytes(1024u * 1024 * 1024) {}
+};
+
+// What SffFile::Reload() had to do to pick up the file's new contents
+enum SffReloadResult {
+    SFF_RELOAD_FAILED,       // The file couldn't be read or loaded, what was loaded is kept
+    SFF_RELOAD_INCREMENTAL,  // Changed sprites and palettes were updated in place
+    SFF_RELOAD_FULL          // The layout changed and the file was loaded again
+};
+
+// Bottom-left skyline rectangle packer (one per atlas page)
+class SkylinePacker {
+public:
+    SkylinePacker(int width, int height) : width_(width), height_(height), usedHeight_(0) {
+        skyline_.push_back({0, 0, width});
+    }
+
+    bool Insert(int w, int h, int& x, int& y);
+    int GetUsedHeight() const { return usedHeight_; }
+
+private:
+    struct Segment {
+        int x, y, width;
+    };
+
+    int FitAt(size_t index, int w, int h) const;
+
+    std::vector<Segment> skyline_;
+    int width_, height_;
+    int usedHeight_;
+};
+
+// Packs decoded 8-bit index planes into a few large GRAYSCALE pages. Pixels are
+// staged on the CPU and every page is uploaded once, by Upload().
+class SpriteAtlasBuilder {
+public:
+    // bytesPerPixel 1 builds GRAYSCALE index pages, 4 builds RGBA pages
+    SpriteAtlasBuilder(int pageSize, int padding, int bytesPerPixel = 1)
+        : pageSize_(pageSize), padding_(padding), bytesPerPixel_(bytesPerPixel) {}
+
+    // Finds room for a w x h plane and copies it there. Returns false when the plane
+    // is larger than a page, in which case the caller keeps a standalone texture.
+    bool Add(const uint8_t* pixels, int w, int h, int& page, Rectangle& rect);
+
+    size_t GetPageCount() const { return pages_.size(); }
+
+    // Whether the w x h plane at rect of page (as returned by Add()) holds exactly pixels
+    bool Matches(const uint8_t* pixels, int page, const Rectangle& rect) const;
+
+    // Texture bytes Upload() will create
+    size_t GetUploadBytes() const;
+
+    // Uploads the pages, each cropped to the rows actually used
+    std::vector<TextureHandle> Upload();
+
+private:
+    struct Page {
+        SkylinePacker packer;
+        std::vector<uint8_t> pixels;
+        int usedWidth;
+    };
+
+    int pageSize_;
+    int padding_;
+    int bytesPerPixel_;
+    std::vector<Page> pages_;
+};
+
+// Where a sprite's data lives, gathered by the index pass of Load() before anything is decoded
+struct SpriteIndexEntry {
+    uint32_t headerOffset;  // Sprite header (v1 subheader) position
+    uint32_t dataOffset;    // v2: absolute data offset, v1: next subheader offset
+    uint32_t dataSize;      // 0 for linked sprites
+    uint16_t link;          // Index of the sprite this one reuses when dataSize is 0
+    uint8_t pngColorType;   // From the IHDR of PNG sprites, 0 otherwise
+    uint8_t pngBitDepth;
+    uint16_t width;         // Decoded size before trimming, so evicted sprites can be decoded again
+    uint16_t height;
+    uint64_t headerHash;    // Fields of the sprite header that shape the decoded sprite, for Reload()
+    uint64_t payloadHash;   // Raw sprite data, only kept when change tracking is on
+
+    SpriteIndexEntry() : headerOffset(0), dataOffset(0), dataSize(0), link(0), pngColorType(0), pngBitDepth(0),
+                         width(0), height(0), headerHash(0), payloadHash(0) {}
+};
+
+// Identifies decoded sprite pixels by content, so byte-identical images stored as
+// separate sprites can share one texture
+struct SpriteImageKey {
+    uint64_t hash;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bytesPerPixel;
+
+    bool operator==(const SpriteImageKey& other) const {
+        return hash == other.hash && width == other.width && height == other.height &&
+               bytesPerPixel == other.bytesPerPixel;
+    }
+};
+
+struct SpriteImageKeyHash {
+    std::size_t operator()(const SpriteImageKey& key) const {
+        return static_cast<std::size_t>(key.hash ^ (static_cast<uint64_t>(key.width) << 32) ^
+                                        (static_cast<uint64_t>(key.height) << 16) ^ key.bytesPerPixel);
+    }
+};
+
+// Sprite indices by (group, number), the way MUGEN content addresses sprites. Open addressing
+// with linear probing over the packed Group << 16 | Number key, kept at most half full so
+// lookups touch one or two slots. Built once per Load(); the first sprite wins on duplicates.
+class SpriteLookup {
+public:
+    SpriteLookup() : shift_(32) {}
+
+    // Returns the number of sprites whose (group, number) was already taken
+    size_t Build(const std::vector<Sprite>& sprites);
+    void Clear();
+
+    // Index into the sprite vector, -1 if there is no such sprite
+    int Find(uint16_t group, uint16_t number) const {
+        if (slots_.empty()) {
+            return -1;
+        }
+        uint32_t key = MakeKey(group, number);
+        for (size_t slot = Slot(key); ; slot = (slot + 1) & (slots_.size() - 1)) {
+            if (slots_[slot].index < 0 || slots_[slot].key == key) {
+                return slots_[slot].index;
+            }
+        }
     }
+
+    // Indices of the sprites in group, in number order
+    std::pair<const uint32_t*, const uint32_t*> FindGroup(uint16_t group) const;
+
+    static uint32_t MakeKey(uint16_t group, uint16_t number) {
+        return (static_cast<uint32_t>(group) << 16) | number;
+    }
+
+private:
+    struct Entry {
+        uint32_t key;
+        int32_t index;  // -1 for an empty slot
+    };
+
+    // Fibonacci hashing, the top bits of key * 2^32 / phi
+    size_t Slot(uint32_t key) const {
+        return static_cast<size_t>((key * 2654435769u) >> shift_);
+    }
+
+    std::vector<Entry> slots_;
+    std::vector<uint32_t> sorted_;  // Unique sprite indices ordered by key, for group ranges
+    std::vector<uint32_t> sortedKeys_;
+    int shift_;
+};
+
+// The sprites of one group in number order, from SffFile::GetSpriteGroup()
+class SpriteGroupRange {
+public:
+    class iterator {
+    public:
+        iterator(const Sprite* sprites, const uint32_t* index) : sprites_(sprites), index_(index) {}
+        const Sprite& operator*() const { return sprites_[*index_]; }
+        const Sprite* operator->() const { return &sprites_[*index_]; }
+        iterator& operator++() { ++index_; return *this; }
+        bool operator==(const iterator& other) const { return index_ == other.index_; }
+        bool operator!=(const iterator& other) const { return index_ != other.index_; }
+        // Position of the sprite in SffFile::GetSprites()
+        uint32_t GetIndex() const { return *index_; }
+
+    private:
+        const Sprite* sprites_;
+        const uint32_t* index_;
+    };
+
+    SpriteGroupRange(const Sprite* sprites, const uint32_t* first, const uint32_t* last)
+        : sprites_(sprites), first_(first), last_(last) {}
+
+    iterator begin() const { return iterator(sprites_, first_); }
+    iterator end() const { return iterator(sprites_, last_); }
+    size_t size() const { return static_cast<size_t>(last_ - first_); }
+    bool empty() const { return first_ == last_; }
+
+private:
+    const Sprite* sprites_;
+    const uint32_t* first_;
+    const uint32_t* last_;
 };
 
 class SffFile {
@@ -152,23 +682,127 @@ private:
     std::string filename_;
     SffHeader header_;
     std::vector<Sprite> sprites_;
+    std::vector<SpriteIndexEntry> index_;
+    SpriteLookup lookup_;
     std::vector<Palette> palettes_;
+    std::shared_ptr<PaletteAtlas> paletteAtlas_;
+    std::vector<TextureHandle> atlasPages_;
+    std::vector<TextureHandle> ownedTextures_;  // Textures this file uploaded, for VRAM accounting
     std::map<int, int> palette_usage_;
+    std::unordered_map<int, int> paletteByRow_;  // Palette atlas row -> first palettes_ entry using it
     std::map<int, int> compression_format_usage_;
     size_t numLinkedSprites_;
+    SffLoadLimits limits_;
+    uint64_t fileSize_;
+    size_t decodedBytes_;
+    size_t trimmedBytes_;
+    size_t dedupedBytes_;
+    size_t numDedupedSprites_;
+    size_t numSharedPalettes_;
+    size_t sharedBytes_;
+    bool premultiplyAlpha_;
+    bool trimBorders_;
+    bool dedupImages_;
+    bool deferDecode_;
+    bool decodeDeferred_;  // The last Load() deferred decoding, offsets are still untrimmed
+    bool trackChanges_;
+    bool ownsPaletteAtlas_;
+    int atlasPageSize_;
+    std::vector<uint64_t> paletteHashes_;  // Colours of every palettes_ entry, for Reload()
+    struct PendingUpload;
+    std::unique_ptr<PendingUpload> pending_;  // Between Decode() and Upload()
 
 public:
-    SffFile() : numLinkedSprites_(0) {}
+    SffFile() : numLinkedSprites_(0), fileSize_(0), decodedBytes_(0), trimmedBytes_(0), dedupedBytes_(0),
+                numDedupedSprites_(0), numSharedPalettes_(0), sharedBytes_(0), premultiplyAlpha_(false), trimBorders_(false), dedupImages_(true),
+                deferDecode_(false), decodeDeferred_(false), trackChanges_(false), ownsPaletteAtlas_(false), atlasPageSize_(2048) {}
     ~SffFile() { Clear(); }
 
     bool Load(const std::string& filename);
     void Clear();
 
+    // Load() in two halves for a file that holds no textures yet (new or Clear()ed). Decode()
+    // reads and decodes the file on the CPU without touching GL or the VRAM budget, so files
+    // can decode on worker threads (one thread per SffFile). Upload() then creates the
+    // textures on the thread owning the GL context.
+    bool Decode(const std::string& filename);
+    bool Upload();
+
+    // Reads the file again after it changed on disk. When only sprite pixels or palette
+    // colours changed, just those are decoded and uploaded into the textures and palette
+    // rows already in use, so sprites, handles and atlas rectangles stay valid. Anything
+    // else (sprites added, moved, resized or renamed, SFF v1) takes a full Load(), after
+    // which pointers to sprites must be looked up again. Needs SetTrackChanges(true).
+    SffReloadResult Reload();
+    const std::string& GetFilename() const { return filename_; }
+
     // Return const references to allow access without modification
     const std::vector<Sprite>& GetSprites() const { return sprites_; }
     const std::vector<Palette>& GetPalettes() const { return palettes_; }
+    const std::vector<SpriteIndexEntry>& GetSpriteIndex() const { return index_; }
     const SffHeader& GetHeader() const { return header_; }
     size_t GetLinkedSpriteCount() const { return numLinkedSprites_; }
+    size_t GetDecodedBytes() const { return decodedBytes_; }
+    size_t GetTrimmedBytes() const { return trimmedBytes_; }
+    size_t GetDedupedBytes() const { return dedupedBytes_; }
+    size_t GetDedupedSpriteCount() const { return numDedupedSprites_; }
+    size_t GetSharedPaletteCount() const { return numSharedPalettes_; }
+
+    // Resident texture bytes this file uploaded, by category. Textures shared with other files
+    // count for the file that uploaded them; VramBudget::Instance().GetUsage() has the totals.
+    VramUsage GetVramUsage() const;
+
+    // Limits take effect on the next Load()
+    void SetLoadLimits(const SffLoadLimits& limits) { limits_ = limits; }
+    const SffLoadLimits& GetLoadLimits() const { return limits_; }
+
+    // Premultiply RGBA sprites by alpha while decoding (takes effect on the next Load())
+    void SetPremultiplyAlpha(bool enable) { premultiplyAlpha_ = enable; }
+
+    // Crop fully transparent margins off decoded sprites. Size becomes the cropped size and
+    // Offset moves with it, so sprites drawn by their axis look the same (next Load())
+    void SetTrimTransparentBorders(bool enable) { trimBorders_ = enable; }
+
+    // Share one texture between sprites whose decoded pixels are identical, on by default
+    // (takes effect on the next Load())
+    void SetDeduplicateImages(bool enable) { dedupImages_ = enable; }
+
+    // Only read the sprite index and palettes, sprites get no texture and are decoded on demand
+    // with DecodeSpritePixels(). SFF v1 keeps its palettes in the sprite data, so v1 files
+    // are still decoded completely (takes effect on the next Load())
+    void SetDeferDecode(bool enable) { deferDecode_ = enable; }
+
+    // Keeps a hash of every sprite's data so Reload() can tell which sprites changed, and
+    // leaves spare rows in the file's own palette atlas for changed palettes. Costs one
+    // extra read of the file (takes effect on the next Load())
+    void SetTrackChanges(bool enable) { trackChanges_ = enable; }
+
+    // Decodes one sprite on the CPU without uploading it: a palette index per pixel for
+    // paletted sprites, RGBA otherwise. width and height receive the decoded size, which is
+    // the trimmed size when trimming is on, offsetX and offsetY the axis within the decoded
+    // pixels (a deferred load leaves Sprite::Offset untrimmed). Linked sprites decode the
+    // sprite they link to.
+    std::unique_ptr<uint8_t[]> DecodeSpritePixels(uint32_t index, int& width, int& height, int& offsetX, int& offsetY);
+
+    // Size of the square atlas pages sprites are packed into, index planes and RGBA sprites
+    // on separate pages. 0 gives every sprite its own texture (takes effect on the next Load())
+    void SetAtlasPageSize(int size) { atlasPageSize_ = size; }
+    const std::vector<TextureHandle>& GetAtlasPages() const { return atlasPages_; }
+
+    // Palettes are stored as rows of one atlas texture. By default each Load() creates
+    // its own; pass a shared atlas before loading to put several files' palettes together.
+    // A shared atlas never grows once its texture exists, so it needs an explicit capacity
+    // covering every file's palettes: PaletteAtlas(0) is refused and false returned.
+    bool SetPaletteAtlas(const std::shared_ptr<PaletteAtlas>& atlas) {
+        if (atlas && atlas->GetCapacity() == 0) {
+            fprintf(stderr, "Error: a shared palette atlas needs a capacity\n");
+            return false;
+        }
+        paletteAtlas_ = atlas;
+        ownsPaletteAtlas_ = false;
+        return true;
+    }
+    const std::shared_ptr<PaletteAtlas>& GetPaletteAtlas() const { return paletteAtlas_; }
 
     // Non-const accessors for when modification is needed
     std::vector<Sprite>& GetSprites() { return sprites_; }
@@ -182,6 +816,26 @@ public:
         return (index < sprites_.size()) ? &sprites_[index] : nullptr;
     }
 
+    // Sprite by MUGEN group and number, nullptr if the file has none
+    const Sprite* GetSprite(uint16_t group, uint16_t number) const {
+        int index = lookup_.Find(group, number);
+        return index >= 0 ? &sprites_[index] : nullptr;
+    }
+
+    Sprite* GetSprite(uint16_t group, uint16_t number) {
+        int index = lookup_.Find(group, number);
+        return index >= 0 ? &sprites_[index] : nullptr;
+    }
+
+    // Index of the sprite in GetSprites(), -1 if the file has none
+    int FindSprite(uint16_t group, uint16_t number) const { return lookup_.Find(group, number); }
+
+    // All sprites of group in number order, empty if the group doesn't exist
+    SpriteGroupRange GetSpriteGroup(uint16_t group) const {
+        std::pair<const uint32_t*, const uint32_t*> range = lookup_.FindGroup(group);
+        return SpriteGroupRange(sprites_.data(), range.first, range.second);
+    }
+
     const Palette* GetPalette(size_t index) const {
         return (index < palettes_.size()) ? &palettes_[index] : nullptr;
     }
@@ -200,15 +854,33 @@ private:
     std::unique_ptr<uint8_t[]> ReadSpriteDataV2(Sprite& sprite, FILE* file, uint64_t offset, uint32_t datasize);
 
     bool ReadPcxHeader(Sprite& sprite, FILE* file, uint64_t offset);
+    bool ScanPngHeader(Sprite& sprite, FILE* file, SpriteIndexEntry& entry);
+
+    bool CheckPayload(uint64_t offset, size_t length) const;
+    bool ReserveDecodedBytes(const Sprite& s, size_t pixels, size_t bytesPerPixel);
 
     std::unique_ptr<uint8_t[]> RlePcxDecode(const Sprite& s, const uint8_t* srcPx, size_t srcLen);
     std::unique_ptr<uint8_t[]> Rle8Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen);
     std::unique_ptr<uint8_t[]> Rle5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen);
     std::unique_ptr<uint8_t[]> Lz5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen);
     std::unique_ptr<uint8_t[]> PngDecode(Sprite& s, const uint8_t* srcPx, size_t srcLen);
-
-    Texture2D GeneratePaletteTexture(const std::array<uint32_t, 256>& pal_rgba);
-    Texture2D GeneratePaletteTexture(const std::array<RGB, 256>& pal_rgb);
+    std::unique_ptr<uint8_t[]> TrimTransparentBorders(Sprite& s, std::unique_ptr<uint8_t[]> px);
+
+    std::unique_ptr<uint8_t[]> DecodeSprite(Sprite& sprite, FILE* file, SpriteIndexEntry& entry, Sprite* prev);
+    std::unique_ptr<uint8_t[]> DecodeSpriteCopy(FILE* file, uint32_t index, Sprite& scratch);
+    std::unique_ptr<uint8_t[]> RedecodeSprite(FILE* file, uint32_t index);
+    bool HashPayload(FILE* file, SpriteIndexEntry& entry, std::vector<uint8_t>& buffer);
+    SffReloadResult ReloadChanged(FILE* file, const char*& fullReason);
+    SffReloadResult ReloadFull(const char* reason);
+    void Swap(SffFile& other);
+    void BindReloaders();
+    bool ReloadSpriteTexture(uint32_t index, Texture2D& texture);
+    bool ReloadAtlasPage(int page, Texture2D& texture);
+    void ReleaseOwnedTextures();
+
+    int AddPalette(const std::array<uint8_t, 256 * 4>& pal_byte, bool reuseEntry);
+    std::array<uint8_t, 256 * 4> ConvertPalette(const std::array<uint32_t, 256>& pal_rgba);
+    std::array<uint8_t, 256 * 4> ConvertPalette(const std::array<RGB, 256>& pal_rgb);
 
     // Helper functions for reading integers with proper endianness
     uint16_t ReadU16LE(FILE* file) {
@@ -238,356 +910,1349 @@ private:
     }
 };
 
-// Implementation of SffFile methods
-bool SffFile::Load(const std::string& filename) {
-    FILE* file = fopen(filename.c_str(), "rb");
-    if (!file) {
-        printf("Error: cannot open file %s\n", filename.c_str());
-        return false;
+// Implementation of SpriteLookup methods
+size_t SpriteLookup::Build(const std::vector<Sprite>& sprites) {
+    Clear();
+    if (sprites.empty()) {
+        return 0;
     }
 
-    filename_ = filename;
-    printf("Open file %s\n", filename.c_str());
+    size_t capacity = 2;
+    shift_ = 31;
+    while (capacity < sprites.size() * 2) {
+        capacity *= 2;
+        shift_--;
+    }
+    slots_.assign(capacity, Entry{0, -1});
+
+    size_t numDuplicates = 0;
+    sorted_.reserve(sprites.size());
+    for (size_t i = 0; i < sprites.size(); i++) {
+        uint32_t key = MakeKey(sprites[i].Group, sprites[i].Number);
+        size_t slot = Slot(key);
+        while (slots_[slot].index >= 0 && slots_[slot].key != key) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (slots_[slot].index >= 0) {
+            numDuplicates++;
+            continue;
+        }
+        slots_[slot] = Entry{key, static_cast<int32_t>(i)};
+        sorted_.push_back(static_cast<uint32_t>(i));
+    }
 
-    uint32_t lofs, tofs;
-    if (!ReadHeader(file, lofs, tofs)) {
-        printf("Error: reading header %s\n", filename.c_str());
-        fclose(file);
-        return false;
+    std::sort(sorted_.begin(), sorted_.end(), [&sprites](uint32_t a, uint32_t b) {
+        return MakeKey(sprites[a].Group, sprites[a].Number) < MakeKey(sprites[b].Group, sprites[b].Number);
+    });
+    sortedKeys_.reserve(sorted_.size());
+    for (uint32_t index : sorted_) {
+        sortedKeys_.push_back(MakeKey(sprites[index].Group, sprites[index].Number));
     }
+    return numDuplicates;
+}
 
-    // Load palettes for SFF v2
-    if (header_.Ver0 != 1) {
-        // std::map<std::array<int, 2>, int> uniquePals;
-		std::unordered_map<std::array<int, 2>, int, ArrayHash> uniquePals;
-        palettes_.clear();
-        palettes_.reserve(header_.NumberOfPalettes);
+void SpriteLookup::Clear() {
+    slots_.clear();
+    sorted_.clear();
+    sortedKeys_.clear();
+    shift_ = 32;
+}
 
-        for (uint32_t i = 0; i < header_.NumberOfPalettes; i++) {
-            fseek(file, header_.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
+std::pair<const uint32_t*, const uint32_t*> SpriteLookup::FindGroup(uint16_t group) const {
+    auto first = std::lower_bound(sortedKeys_.begin(), sortedKeys_.end(), MakeKey(group, 0));
+    auto last = std::upper_bound(first, sortedKeys_.end(), MakeKey(group, 0xFFFF));
+    const uint32_t* base = sorted_.data();
+    return std::make_pair(base + (first - sortedKeys_.begin()), base + (last - sortedKeys_.begin()));
+}
 
-            std::array<int16_t, 3> gn;
-            gn[0] = ReadU16LE(file); // group
-            gn[1] = ReadU16LE(file); // number
-            gn[2] = ReadU16LE(file); // colnumber
+// Implementation of VramBudget methods
+VramBudget& VramBudget::Instance() {
+    static VramBudget budget;
+    return budget;
+}
 
-            uint16_t link = ReadU16LE(file); (void)link;
-            uint32_t ofs = ReadU32LE(file);
-            uint32_t siz = ReadU32LE(file); (void) siz;
- 
-            /*std::array<int, 2> key = { gn[0], gn[1] };
-            if (uniquePals.find(key) == uniquePals.end()) {
-                fseek(file, lofs + ofs, SEEK_SET);
-                std::array<uint32_t, 256> rgba;
-                if (fread(rgba.data(), sizeof(uint32_t), 256, file) != 256) {
-                    printf("Failed to read palette data: %s", filename.c_str());
-                    fclose(file);
-                    return false;
-                }
-                palettes_.emplace_back(GeneratePaletteTexture(rgba));
-                uniquePals[key] = i;
-            } else {
-                printf("Palette %d(%d,%d) is not unique, using palette %d\n",
-                       i, gn[0], gn[1], uniquePals[key]);
-                palettes_.emplace_back(palettes_[uniquePals[key]].texture);
-            }*/
+void VramBudget::SetLimit(size_t bytes, VramBudgetPolicy policy) {
+    limit_ = bytes;
+    policy_ = policy;
+}
 
-			// Optimized using unordered_map (faster)
-			std::array<int, 2> key = { gn[0], gn[1] };
-			auto it = uniquePals.find(key);
-			if (it == uniquePals.end()) {
-				fseek(file, lofs + ofs, SEEK_SET);
-				std::array<uint32_t, 256> rgba;
-				if (fread(rgba.data(), sizeof(uint32_t), 256, file) != 256) {
-					printf("Failed to read palette data: %s\n", filename.c_str());
-					fclose(file);
-					return false;
-				}
-				palettes_.emplace_back(GeneratePaletteTexture(rgba));
-				uniquePals[key] = static_cast<int>(palettes_.size() - 1);
-			} else {
-				printf("Palette %d(%d,%d) is not unique, using palette %d\n",
-					   i, gn[0], gn[1], it->second);
-				palettes_.emplace_back(palettes_[it->second].texture);
-			}
+bool VramBudget::Reserve(size_t bytes) {
+    if (limit_ == 0) {
+        return true;
+    }
+    while (usage_.Total() + bytes > limit_) {
+        if (policy_ != VRAM_BUDGET_EVICT) {
+            return false;
+        }
 
+        // Least recently drawn resident texture that was not drawn this frame
+        TextureRecord* victim = nullptr;
+        for (TextureRecord* r = evictable_; r != nullptr; r = r->next) {
+            if (r->texture.id != 0 && r->lastUsed < frame_ && (!victim || r->lastUsed < victim->lastUsed)) {
+                victim = r;
+            }
+        }
+        if (!victim) {
+            return false;
         }
+        Evict(victim);
     }
+    return true;
+}
 
-    // Load sprites
-    sprites_.clear();
-    sprites_.resize(header_.NumberOfSprites);
-    Sprite* prev = nullptr;
-    numLinkedSprites_ = 0;
+void VramBudget::OnCreate(TextureRecord* record) {
+    const Texture2D& t = record->texture;
+    record->bytes = static_cast<size_t>(GetPixelDataSize(t.width, t.height, t.format));
+    record->lastUsed = frame_;
+    usage_.bytes[record->category] += record->bytes;
+}
 
-    long shofs = header_.FirstSpriteHeaderOffset;
-    for (uint32_t i = 0; i < header_.NumberOfSprites; i++) {
-        uint32_t xofs, size;
-        uint16_t indexOfPrevious;
+void VramBudget::OnRelease(TextureRecord* record) {
+    SetReloader(record, nullptr);
+    if (record->texture.id != 0) {
+        UnloadTexture(record->texture);
+        usage_.bytes[record->category] -= record->bytes;
+    }
+}
 
-        fseek(file, shofs, SEEK_SET);
-        bool success = false;
+bool VramBudget::OnUse(TextureRecord* record) {
+    record->lastUsed = frame_;
+    if (record->texture.id != 0) {
+        return true;
+    }
+    if (!record->reloader || !Reserve(record->bytes) || !record->reloader(record->texture)) {
+        return false;
+    }
+    usage_.bytes[record->category] += record->bytes;
+    return true;
+}
 
-        switch (header_.Ver0) {
-            case 1:
-                success = ReadSpriteHeaderV1(sprites_[i], file, xofs, size, indexOfPrevious);
-                break;
-            case 2:
-                success = ReadSpriteHeaderV2(sprites_[i], file, xofs, size, lofs, tofs, indexOfPrevious);
-                break;
-            default:
-                printf("Unsupported SFF version: %d\n", header_.Ver0);
-                fclose(file);
-                return false;
-        }
+void VramBudget::SetReloader(TextureRecord* record, std::function<bool(Texture2D&)> reloader) {
+    bool listed = static_cast<bool>(record->reloader);
+    record->reloader = std::move(reloader);
+
+    if (record->reloader && !listed) {
+        record->prev = nullptr;
+        record->next = evictable_;
+        if (evictable_) evictable_->prev = record;
+        evictable_ = record;
+    } else if (!record->reloader && listed) {
+        if (record->prev) record->prev->next = record->next;
+        else evictable_ = record->next;
+        if (record->next) record->next->prev = record->prev;
+        record->prev = record->next = nullptr;
+    }
+}
 
-        if (!success) {
-            fclose(file);
-            return false;
-        }
+void VramBudget::Evict(TextureRecord* record) {
+    UnloadTexture(record->texture);
+    record->texture.id = 0;
+    usage_.bytes[record->category] -= record->bytes;
+    evictions_++;
+}
 
-        if (size == 0) {
-            numLinkedSprites_++;
-            if (indexOfPrevious < i) {
-                printf("Info: Sprite[%d] use prev Sprite[%d]\n", i, indexOfPrevious);
-                sprites_[i].CopyFrom(sprites_[indexOfPrevious]);
-            } else {
-                printf("Warning: Sprite %d has no size\n", i);
-                sprites_[i].palidx = 0;
-            }
-        } else {
-            std::unique_ptr<uint8_t[]> data;
-            bool character = true; // This should be determined properly
+// MurmurHash64A (Austin Appleby, public domain), a fast general-purpose 64-bit content hash.
+// Not cryptographic: where sharing data depends on a match, compare the bytes as well
+static uint64_t HashBytes64(const uint8_t* data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+
+    size_t blocks = len / 8;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k;
+        memcpy(&k, data + i * 8, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
 
-            switch (header_.Ver0) {
-                case 1:
-                    data = ReadSpriteDataV1(sprites_[i], file, shofs + 32, size, xofs, prev, character);
-                    break;
-                case 2:
-                    data = ReadSpriteDataV2(sprites_[i], file, xofs, size);
-                    break;
-            }
+    const uint8_t* tail = data + blocks * 8;
+    switch (len & 7) {
+        case 7: h ^= static_cast<uint64_t>(tail[6]) << 48; // fall through
+        case 6: h ^= static_cast<uint64_t>(tail[5]) << 40; // fall through
+        case 5: h ^= static_cast<uint64_t>(tail[4]) << 32; // fall through
+        case 4: h ^= static_cast<uint64_t>(tail[3]) << 24; // fall through
+        case 3: h ^= static_cast<uint64_t>(tail[2]) << 16; // fall through
+        case 2: h ^= static_cast<uint64_t>(tail[1]) << 8;  // fall through
+        case 1: h ^= static_cast<uint64_t>(tail[0]);
+                h *= m;
+    }
 
-            if (!data) {
-                printf("Error reading SFFv%d sprite data for sprite %d\n", header_.Ver0, i);
-                fclose(file);
-                return false;
-            }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
 
-            // Update usage statistics
-            if (sprites_[i].IsPaletted()) {
-                palette_usage_[sprites_[i].palidx]++;
-            }
-            compression_format_usage_[sprites_[i].rle]++;
+// Implementation of PaletteAtlas methods
+int PaletteAtlas::AddRow(const uint8_t* rgba) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AddRowLocked(rgba);
+}
 
-            // Create texture
-            int format = sprites_[i].IsRGBA() ?
-                PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 : PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
-
-            sprites_[i].texture.id = rlLoadTexture(data.get(), sprites_[i].Size[0],
-                                                 sprites_[i].Size[1], format, 1);
-            sprites_[i].texture.width = sprites_[i].Size[0];
-            sprites_[i].texture.height = sprites_[i].Size[1];
-            sprites_[i].texture.mipmaps = 1;
-            sprites_[i].texture.format = format;
-			
-			if (sprites_[i].IsPaletted()) {
-				// No filtering — perfect for pixel art. Keeps hard edges and crisp pixels.
-				SetTextureFilter(sprites_[i].texture, TEXTURE_FILTER_POINT);
-			}
+int PaletteAtlas::AddRowLocked(const uint8_t* rgba) {
+    if (!texture_) {
+        pixels_.insert(pixels_.end(), rgba, rgba + 256 * 4);
+    } else if (rows_ < capacity_) {
+        // Capacity is fixed once the texture exists, the staging buffer already covers it
+        memcpy(pixels_.data() + static_cast<size_t>(rows_) * 256 * 4, rgba, 256 * 4);
+    } else {
+        return -1;
+    }
+    return rows_++;
+}
 
-            // Update previous sprite reference
-            if (sprites_[i].Group == 9000) {
-                if (sprites_[i].Number == 0) {
-                    prev = &sprites_[i];
-                }
-            } else {
-                prev = &sprites_[i];
-            }
+int PaletteAtlas::FindOrAddRow(const uint8_t* rgba, bool* added) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (added) {
+        *added = false;
+    }
+    uint64_t hash = HashBytes64(rgba, 256 * 4, 0);
+    std::vector<int>& rows = rowsByHash_[hash];
+    for (int row : rows) {
+        if (memcmp(pixels_.data() + static_cast<size_t>(row) * 256 * 4, rgba, 256 * 4) == 0) {
+            return row;
         }
+    }
 
-        // Update next header offset
-        if (header_.Ver0 == 1) {
-            shofs = xofs;
-        } else {
-            shofs += 28;
+    int row = AddRowLocked(rgba);
+    if (row >= 0) {
+        rows.push_back(row);
+        if (added) {
+            *added = true;
         }
     }
+    return row;
+}
 
-    // Update palette count for SFF v1
-    if (header_.Ver0 == 1) {
-        header_.NumberOfPalettes = palettes_.size();
+void PaletteAtlas::Commit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!texture_) {
+        if (capacity_ < rows_) {
+            capacity_ = rows_;
+        }
+        if (capacity_ == 0) {
+            return;
+        }
+        pixels_.resize(static_cast<size_t>(capacity_) * 256 * 4, 0);
+
+        Texture2D texture = {};
+        texture.id = rlLoadTexture(pixels_.data(), 256, capacity_, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, 1);
+        texture.width = 256;
+        texture.height = capacity_;
+        texture.mipmaps = 1;
+        texture.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+
+        // CRITICAL: Set palette texture to NEAREST filtering
+        rlTextureParameters(texture.id, RL_TEXTURE_MIN_FILTER, RL_TEXTURE_FILTER_NEAREST);
+        rlTextureParameters(texture.id, RL_TEXTURE_MAG_FILTER, RL_TEXTURE_FILTER_NEAREST);
+        rlTextureParameters(texture.id, RL_TEXTURE_WRAP_S, RL_TEXTURE_WRAP_CLAMP);
+        rlTextureParameters(texture.id, RL_TEXTURE_WRAP_T, RL_TEXTURE_WRAP_CLAMP);
+        texture_ = TextureHandle(texture, VRAM_PALETTES);
+    } else if (dirtyFrom_ < rows_) {
+        rlUpdateTexture(texture_->id, 0, dirtyFrom_, 256, rows_ - dirtyFrom_, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+                        pixels_.data() + static_cast<size_t>(dirtyFrom_) * 256 * 4);
     }
+    dirtyFrom_ = rows_;
+}
 
-    fclose(file);
-    return true;
+// Implementation of the PNG scratch arena
+void* PngScratchArena::Alloc(size_t size) {
+    size_t need = kHeaderSize + AlignUp(size);
+    if (blocks_.empty() || blocks_.back().used + need > blocks_.back().capacity) {
+        size_t capacity = blocks_.empty() ? kMinBlockSize : blocks_.back().capacity * 2;
+        if (capacity < need) {
+            capacity = need;
+        }
+        uint8_t* base = static_cast<uint8_t*>(malloc(capacity));
+        if (!base) {
+            return nullptr;
+        }
+        blocks_.push_back({base, capacity, 0});
+    }
+
+    Block& block = blocks_.back();
+    uint8_t* header = block.base + block.used;
+    *reinterpret_cast<size_t*>(header) = size;
+    block.used += need;
+    return header + kHeaderSize;
 }
 
-void SffFile::Clear() {
-    std::map<unsigned int, bool> unloadedIds;
+void* PngScratchArena::Realloc(void* ptr, size_t newSize) {
+    if (!ptr) {
+        return Alloc(newSize);
+    }
 
-    for (auto& palette : palettes_) {
-        if (palette.texture.id != 0 && !unloadedIds[palette.texture.id]) {
-            UnloadTexture(palette.texture);
-            unloadedIds[palette.texture.id] = true;
+    uint8_t* header = static_cast<uint8_t*>(ptr) - kHeaderSize;
+    size_t oldSize = *reinterpret_cast<size_t*>(header);
+
+    // Grow in place when ptr is the most recent allocation (the ucvector pattern lodepng uses)
+    Block& block = blocks_.back();
+    if (header >= block.base && header + kHeaderSize + AlignUp(oldSize) == block.base + block.used) {
+        size_t start = static_cast<size_t>(header - block.base);
+        if (start + kHeaderSize + AlignUp(newSize) <= block.capacity) {
+            block.used = start + kHeaderSize + AlignUp(newSize);
+            *reinterpret_cast<size_t*>(header) = newSize;
+            return ptr;
         }
     }
 
-    for (auto& sprite : sprites_) {
-        if (sprite.texture.id != 0 && !unloadedIds[sprite.texture.id]) {
-            UnloadTexture(sprite.texture);
-            unloadedIds[sprite.texture.id] = true;
+    void* moved = Alloc(newSize);
+    if (moved) {
+        memcpy(moved, ptr, std::min(oldSize, newSize));
+    }
+    return moved;
+}
+
+bool PngScratchArena::Owns(const void* ptr) const {
+    const uint8_t* p = static_cast<const uint8_t*>(ptr);
+    for (const Block& block : blocks_) {
+        if (p >= block.base && p < block.base + block.capacity) {
+            return true;
         }
     }
+    return false;
+}
 
-    sprites_.clear();
-    palettes_.clear();
-    palette_usage_.clear();
-    compression_format_usage_.clear();
-    numLinkedSprites_ = 0;
+void PngScratchArena::Reset() {
+    // Coalesce into a single block sized for the largest sprite seen so far
+    if (blocks_.size() > 1) {
+        size_t total = 0;
+        for (const Block& block : blocks_) {
+            total += block.capacity;
+        }
+        Release();
+        if (total <= kMaxRetainedSize) {
+            uint8_t* base = static_cast<uint8_t*>(malloc(total));
+            if (base) {
+                blocks_.push_back({base, total, 0});
+            }
+        }
+    } else if (!blocks_.empty() && blocks_[0].capacity > kMaxRetainedSize) {
+        Release();
+    }
+
+    for (Block& block : blocks_) {
+        block.used = 0;
+    }
 }
 
-bool SffFile::ReadHeader(FILE* file, uint32_t& lofs, uint32_t& tofs) {
-    // Validate header by comparing 12 first bytes with "ElecbyteSpr\x0"
-    char headerCheck[12];
-    if (fread(headerCheck, 12, 1, file) != 1) {
-        fprintf(stderr, "Error reading header check\n");
-        return false;
+void PngScratchArena::Release() {
+    for (Block& block : blocks_) {
+        free(block.base);
     }
+    blocks_.clear();
+}
 
-    if (memcmp(headerCheck, "ElecbyteSpr\0", 12) != 0) {
-        fprintf(stderr, "Invalid SFF file [%s]\n", headerCheck);
-        return false;
+// Context of the calling thread, if it has one. Consulted by the lodepng allocator hooks.
+static thread_local PngDecoderContext* t_pngContext = nullptr;
+
+void* lodepng_malloc(size_t size) {
+    PngDecoderContext* ctx = t_pngContext;
+    if (ctx && ctx->IsActive()) {
+        return ctx->Alloc(size);
     }
+    return malloc(size);
+}
 
-    // Read versions in the header
-    if (fread(&header_.Ver3, 1, 1, file) != 1) {
-        fprintf(stderr, "Error reading version\n");
-        return false;
+void* lodepng_realloc(void* ptr, size_t new_size) {
+    PngDecoderContext* ctx = t_pngContext;
+    if (ctx && ctx->IsActive() && (!ptr || ctx->Owns(ptr))) {
+        return ctx->Realloc(ptr, new_size);
     }
-    if (fread(&header_.Ver2, 1, 1, file) != 1) {
-        fprintf(stderr, "Error reading version\n");
-        return false;
+    return realloc(ptr, new_size);
+}
+
+void lodepng_free(void* ptr) {
+    PngDecoderContext* ctx = t_pngContext;
+    if (ctx && ctx->Owns(ptr)) {
+        return; // Reclaimed by the next arena Reset()
     }
-    if (fread(&header_.Ver1, 1, 1, file) != 1) {
-        fprintf(stderr, "Error reading version\n");
+    free(ptr);
+}
+
+// Implementation of PngDecoderContext methods
+PngDecoderContext& PngDecoderContext::ForThisThread() {
+    static thread_local PngDecoderContext context;
+    return context;
+}
+
+PngDecoderContext::PngDecoderContext() : active_(false) {
+    lodepng_state_init(&state_);
+    t_pngContext = this;
+}
+
+PngDecoderContext::~PngDecoderContext() {
+    lodepng_state_cleanup(&state_);
+    t_pngContext = nullptr;
+}
+
+void PngDecoderContext::ResetState() {
+    // Palette buffers of the previous image point into the arena, so drop them before rewinding it
+    lodepng_state_cleanup(&state_);
+    lodepng_state_init(&state_);
+    state_.decoder.color_convert = 0;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    state_.decoder.read_text_chunks = 0;
+    state_.decoder.remember_unknown_chunks = 0;
+#endif
+    arena_.Reset();
+}
+
+bool PngDecoderContext::ReadHeader(const uint8_t* data, size_t size, PngHeaderInfo& info) {
+    static const uint8_t kSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 33 || memcmp(data, kSignature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
         return false;
     }
-    if (fread(&header_.Ver0, 1, 1, file) != 1) {
-        fprintf(stderr, "Error reading version\n");
-        return false;
+    info.width = (static_cast<unsigned>(data[16]) << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+    info.height = (static_cast<unsigned>(data[20]) << 24) | (data[21] << 16) | (data[22] << 8) | data[23];
+    info.bitdepth = data[24];
+    info.colortype = data[25];
+    info.interlace = data[28];
+    return info.width != 0 && info.height != 0;
+}
+
+// Narrows big-endian 16-bit RGBA samples to 8 bits by keeping the high byte (what
+// lodepng_convert does), 16 samples per iteration on SSE2/NEON.
+static void NarrowRGBA16(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    size_t samples = pixels * 4;
+    size_t i = 0;
+#if defined(SFF_SIMD_SSE2)
+    const __m128i lowByte = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= samples; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2 + 16));
+        a = _mm_and_si128(a, lowByte);  // High byte of each sample sits first in memory
+        b = _mm_and_si128(b, lowByte);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b));
     }
+#elif defined(SFF_SIMD_NEON)
+    for (; i + 16 <= samples; i += 16) {
+        uint8x16x2_t v = vld2q_u8(src + i * 2);
+        vst1q_u8(dst + i, v.val[0]);
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i] = src[i * 2];
+    }
+}
 
-    uint32_t dummy;
-    if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
-        fprintf(stderr, "Error reading dummy\n");
-        return false;
+// Multiplies RGB by alpha with exact rounding, round(c * a / 255), 4 pixels per iteration on SSE2
+// and 8 on NEON.
+static void PremultiplyRGBA8(uint8_t* px, size_t pixels) {
+    size_t i = 0;
+#if defined(SFF_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgbMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alphaOne = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i bias = _mm_set1_epi16(128);
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px + i * 4));
+        __m128i half[2] = {_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)};
+        for (__m128i& h : half) {
+            __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(h, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            a = _mm_or_si128(_mm_and_si128(a, rgbMask), alphaOne);  // Alpha channel multiplies by 255/255
+            __m128i t = _mm_add_epi16(_mm_mullo_epi16(h, a), bias);
+            h = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px + i * 4), _mm_packus_epi16(half[0], half[1]));
+    }
+#elif defined(SFF_SIMD_NEON)
+    for (; i + 8 <= pixels; i += 8) {
+        uint8x8x4_t v = vld4_u8(px + i * 4);
+        for (int c = 0; c < 3; c++) {
+            uint16x8_t p = vmull_u8(v.val[c], v.val[3]);
+            v.val[c] = vrshrn_n_u16(vrsraq_n_u16(p, p, 8), 8);
+        }
+        vst4_u8(px + i * 4, v);
+    }
+#endif
+    for (; i < pixels; i++) {
+        uint8_t* p = px + i * 4;
+        for (int c = 0; c < 3; c++) {
+            unsigned t = p[c] * p[3] + 128;
+            p[c] = static_cast<uint8_t>((t + (t >> 8)) >> 8);
+        }
     }
+}
 
-    if (header_.Ver0 == 2) {
-        // Read additional header fields for version 2
-        for (int i = 0; i < 4; i++) {
-            if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
-                fprintf(stderr, "Error reading dummy\n");
-                return false;
+// ORs a row of pixels into acc and reports whether the row has a visible pixel: a non-zero
+// index (bpp 1) or non-zero alpha (bpp 4). 16 bytes per iteration on SSE2/NEON.
+static bool AccumulateRowCoverage(uint8_t* acc, const uint8_t* row, size_t bytes, int bpp) {
+    const uint32_t visibleMask = bpp == 4 ? 0xFF000000u : 0xFFFFFFFFu;  // Little-endian RGBA, alpha last
+    bool visible = false;
+    size_t i = 0;
+#if defined(SFF_SIMD_SSE2)
+    const __m128i mask = _mm_set1_epi32(static_cast<int>(visibleMask));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_or_si128(a, v));
+        visible |= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), zero)) != 0xFFFF;
+    }
+#elif defined(SFF_SIMD_NEON)
+    const uint8x16_t mask = vreinterpretq_u8_u32(vdupq_n_u32(visibleMask));
+    for (; i + 16 <= bytes; i += 16) {
+        uint8x16_t v = vld1q_u8(row + i);
+        vst1q_u8(acc + i, vorrq_u8(vld1q_u8(acc + i), v));
+        uint8x16_t m = vandq_u8(v, mask);
+        visible |= vget_lane_u64(vreinterpret_u64_u8(vorr_u8(vget_low_u8(m), vget_high_u8(m))), 0) != 0;
+    }
+#endif
+    for (; i < bytes; i++) {
+        acc[i] |= row[i];
+        visible |= (row[i] & (visibleMask >> ((i & 3) * 8))) != 0;
+    }
+    return visible;
+}
+
+// Tight bounding box of the visible pixels, false when the image is fully transparent
+static bool FindVisibleBounds(const uint8_t* px, int w, int h, int bpp, int& left, int& top, int& right, int& bottom) {
+    size_t rowBytes = static_cast<size_t>(w) * bpp;
+    std::vector<uint8_t> columns(rowBytes, 0);
+    top = -1;
+    bottom = -1;
+    for (int y = 0; y < h; y++) {
+        if (AccumulateRowCoverage(columns.data(), px + y * rowBytes, rowBytes, bpp)) {
+            if (top < 0) {
+                top = y;
             }
+            bottom = y;
         }
+    }
+    if (top < 0) {
+        return false;
+    }
 
-        // Read FirstSpriteHeaderOffset
-        if (fread(&header_.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
-            return false;
-        }
+    // Rows were ORed together, so a column is visible when its accumulated index/alpha is non-zero
+    left = 0;
+    while (columns[left * bpp + bpp - 1] == 0) {
+        left++;
+    }
+    right = w - 1;
+    while (columns[right * bpp + bpp - 1] == 0) {
+        right--;
+    }
+    return true;
+}
 
-        // Read NumberOfSprites
-        if (fread(&header_.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading NumberOfSprites\n");
-            return false;
+unsigned PngDecoderContext::Decode(const uint8_t* data, size_t size, LodePNGColorType colortype, size_t maxOutputSize,
+                                   bool premultiply, PngImage& image) {
+    ResetState();
+    state_.decoder.zlibsettings.max_output_size = maxOutputSize;
+    active_ = true;
+
+    unsigned char* native = nullptr;
+    unsigned width = 0, height = 0;
+    unsigned status = lodepng_decode(&native, &width, &height, &state_, data, size);
+
+    const LodePNGColorMode& in = state_.info_png.color;
+    LodePNGColorMode out;
+    lodepng_color_mode_init(&out);
+    out.colortype = colortype;
+    out.bitdepth = 8;
+
+    unsigned char* pixels = native;
+    if (status == 0 && (in.colortype != out.colortype || in.bitdepth != out.bitdepth)) {
+        unsigned char* converted = static_cast<unsigned char*>(Alloc(lodepng_get_raw_size(width, height, &out)));
+        if (!converted) {
+            status = 83; // alloc fail
+        } else if (in.colortype == LCT_RGBA && in.bitdepth == 16) {
+            NarrowRGBA16(converted, native, static_cast<size_t>(width) * height);
+            pixels = converted;
+        } else {
+            status = lodepng_convert(converted, native, &out, &in, width, height);
+            pixels = converted;
         }
+    }
 
-        // Read FirstPaletteHeaderOffset
-        if (fread(&header_.FirstPaletteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading FirstPaletteHeaderOffset\n");
-            return false;
-        }
+    if (status == 0 && premultiply && colortype == LCT_RGBA) {
+        PremultiplyRGBA8(pixels, static_cast<size_t>(width) * height);
+    }
 
-        // Read NumberOfPalettes
-        if (fread(&header_.NumberOfPalettes, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading NumberOfPalettes\n");
-            return false;
-        }
+    active_ = false;
 
-        // Read lofs
-        if (fread(&lofs, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading lofs\n");
-            return false;
-        }
+    image.pixels = status ? nullptr : pixels;
+    image.width = width;
+    image.height = height;
+    image.colortype = out.colortype;
+    image.bitdepth = out.bitdepth;
+    image.size = lodepng_get_raw_size(width, height, &out);
+    lodepng_color_mode_cleanup(&out);
+    return status;
+}
 
-        if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading dummy\n");
-            return false;
-        }
+void PngDecoderContext::ReleaseScratch() {
+    lodepng_state_cleanup(&state_);
+    lodepng_state_init(&state_);
+    arena_.Release();
+}
 
-        // Read tofs
-        if (fread(&tofs, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading tofs\n");
-            return false;
-        }
-    } else if (header_.Ver0 == 1) {
-        // Read NumberOfSprites
-        if (fread(&header_.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading NumberOfSprites\n");
-            return false;
+// Implementation of the sprite atlas
+int SkylinePacker::FitAt(size_t index, int w, int h) const {
+    // Lowest y at which a w-wide rectangle starting at segment 'index' clears the skyline
+    int x = skyline_[index].x;
+    if (x + w > width_) {
+        return -1;
+    }
+
+    int y = 0;
+    int remaining = w;
+    for (size_t i = index; remaining > 0; i++) {
+        y = std::max(y, skyline_[i].y);
+        if (y + h > height_) {
+            return -1;
         }
+        remaining -= skyline_[i].width;
+    }
+    return y;
+}
 
-        // Read FirstSpriteHeaderOffset
-        if (fread(&header_.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
-            return false;
+bool SkylinePacker::Insert(int w, int h, int& x, int& y) {
+    size_t best = skyline_.size();
+    int bestY = 0, bestWidth = 0;
+
+    for (size_t i = 0; i < skyline_.size(); i++) {
+        int fit = FitAt(i, w, h);
+        if (fit < 0) {
+            continue;
+        }
+        // Bottom-left rule: lowest top edge, ties go to the narrower segment
+        if (best == skyline_.size() || fit < bestY || (fit == bestY && skyline_[i].width < bestWidth)) {
+            best = i;
+            bestY = fit;
+            bestWidth = skyline_[i].width;
         }
+    }
 
-        // Initialize v1-specific fields
-        header_.FirstPaletteHeaderOffset = 0;
-        header_.NumberOfPalettes = 0;
-        lofs = 0;
-        tofs = 0;
-    } else {
-        fprintf(stderr, "Unsupported SFF version: %d\n", header_.Ver0);
+    if (best == skyline_.size()) {
         return false;
     }
 
-    printf("SFF Version: %d.%d.%d.%d\n", header_.Ver3, header_.Ver2, header_.Ver1, header_.Ver0);
-    printf("Sprites: %u, Palettes: %u\n", header_.NumberOfSprites, header_.NumberOfPalettes);
-    printf("FirstSpriteOffset: 0x%X, FirstPaletteOffset: 0x%X\n",
-           header_.FirstSpriteHeaderOffset, header_.FirstPaletteHeaderOffset);
+    x = skyline_[best].x;
+    y = bestY;
 
-    if (header_.Ver0 == 2) {
-        printf("LOFS: 0x%X, TOFS: 0x%X\n", lofs, tofs);
+    // Raise the skyline under the new rectangle and trim the segments it covers
+    skyline_.insert(skyline_.begin() + best, {x, y + h, w});
+    for (size_t i = best + 1; i < skyline_.size(); ) {
+        Segment& seg = skyline_[i];
+        int shrink = (x + w) - seg.x;
+        if (shrink <= 0) {
+            break;
+        }
+        seg.x += shrink;
+        seg.width -= shrink;
+        if (seg.width <= 0) {
+            skyline_.erase(skyline_.begin() + i);
+        } else {
+            break;
+        }
+    }
+
+    // Merge neighbours that ended up at the same height
+    for (size_t i = 0; i + 1 < skyline_.size(); ) {
+        if (skyline_[i].y == skyline_[i + 1].y) {
+            skyline_[i].width += skyline_[i + 1].width;
+            skyline_.erase(skyline_.begin() + i + 1);
+        } else {
+            i++;
+        }
     }
 
+    usedHeight_ = std::max(usedHeight_, y + h);
     return true;
 }
 
-bool SffFile::ReadSpriteHeaderV1(Sprite& sprite, FILE* file, uint32_t& ofs, uint32_t& size, uint16_t& link) {
-    // Read ofs and size
-    ofs = ReadU32LE(file);
-    size = ReadU32LE(file);
-
-    // Read sprite offsets
-    sprite.Offset[0] = ReadI16LE(file);
-    sprite.Offset[1] = ReadI16LE(file);
+bool SpriteAtlasBuilder::Add(const uint8_t* pixels, int w, int h, int& page, Rectangle& rect) {
+    int paddedW = w + padding_;
+    int paddedH = h + padding_;
+    if (w <= 0 || h <= 0 || paddedW > pageSize_ || paddedH > pageSize_) {
+        return false;
+    }
 
-    // Read sprite group and number
-    sprite.Group = ReadU16LE(file);
-    sprite.Number = ReadU16LE(file);
+    int x = 0, y = 0;
+    size_t target = pages_.size();
+    for (size_t i = 0; i < pages_.size(); i++) {
+        if (pages_[i].packer.Insert(paddedW, paddedH, x, y)) {
+            target = i;
+            break;
+        }
+    }
 
-    // Read the link to the next sprite header
-    link = ReadU16LE(file);
+    if (target == pages_.size()) {
+        pages_.push_back({SkylinePacker(pageSize_, pageSize_), std::vector<uint8_t>(), 0});
+        // Index 0 (and alpha 0) is transparent, so the zero fill doubles as the padding between sprites
+        pages_.back().pixels.assign(static_cast<size_t>(pageSize_) * pageSize_ * bytesPerPixel_, 0);
+        pages_.back().packer.Insert(paddedW, paddedH, x, y);
+    }
 
-    // Initialize v1-specific fields
-    sprite.rle = -1; // PCX format for v1
-    sprite.coldepth = 8; // 8-bit for v1
-    sprite.palidx = 0; // Will be set during data reading
+    uint8_t* dst = pages_[target].pixels.data();
+    size_t rowBytes = static_cast<size_t>(w) * bytesPerPixel_;
+    for (int row = 0; row < h; row++) {
+        memcpy(dst + (static_cast<size_t>(y + row) * pageSize_ + x) * bytesPerPixel_,
+               pixels + row * rowBytes, rowBytes);
+    }
+
+    pages_[target].usedWidth = std::max(pages_[target].usedWidth, x + w);
+    page = static_cast<int>(target);
+    rect = Rectangle{static_cast<float>(x), static_cast<float>(y), static_cast<float>(w), static_cast<float>(h)};
+    return true;
+}
+
+bool SpriteAtlasBuilder::Matches(const uint8_t* pixels, int page, const Rectangle& rect) const {
+    if (page < 0 || page >= static_cast<int>(pages_.size())) {
+        return false;
+    }
+    const uint8_t* src = pages_[page].pixels.data();
+    int x = static_cast<int>(rect.x), y = static_cast<int>(rect.y);
+    int w = static_cast<int>(rect.width), h = static_cast<int>(rect.height);
+    size_t rowBytes = static_cast<size_t>(w) * bytesPerPixel_;
+    for (int row = 0; row < h; row++) {
+        if (memcmp(src + (static_cast<size_t>(y + row) * pageSize_ + x) * bytesPerPixel_,
+                   pixels + row * rowBytes, rowBytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t SpriteAtlasBuilder::GetUploadBytes() const {
+    size_t bytes = 0;
+    for (const Page& page : pages_) {
+        bytes += static_cast<size_t>(page.usedWidth) * page.packer.GetUsedHeight() * bytesPerPixel_;
+    }
+    return bytes;
+}
+
+std::vector<TextureHandle> SpriteAtlasBuilder::Upload() {
+    std::vector<TextureHandle> textures;
+    textures.reserve(pages_.size());
+    int format = bytesPerPixel_ == 4 ? PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 : PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+    VramCategory category = bytesPerPixel_ == 4 ? VRAM_RGBA_SPRITES : VRAM_INDEXED_SPRITES;
+
+    for (Page& page : pages_) {
+        // Rectangles are measured from the top-left corner, so dropping the unused right and
+        // bottom parts keeps every one of them valid
+        int width = page.usedWidth;
+        int height = page.packer.GetUsedHeight();
+        if (width < pageSize_) {
+            size_t rowBytes = static_cast<size_t>(width) * bytesPerPixel_;
+            for (int row = 1; row < height; row++) {
+                memmove(page.pixels.data() + row * rowBytes,
+                        page.pixels.data() + static_cast<size_t>(row) * pageSize_ * bytesPerPixel_, rowBytes);
+            }
+        }
+
+        Texture2D texture = {};
+        texture.id = rlLoadTexture(page.pixels.data(), width, height, format, 1);
+        texture.width = width;
+        texture.height = height;
+        texture.mipmaps = 1;
+        texture.format = format;
+        SetTextureFilter(texture, TEXTURE_FILTER_POINT);
+        textures.emplace_back(texture, category);
+
+        std::vector<uint8_t>().swap(page.pixels);
+    }
+
+    pages_.clear();
+    return textures;
+}
+
+// Implementation of SffFile methods
+// Hash of the v2 sprite header fields that decide how a sprite decodes and where it is
+// drawn. The data offset is left out, it moves whenever an earlier sprite changes size.
+static uint64_t HashSpriteHeader(const Sprite& sprite, const SpriteIndexEntry& entry) {
+    int32_t fields[] = {sprite.Group, sprite.Number, sprite.Size[0], sprite.Size[1], sprite.Offset[0], sprite.Offset[1],
+                        sprite.palidx, sprite.rle, sprite.coldepth, entry.pngColorType, entry.pngBitDepth,
+                        entry.dataSize == 0 ? -1 - entry.link : 0};
+    return HashBytes64(reinterpret_cast<const uint8_t*>(fields), sizeof(fields), 0);
+}
+
+// What Decode() leaves for Upload(): the staged atlas pages and the pixels of sprites that
+// get a texture of their own
+struct SffFile::PendingUpload {
+    SpriteAtlasBuilder atlas;      // Index planes
+    SpriteAtlasBuilder rgbaAtlas;  // RGBA sprites
+    std::map<uint32_t, std::unique_ptr<uint8_t[]>> images;    // Sprite -> pixels of its own texture
+    std::vector<std::pair<uint32_t, uint32_t>> sharedImages;  // Sprite -> earlier sprite with the same image
+    size_t numAtlasSprites;
+
+    explicit PendingUpload(int pageSize) : atlas(pageSize, 1), rgbaAtlas(pageSize, 1, 4), numAtlasSprites(0) {}
+};
+
+bool SffFile::Load(const std::string& filename) {
+    ReleaseOwnedTextures();
+    return Decode(filename) && Upload();
+}
+
+bool SffFile::Decode(const std::string& filename) {
+    pending_.reset();
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        printf("Error: cannot open file %s\n", filename.c_str());
+        return false;
+    }
+
+    filename_ = filename;
+    printf("Open file %s\n", filename.c_str());
+
+    fseek(file, 0, SEEK_END);
+    long endOfFile = ftell(file);
+    fileSize_ = endOfFile > 0 ? static_cast<uint64_t>(endOfFile) : 0;
+    fseek(file, 0, SEEK_SET);
+    decodedBytes_ = 0;
+    trimmedBytes_ = 0;
+    dedupedBytes_ = 0;
+    numDedupedSprites_ = 0;
+    numSharedPalettes_ = 0;
+    paletteByRow_.clear();
+
+    uint32_t lofs, tofs;
+    if (!ReadHeader(file, lofs, tofs)) {
+        printf("Error: reading header %s\n", filename.c_str());
+        fclose(file);
+        return false;
+    }
+
+    // The atlas of a previous Load() is full and would pass for a shared one, start a new one
+    if (ownsPaletteAtlas_) {
+        paletteAtlas_.reset();
+    }
+    ownsPaletteAtlas_ = !paletteAtlas_;
+    if (ownsPaletteAtlas_) {
+        // Spare rows let Reload() put every palette's new colours next to the old ones once
+        int capacity = (trackChanges_ && header_.Ver0 == 2) ? static_cast<int>(header_.NumberOfPalettes) * 2 : 0;
+        paletteAtlas_ = std::make_shared<PaletteAtlas>(capacity);
+    }
+
+    // Load palettes for SFF v2
+    if (header_.Ver0 != 1) {
+        // std::map<std::array<int, 2>, int> uniquePals;
+		std::unordered_map<std::array<int, 2>, int, ArrayHash> uniquePals;
+        palettes_.clear();
+        palettes_.reserve(header_.NumberOfPalettes);
+        paletteHashes_.clear();
+
+        for (uint32_t i = 0; i < header_.NumberOfPalettes; i++) {
+            fseek(file, header_.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
+
+            std::array<int16_t, 3> gn;
+            gn[0] = ReadU16LE(file); // group
+            gn[1] = ReadU16LE(file); // number
+            gn[2] = ReadU16LE(file); // colnumber
+
+            uint16_t link = ReadU16LE(file); (void)link;
+            uint32_t ofs = ReadU32LE(file);
+            uint32_t siz = ReadU32LE(file); (void) siz;
+ 
+            /*std::array<int, 2> key = { gn[0], gn[1] };
+            if (uniquePals.find(key) == uniquePals.end()) {
+                fseek(file, lofs + ofs, SEEK_SET);
+                std::array<uint32_t, 256> rgba;
+                if (fread(rgba.data(), sizeof(uint32_t), 256, file) != 256) {
+                    printf("Failed to read palette data: %s", filename.c_str());
+                    fclose(file);
+                    return false;
+                }
+                palettes_.emplace_back(GeneratePaletteTexture(rgba));
+                uniquePals[key] = i;
+            } else {
+                printf("Palette %d(%d,%d) is not unique, using palette %d\n",
+                       i, gn[0], gn[1], uniquePals[key]);
+                palettes_.emplace_back(palettes_[uniquePals[key]].texture);
+            }*/
+
+			// Optimized using unordered_map (faster)
+			std::array<int, 2> key = { gn[0], gn[1] };
+			auto it = uniquePals.find(key);
+			if (it == uniquePals.end()) {
+				fseek(file, lofs + ofs, SEEK_SET);
+				std::array<uint32_t, 256> rgba;
+				if (fread(rgba.data(), sizeof(uint32_t), 256, file) != 256) {
+					printf("Failed to read palette data: %s\n", filename.c_str());
+					fclose(file);
+					return false;
+				}
+				// palidx refers to the file's palette numbers, so every palette keeps an entry
+				std::array<uint8_t, 256 * 4> colors = ConvertPalette(rgba);
+				if (AddPalette(colors, false) < 0) {
+					fclose(file);
+					return false;
+				}
+				uniquePals[key] = static_cast<int>(palettes_.size() - 1);
+				paletteHashes_.push_back(HashBytes64(colors.data(), colors.size(), 0));
+			} else {
+				printf("Palette %d(%d,%d) is not unique, using palette %d\n",
+					   i, gn[0], gn[1], it->second);
+				palettes_.push_back(palettes_[it->second]);
+				paletteHashes_.push_back(paletteHashes_[it->second]);
+			}
+
+        }
+    }
+
+    // Index pass: read every sprite header, plus the IHDR of PNG sprites, so that
+    // dimensions and formats are known before anything is inflated
+    sprites_.clear();
+    sprites_.resize(header_.NumberOfSprites);
+    index_.clear();
+    index_.resize(header_.NumberOfSprites);
+    size_t plannedBytes = 0;
+    std::vector<uint8_t> payload;
+
+    long shofs = header_.FirstSpriteHeaderOffset;
+    for (uint32_t i = 0; i < header_.NumberOfSprites; i++) {
+        SpriteIndexEntry& entry = index_[i];
+        entry.headerOffset = static_cast<uint32_t>(shofs);
+
+        fseek(file, shofs, SEEK_SET);
+        bool success = false;
+
+        switch (header_.Ver0) {
+            case 1:
+                success = ReadSpriteHeaderV1(sprites_[i], file, entry.dataOffset, entry.dataSize, entry.link);
+                break;
+            case 2:
+                success = ReadSpriteHeaderV2(sprites_[i], file, entry.dataOffset, entry.dataSize, lofs, tofs, entry.link);
+                if (success && entry.dataSize != 0 && sprites_[i].IsPng()) {
+                    success = ScanPngHeader(sprites_[i], file, entry);
+                }
+                break;
+            default:
+                printf("Unsupported SFF version: %d\n", header_.Ver0);
+                fclose(file);
+                return false;
+        }
+
+        if (success && header_.Ver0 == 2) {
+            entry.headerHash = HashSpriteHeader(sprites_[i], entry);
+            if (trackChanges_ && entry.dataSize != 0) {
+                success = HashPayload(file, entry, payload);
+            }
+        }
+
+        if (!success) {
+            fclose(file);
+            return false;
+        }
+
+        // v1 sizes live in the PCX headers and are only known once the data is read
+        if (header_.Ver0 == 2 && entry.dataSize != 0) {
+            plannedBytes += static_cast<size_t>(sprites_[i].Size[0]) * sprites_[i].Size[1] * (sprites_[i].IsRGBA() ? 4 : 1);
+        }
+
+        // Update next header offset
+        if (header_.Ver0 == 1) {
+            shofs = entry.dataOffset;
+        } else {
+            shofs += 28;
+        }
+    }
+
+    if (limits_.maxLoadBytes != 0 && plannedBytes > limits_.maxLoadBytes) {
+        fprintf(stderr, "Error: %s needs %zu decoded bytes, load limit is %zu\n",
+                filename.c_str(), plannedBytes, limits_.maxLoadBytes);
+        fclose(file);
+        return false;
+    }
+
+    // Decode pass, which only resolves links when decoding is deferred
+    bool deferDecode = deferDecode_ && header_.Ver0 == 2;
+    decodeDeferred_ = deferDecode;
+    if (deferDecode_ && !deferDecode) {
+        printf("Info: SFF v1 palettes live in the sprite data, decoding everything\n");
+    }
+    Sprite* prev = nullptr;
+    numLinkedSprites_ = 0;
+    // Index planes and RGBA sprites are packed into pages of their own format
+    std::unique_ptr<PendingUpload> pending(new PendingUpload(atlasPageSize_));
+    SpriteAtlasBuilder& atlas = pending->atlas;
+    SpriteAtlasBuilder& rgbaAtlas = pending->rgbaAtlas;
+    std::unordered_map<SpriteImageKey, uint32_t, SpriteImageKeyHash> uniqueImages;
+
+    for (uint32_t i = 0; i < header_.NumberOfSprites; i++) {
+        SpriteIndexEntry& entry = index_[i];
+
+        if (entry.dataSize == 0) {
+            numLinkedSprites_++;
+            if (entry.link < i) {
+                printf("Info: Sprite[%d] use prev Sprite[%d]\n", i, entry.link);
+                // A linked sprite shares the image but keeps its own group and number
+                uint16_t group = sprites_[i].Group;
+                uint16_t number = sprites_[i].Number;
+                sprites_[i].CopyFrom(sprites_[entry.link]);
+                sprites_[i].Group = group;
+                sprites_[i].Number = number;
+                if (!deferDecode) {
+                    sharedBytes_ += static_cast<size_t>(sprites_[i].Size[0]) * sprites_[i].Size[1] * (sprites_[i].IsRGBA() ? 4 : 1);
+                }
+            } else {
+                printf("Warning: Sprite %d has no size\n", i);
+                sprites_[i].palidx = 0;
+            }
+        } else if (deferDecode) {
+            // v2 headers carry the size, DecodeSpritePixels() decodes the data when asked
+            entry.width = sprites_[i].Size[0];
+            entry.height = sprites_[i].Size[1];
+            // What PngDecode() will do with the pixels, so they decode and blend the same way
+            sprites_[i].premultiplied = premultiplyAlpha_ && sprites_[i].IsPng() && sprites_[i].rle != -10;
+        } else {
+            std::unique_ptr<uint8_t[]> data = DecodeSprite(sprites_[i], file, entry, prev);
+
+            if (!data) {
+                printf("Error reading SFFv%d sprite data for sprite %d\n", header_.Ver0, i);
+                fclose(file);
+                return false;
+            }
+
+            // Update usage statistics
+            if (sprites_[i].IsPaletted()) {
+                palette_usage_[sprites_[i].palidx]++;
+            }
+            compression_format_usage_[sprites_[i].rle]++;
+
+            // Identical pixels reuse the texture (or atlas rectangle) of the first sprite that had them
+            size_t bytesPerPixel = sprites_[i].IsRGBA() ? 4 : 1;
+            size_t imageBytes = static_cast<size_t>(sprites_[i].Size[0]) * sprites_[i].Size[1] * bytesPerPixel;
+            SpriteImageKey key = {};
+            if (dedupImages_) {
+                key = SpriteImageKey{HashBytes64(data.get(), imageBytes, 0), sprites_[i].Size[0], sprites_[i].Size[1],
+                                     static_cast<uint8_t>(bytesPerPixel)};
+            }
+            auto original = dedupImages_ ? uniqueImages.find(key) : uniqueImages.end();
+            // The hash only finds the candidate, sharing needs identical bytes (hashes can be
+            // made to collide). Colliding images are kept apart.
+            bool identical = false;
+            if (original != uniqueImages.end()) {
+                const Sprite& source = sprites_[original->second];
+                if (source.atlasPage >= 0) {
+                    identical = (source.IsRGBA() ? rgbaAtlas : atlas).Matches(data.get(), source.atlasPage, source.atlasRect);
+                } else {
+                    auto pixels = pending->images.find(original->second);
+                    identical = pixels != pending->images.end() && memcmp(pixels->second.get(), data.get(), imageBytes) == 0;
+                }
+            }
+
+            if (identical) {
+                const Sprite& source = sprites_[original->second];
+                sprites_[i].atlasPage = source.atlasPage;
+                sprites_[i].atlasRect = source.atlasRect;
+                if (source.atlasPage < 0) {
+                    pending->sharedImages.emplace_back(i, original->second);
+                }
+                dedupedBytes_ += imageBytes;
+                numDedupedSprites_++;
+            } else if (atlasPageSize_ > 0 &&
+                (sprites_[i].IsRGBA() ? rgbaAtlas : atlas).Add(data.get(), sprites_[i].Size[0], sprites_[i].Size[1],
+                                                               sprites_[i].atlasPage, sprites_[i].atlasRect)) {
+                // Sprites go to an atlas page when one is configured, the texture is assigned
+                // once the pages are uploaded
+                pending->numAtlasSprites++;
+            } else {
+                // Upload() creates the texture, the pixels also serve the dedup comparisons
+                sprites_[i].atlasRect = Rectangle{0, 0, static_cast<float>(sprites_[i].Size[0]),
+                                                  static_cast<float>(sprites_[i].Size[1])};
+                pending->images.emplace(i, std::move(data));
+            }
+
+            if (dedupImages_ && original == uniqueImages.end()) {
+                uniqueImages.emplace(key, i);
+            }
+
+            // Update previous sprite reference
+            if (sprites_[i].Group == 9000) {
+                if (sprites_[i].Number == 0) {
+                    prev = &sprites_[i];
+                }
+            } else {
+                prev = &sprites_[i];
+            }
+        }
+    }
+
+    size_t numDuplicates = lookup_.Build(sprites_);
+    if (numDuplicates > 0) {
+        printf("Warning: %zu sprites repeat a group and number already used, the first one is kept\n", numDuplicates);
+    }
+
+    // Update palette count for SFF v1
+    if (header_.Ver0 == 1) {
+        header_.NumberOfPalettes = palettes_.size();
+    }
+
+    PngDecoderContext::ForThisThread().ReleaseScratch();
+    fclose(file);
+    pending_ = std::move(pending);
+    return true;
+}
+
+bool SffFile::Upload() {
+    if (!pending_) {
+        fprintf(stderr, "Error: nothing to upload for %s, Decode() it first\n", filename_.c_str());
+        return false;
+    }
+    std::unique_ptr<PendingUpload> pending = std::move(pending_);
+    SpriteAtlasBuilder& atlas = pending->atlas;
+    SpriteAtlasBuilder& rgbaAtlas = pending->rgbaAtlas;
+
+    for (auto& image : pending->images) {
+        Sprite& sprite = sprites_[image.first];
+        int format = sprite.IsRGBA() ? PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 : PIXELFORMAT_UNCOMPRESSED_GRAYSCALE;
+        if (!VramBudget::Instance().Reserve(static_cast<size_t>(sprite.Size[0]) * sprite.Size[1] * (sprite.IsRGBA() ? 4 : 1))) {
+            fprintf(stderr, "Error: VRAM budget exceeded by sprite %d,%d of %s\n",
+                    sprite.Group, sprite.Number, filename_.c_str());
+            return false;
+        }
+
+        Texture2D texture = {};
+        texture.id = rlLoadTexture(image.second.get(), sprite.Size[0], sprite.Size[1], format, 1);
+        texture.width = sprite.Size[0];
+        texture.height = sprite.Size[1];
+        texture.mipmaps = 1;
+        texture.format = format;
+
+        if (sprite.IsPaletted()) {
+            // No filtering — perfect for pixel art. Keeps hard edges and crisp pixels.
+            SetTextureFilter(texture, TEXTURE_FILTER_POINT);
+        }
+        sprite.texture = TextureHandle(texture, sprite.IsRGBA() ? VRAM_RGBA_SPRITES : VRAM_INDEXED_SPRITES);
+        ownedTextures_.push_back(sprite.texture);
+    }
+    for (const auto& shared : pending->sharedImages) {
+        sprites_[shared.first].texture = sprites_[shared.second].texture;
+    }
+
+    if (!VramBudget::Instance().Reserve(atlas.GetUploadBytes() + rgbaAtlas.GetUploadBytes())) {
+        fprintf(stderr, "Error: VRAM budget exceeded by the sprite atlas of %s\n", filename_.c_str());
+        return false;
+    }
+    // RGBA pages follow the index pages, sprites on them were numbered from 0 so far
+    atlasPages_ = atlas.Upload();
+    int firstRgbaPage = static_cast<int>(atlasPages_.size());
+    for (TextureHandle& page : rgbaAtlas.Upload()) {
+        atlasPages_.push_back(std::move(page));
+    }
+    for (Sprite& sprite : sprites_) {
+        if (sprite.IsRGBA() && sprite.atlasPage >= 0) {
+            sprite.atlasPage += firstRgbaPage;
+        }
+    }
+    for (size_t page = 0; page < atlasPages_.size(); page++) {
+        ownedTextures_.push_back(atlasPages_[page]);
+    }
+    for (Sprite& sprite : sprites_) {
+        if (sprite.atlasPage >= 0) {
+            sprite.texture = atlasPages_[sprite.atlasPage];
+        }
+    }
+    // Linked sprites copied their target before it had a texture, links always point back
+    for (uint32_t i = 0; i < sprites_.size(); i++) {
+        if (index_[i].dataSize == 0 && index_[i].link < i) {
+            sprites_[i].texture = sprites_[index_[i].link].texture;
+        }
+    }
+    BindReloaders();
+    if (!atlasPages_.empty()) {
+        printf("Atlas: %zu sprites packed into %zu pages\n", pending->numAtlasSprites, atlasPages_.size());
+    }
+    if (trimmedBytes_ > 0) {
+        printf("Trim: %zu bytes of transparent borders removed\n", trimmedBytes_);
+    }
+    if (numDedupedSprites_ > 0) {
+        printf("Dedup: %zu sprites share an identical image, %zu bytes saved\n", numDedupedSprites_, dedupedBytes_);
+    }
+    if (numSharedPalettes_ > 0) {
+        printf("Dedup: %zu palettes reuse the colours of an earlier one\n", numSharedPalettes_);
+    }
+
+    sharedBytes_ += dedupedBytes_ + numSharedPalettes_ * 256 * 4;
+    VramBudget::Instance().AddSharedBytes(sharedBytes_);
+    VramUsage usage = GetVramUsage();
+    printf("VRAM: %zu KB (indexed %zu KB, RGBA %zu KB, palettes %zu KB), %zu KB shared\n",
+           usage.Total() / 1024, usage.bytes[VRAM_INDEXED_SPRITES] / 1024, usage.bytes[VRAM_RGBA_SPRITES] / 1024,
+           usage.bytes[VRAM_PALETTES] / 1024, usage.sharedBytes / 1024);
+
+    // Every palette row is known now, upload them in one go. Palettes are accounted but
+    // not checked against the budget, they are tiny and every draw needs them
+    paletteAtlas_->Commit();
+    if (ownsPaletteAtlas_) {
+        ownedTextures_.push_back(paletteAtlas_->GetTexture());
+    }
+    for (Palette& palette : palettes_) {
+        palette.texture = paletteAtlas_->GetTexture();
+    }
+    return true;
+}
+
+void SffFile::Clear() {
+    // Textures are released by their handles once no sprite or palette (of any file) uses them
+    ReleaseOwnedTextures();
+    paletteAtlas_.reset();
+    sprites_.clear();
+    index_.clear();
+    lookup_.Clear();
+    palettes_.clear();
+    atlasPages_.clear();
+    palette_usage_.clear();
+    compression_format_usage_.clear();
+    numLinkedSprites_ = 0;
+    trimmedBytes_ = 0;
+    dedupedBytes_ = 0;
+    numDedupedSprites_ = 0;
+    numSharedPalettes_ = 0;
+    paletteByRow_.clear();
+    paletteHashes_.clear();
+    ownsPaletteAtlas_ = false;
+    decodeDeferred_ = false;
+    pending_.reset();
+}
+
+bool SffFile::ReadHeader(FILE* file, uint32_t& lofs, uint32_t& tofs) {
+    // Validate header by comparing 12 first bytes with "ElecbyteSpr\x0"
+    char headerCheck[12];
+    if (fread(headerCheck, 12, 1, file) != 1) {
+        fprintf(stderr, "Error reading header check\n");
+        return false;
+    }
+
+    if (memcmp(headerCheck, "ElecbyteSpr\0", 12) != 0) {
+        fprintf(stderr, "Invalid SFF file [%s]\n", headerCheck);
+        return false;
+    }
+
+    // Read versions in the header
+    if (fread(&header_.Ver3, 1, 1, file) != 1) {
+        fprintf(stderr, "Error reading version\n");
+        return false;
+    }
+    if (fread(&header_.Ver2, 1, 1, file) != 1) {
+        fprintf(stderr, "Error reading version\n");
+        return false;
+    }
+    if (fread(&header_.Ver1, 1, 1, file) != 1) {
+        fprintf(stderr, "Error reading version\n");
+        return false;
+    }
+    if (fread(&header_.Ver0, 1, 1, file) != 1) {
+        fprintf(stderr, "Error reading version\n");
+        return false;
+    }
+
+    uint32_t dummy;
+    if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+        fprintf(stderr, "Error reading dummy\n");
+        return false;
+    }
+
+    if (header_.Ver0 == 2) {
+        // Read additional header fields for version 2
+        for (int i = 0; i < 4; i++) {
+            if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+                fprintf(stderr, "Error reading dummy\n");
+                return false;
+            }
+        }
+
+        // Read FirstSpriteHeaderOffset
+        if (fread(&header_.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
+            return false;
+        }
+
+        // Read NumberOfSprites
+        if (fread(&header_.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading NumberOfSprites\n");
+            return false;
+        }
+
+        // Read FirstPaletteHeaderOffset
+        if (fread(&header_.FirstPaletteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading FirstPaletteHeaderOffset\n");
+            return false;
+        }
+
+        // Read NumberOfPalettes
+        if (fread(&header_.NumberOfPalettes, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading NumberOfPalettes\n");
+            return false;
+        }
+
+        // Read lofs
+        if (fread(&lofs, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading lofs\n");
+            return false;
+        }
+
+        if (fread(&dummy, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading dummy\n");
+            return false;
+        }
+
+        // Read tofs
+        if (fread(&tofs, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading tofs\n");
+            return false;
+        }
+    } else if (header_.Ver0 == 1) {
+        // Read NumberOfSprites
+        if (fread(&header_.NumberOfSprites, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading NumberOfSprites\n");
+            return false;
+        }
+
+        // Read FirstSpriteHeaderOffset
+        if (fread(&header_.FirstSpriteHeaderOffset, sizeof(uint32_t), 1, file) != 1) {
+            fprintf(stderr, "Error reading FirstSpriteHeaderOffset\n");
+            return false;
+        }
+
+        // Initialize v1-specific fields
+        header_.FirstPaletteHeaderOffset = 0;
+        header_.NumberOfPalettes = 0;
+        lofs = 0;
+        tofs = 0;
+    } else {
+        fprintf(stderr, "Unsupported SFF version: %d\n", header_.Ver0);
+        return false;
+    }
+
+    printf("SFF Version: %d.%d.%d.%d\n", header_.Ver3, header_.Ver2, header_.Ver1, header_.Ver0);
+    printf("Sprites: %u, Palettes: %u\n", header_.NumberOfSprites, header_.NumberOfPalettes);
+    printf("FirstSpriteOffset: 0x%X, FirstPaletteOffset: 0x%X\n",
+           header_.FirstSpriteHeaderOffset, header_.FirstPaletteHeaderOffset);
+
+    if (header_.Ver0 == 2) {
+        printf("LOFS: 0x%X, TOFS: 0x%X\n", lofs, tofs);
+    }
+
+    return true;
+}
+
+bool SffFile::ReadSpriteHeaderV1(Sprite& sprite, FILE* file, uint32_t& ofs, uint32_t& size, uint16_t& link) {
+    // Read ofs and size
+    ofs = ReadU32LE(file);
+    size = ReadU32LE(file);
+
+    // Read sprite offsets
+    sprite.Offset[0] = ReadI16LE(file);
+    sprite.Offset[1] = ReadI16LE(file);
+
+    // Read sprite group and number
+    sprite.Group = ReadU16LE(file);
+    sprite.Number = ReadU16LE(file);
+
+    // Read the link to the next sprite header
+    link = ReadU16LE(file);
+
+    // Initialize v1-specific fields
+    sprite.rle = -1; // PCX format for v1
+    sprite.coldepth = 8; // 8-bit for v1
+    sprite.palidx = 0; // Will be set during data reading
 
     return true;
 }
@@ -601,752 +2266,3958 @@ bool SffFile::ReadSpriteHeaderV2(Sprite& sprite, FILE* file, uint32_t& ofs, uint
     sprite.Offset[0] = ReadI16LE(file);
     sprite.Offset[1] = ReadI16LE(file);
 
-    // Read the link to the next sprite header
-    link = ReadU16LE(file);
+    // Read the link to the next sprite header
+    link = ReadU16LE(file);
+
+    // Read format
+    char format;
+    if (fread(&format, sizeof(char), 1, file) != 1) {
+        fprintf(stderr, "Error reading sprite format\n");
+        return false;
+    }
+    sprite.rle = -format;
+
+    // Read color depth
+    if (fread(&sprite.coldepth, sizeof(uint8_t), 1, file) != 1) {
+        fprintf(stderr, "Error reading color depth\n");
+        return false;
+    }
+
+    // Read ofs and size
+    ofs = ReadU32LE(file);
+    size = ReadU32LE(file);
+
+    // Read palette index
+    uint16_t tmp = ReadU16LE(file);
+    sprite.palidx = tmp;
+
+    // Read location flag and adjust offset
+    tmp = ReadU16LE(file);
+    if ((tmp & 1) == 0) {
+        ofs += lofs; // Local offset
+    } else {
+        ofs += tofs; // Global offset
+    }
+
+    return true;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::ReadSpriteDataV1(Sprite& sprite, FILE* file, uint64_t offset, uint32_t datasize,
+                                                   uint32_t nextSubheader, Sprite* prev, bool c00) {
+    if (nextSubheader > offset) {
+        // Ignore datasize except last
+        datasize = nextSubheader - offset;
+    }
+
+    uint8_t ps;
+    if (fread(&ps, sizeof(uint8_t), 1, file) != 1) {
+        fprintf(stderr, "Error reading sprite ps data\n");
+        return nullptr;
+    }
+
+    bool paletteSame = (ps != 0) && (prev != nullptr);
+
+    if (!ReadPcxHeader(sprite, file, offset)) {
+        fprintf(stderr, "Error reading sprite PCX header\n");
+        return nullptr;
+    }
+
+    if (fseek(file, offset + 128, SEEK_SET) != 0) {
+        fprintf(stderr, "Error seeking to sprite data\n");
+        return nullptr;
+    }
+
+    uint32_t palSize;
+    if (c00 || paletteSame) {
+        palSize = 0;
+    } else {
+        palSize = 768; // 256 colors * 3 bytes per color
+    }
+
+    if (datasize < 128 + palSize) {
+        datasize = 128 + palSize;
+    }
+
+    size_t srcLen = datasize - (128 + palSize);
+    if (!CheckPayload(offset + 128, srcLen)) {
+        return nullptr;
+    }
+    auto srcPx = std::make_unique<uint8_t[]>(srcLen);
+    if (!srcPx) {
+        fprintf(stderr, "Error allocating memory for sprite data\n");
+        return nullptr;
+    }
+
+    if (fread(srcPx.get(), srcLen, 1, file) != 1) {
+        fprintf(stderr, "Error reading sprite PCX data pixel\n");
+        return nullptr;
+    }
+
+    std::unique_ptr<uint8_t[]> px;
+
+    if (paletteSame) {
+        if (prev != nullptr) {
+            sprite.palidx = prev->palidx;
+        }
+        if (sprite.palidx < 0) {
+            fprintf(stderr, "Error: invalid prev palette index %d\n", (prev ? prev->palidx : -1));
+            return nullptr;
+        }
+        px = RlePcxDecode(sprite, srcPx.get(), srcLen);
+    } else {
+        if (c00) {
+            if (fseek(file, offset + datasize - 768, SEEK_SET) != 0) {
+                fprintf(stderr, "Error seeking to palette data\n");
+                return nullptr;
+            }
+        }
+
+        std::array<RGB, 256> pal_rgb;
+        if (fread(pal_rgb.data(), sizeof(RGB), 256, file) != 256) {
+            fprintf(stderr, "Error reading palette rgb data\n");
+            return nullptr;
+        }
+
+        sprite.palidx = AddPalette(ConvertPalette(pal_rgb), true);
+        if (sprite.palidx < 0) {
+            return nullptr;
+        }
+        px = RlePcxDecode(sprite, srcPx.get(), srcLen);
+    }
+
+    return px;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::ReadSpriteDataV2(Sprite& sprite, FILE* file, uint64_t offset, uint32_t datasize) {
+    if (sprite.rle > 0) {
+        return nullptr;
+    }
+
+    std::unique_ptr<uint8_t[]> px;
+
+    if (sprite.rle == 0) {
+        // Uncompressed data
+        size_t pixels = static_cast<size_t>(sprite.Size[0]) * sprite.Size[1];
+        if (!CheckPayload(offset, datasize) || !ReserveDecodedBytes(sprite, pixels, 1)) {
+            return nullptr;
+        }
+
+        px = std::make_unique<uint8_t[]>(pixels);
+        if (!px) {
+            fprintf(stderr, "Error allocating memory for sprite data\n");
+            return nullptr;
+        }
+
+        if (fseek(file, offset, SEEK_SET) != 0) {
+            fprintf(stderr, "Error seeking to sprite data\n");
+            return nullptr;
+        }
+
+        // The texture is uploaded as Size[0]*Size[1] bytes, so never trust datasize alone
+        size_t readLen = std::min(pixels, static_cast<size_t>(datasize));
+        if (readLen > 0 && fread(px.get(), readLen, 1, file) != 1) {
+            fprintf(stderr, "Error reading V2 uncompress sprite data\n");
+            return nullptr;
+        }
+        memset(px.get() + readLen, 0, pixels - readLen);
+    } else {
+        // Compressed data
+        if (datasize < 4) {
+            datasize = 4;
+        }
+
+        size_t srcLen = datasize - 4;
+        if (!CheckPayload(offset + 4, srcLen)) {
+            return nullptr;
+        }
+        auto srcPx = std::make_unique<uint8_t[]>(srcLen);
+        if (!srcPx) {
+            fprintf(stderr, "Error allocating memory for sprite data\n");
+            return nullptr;
+        }
+
+        if (fseek(file, offset + 4, SEEK_SET) != 0) {
+            fprintf(stderr, "Error seeking to compressed sprite data\n");
+            return nullptr;
+        }
+
+        int rc = fread(srcPx.get(), srcLen, 1, file);
+        if (rc != 1) {
+            fprintf(stderr, "Error reading V2 RLE sprite data\n");
+            return nullptr;
+        }
+
+        int format = -sprite.rle;
+        switch (format) {
+            case 2:
+                px = Rle8Decode(sprite, srcPx.get(), srcLen);
+                break;
+            case 3:
+                px = Rle5Decode(sprite, srcPx.get(), srcLen);
+                break;
+            case 4:
+                px = Lz5Decode(sprite, srcPx.get(), srcLen);
+                break;
+            case 10:
+            case 11:
+            case 12:
+                px = PngDecode(sprite, srcPx.get(), static_cast<uint32_t>(srcLen));
+                break;
+            default:
+                fprintf(stderr, "Unknown compression format: %d\n", format);
+                return nullptr;
+        }
+    }
+
+    return px;
+}
+
+bool SffFile::ReadPcxHeader(Sprite& sprite, FILE* file, uint64_t offset) {
+    if (fseek(file, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Error seeking to PCX header offset\n");
+        return false;
+    }
+
+    uint16_t dummy = ReadU16LE(file); (void)dummy;
+    uint8_t encoding, bpp;
+
+    if (fread(&encoding, sizeof(uint8_t), 1, file) != 1) {
+        fprintf(stderr, "Error reading uint8_t encoding\n");
+        return false;
+    }
+    if (fread(&bpp, sizeof(uint8_t), 1, file) != 1) {
+        fprintf(stderr, "Error reading uint8_t bpp\n");
+        return false;
+    }
+
+    if (bpp != 8) {
+        fprintf(stderr, "Invalid PCX color depth: expected 8-bit, got %d\n", bpp);
+        return false;
+    }
+
+    // Read rectangle coordinates
+    uint16_t rect[4];
+    for (int i = 0; i < 4; i++) {
+        rect[i] = ReadU16LE(file);
+    }
+
+    if (fseek(file, offset + 66, SEEK_SET) != 0) {
+        fprintf(stderr, "Error seeking to bytes per line position\n");
+        return false;
+    }
+
+    uint16_t bpl = ReadU16LE(file); (void)bpl;
+
+    sprite.Size[0] = rect[2] - rect[0] + 1;
+    sprite.Size[1] = rect[3] - rect[1] + 1;
+    sprite.rle = -1; // -1 for PCX
+
+    return true;
+}
+
+bool SffFile::CheckPayload(uint64_t offset, size_t length) const {
+    if (offset > fileSize_ || length > fileSize_ - offset) {
+        fprintf(stderr, "Error: sprite data (%zu bytes at 0x%llX) extends past end of file\n",
+                length, static_cast<unsigned long long>(offset));
+        return false;
+    }
+    return true;
+}
+
+bool SffFile::ReserveDecodedBytes(const Sprite& s, size_t pixels, size_t bytesPerPixel) {
+    if (limits_.maxSpritePixels != 0 && pixels > limits_.maxSpritePixels) {
+        fprintf(stderr, "Error: sprite %d,%d is %zu pixels, limit is %zu\n",
+                s.Group, s.Number, pixels, limits_.maxSpritePixels);
+        return false;
+    }
+
+    size_t bytes = pixels * bytesPerPixel;
+    if (limits_.maxLoadBytes != 0 && bytes > limits_.maxLoadBytes - std::min(decodedBytes_, limits_.maxLoadBytes)) {
+        fprintf(stderr, "Error: decoding sprite %d,%d would exceed the %zu byte load limit\n",
+                s.Group, s.Number, limits_.maxLoadBytes);
+        return false;
+    }
+
+    decodedBytes_ += bytes;
+    return true;
+}
+
+bool SffFile::ScanPngHeader(Sprite& sprite, FILE* file, SpriteIndexEntry& entry) {
+    // The payload starts with the 4-byte decoded length, followed by the PNG stream
+    uint8_t head[33];
+    if (entry.dataSize < 4 + sizeof(head) || !CheckPayload(entry.dataOffset, entry.dataSize) ||
+        fseek(file, entry.dataOffset + 4, SEEK_SET) != 0 || fread(head, sizeof(head), 1, file) != 1) {
+        fprintf(stderr, "Error reading PNG header of sprite %d,%d\n", sprite.Group, sprite.Number);
+        return false;
+    }
+
+    PngHeaderInfo info;
+    if (!PngDecoderContext::ReadHeader(head, sizeof(head), info)) {
+        fprintf(stderr, "Error: sprite %d,%d has no valid PNG header\n", sprite.Group, sprite.Number);
+        return false;
+    }
+
+    // Size and the index entry are 16 bits, larger dimensions would wrap on the way in and slip
+    // past maxSpritePixels. Matters when the header's Size is 0 and the IHDR alone decides.
+    if (info.width > 0xFFFF || info.height > 0xFFFF) {
+        fprintf(stderr, "Error: PNG sprite %d,%d is %ux%u, larger than an SFF sprite can be\n",
+                sprite.Group, sprite.Number, info.width, info.height);
+        return false;
+    }
+
+    // An IHDR larger than the sprite header claims is treated as corrupt
+    if ((sprite.Size[0] != 0 && info.width > sprite.Size[0]) || (sprite.Size[1] != 0 && info.height > sprite.Size[1])) {
+        fprintf(stderr, "Error: PNG sprite %d,%d is %ux%u but header says %dx%d\n",
+                sprite.Group, sprite.Number, info.width, info.height, sprite.Size[0], sprite.Size[1]);
+        return false;
+    }
+
+    sprite.Size[0] = static_cast<uint16_t>(info.width);
+    sprite.Size[1] = static_cast<uint16_t>(info.height);
+    entry.pngColorType = info.colortype;
+    entry.pngBitDepth = info.bitdepth;
+    return true;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::RlePcxDecode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
+    if (srcLen == 0) {
+        fprintf(stderr, "Warning: PCX data length is zero\n");
+        return nullptr;
+    }
+
+    size_t dstLen = static_cast<size_t>(s.Size[0]) * s.Size[1];
+    if (!ReserveDecodedBytes(s, dstLen, 1)) {
+        return nullptr;
+    }
+    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
+    if (!dstPx) {
+        fprintf(stderr, "Error allocating memory for PCX decoded data dstLen=%zu srcLen=%zu (%dx%d)\n",
+                dstLen, srcLen, s.Size[0], s.Size[1]);
+        return nullptr;
+    }
+
+    size_t i = 0; // input pointer
+    size_t j = 0; // output pointer
+
+    while (i < srcLen && j < dstLen) {
+        uint8_t byte = srcPx[i++];
+        int count = 1;
+
+        if ((byte & 0xC0) == 0xC0) { // RLE marker
+            count = byte & 0x3F;
+            if (i < srcLen) {
+                byte = srcPx[i++];
+            } else {
+                fprintf(stderr, "Warning: RLE marker at end of data\n");
+                break;
+            }
+        }
+
+        while (count-- > 0 && j < dstLen) {
+            dstPx[j++] = byte;
+        }
+    }
+
+    if (j < dstLen) {
+        fprintf(stderr, "Warning: decoded PCX data shorter than expected (%zu vs %zu)\n", j, dstLen);
+        // Fill the remaining bytes with 0 (or a background color)
+        memset(dstPx.get() + j, 0, dstLen - j);
+    }
+
+    return dstPx;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::Rle8Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
+    if (srcLen == 0) {
+        fprintf(stderr, "Warning RLE8 data length is zero\n");
+        return nullptr;
+    }
+
+    size_t dstLen = static_cast<size_t>(s.Size[0]) * s.Size[1];
+    if (!ReserveDecodedBytes(s, dstLen, 1)) {
+        return nullptr;
+    }
+    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
+    if (!dstPx) {
+        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
+        return nullptr;
+    }
+
+    size_t i = 0, j = 0;
+    // Decode the RLE data
+    while (j < dstLen) {
+        long n = 1;
+        uint8_t d = srcPx[i];
+        if (i < (srcLen - 1)) {
+            i++;
+        }
+        if ((d & 0xc0) == 0x40) {
+            n = d & 0x3f;
+            d = srcPx[i];
+            if (i < (srcLen - 1)) {
+                i++;
+            }
+        }
+        for (; n > 0; n--) {
+            if (j < dstLen) {
+                dstPx[j] = d;
+                j++;
+            }
+        }
+    }
+
+    return dstPx;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::Rle5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
+    if (srcLen == 0) {
+        fprintf(stderr, "Warning RLE5 data length is zero\n");
+        return nullptr;
+    }
+
+    size_t dstLen = static_cast<size_t>(s.Size[0]) * s.Size[1];
+    if (!ReserveDecodedBytes(s, dstLen, 1)) {
+        return nullptr;
+    }
+    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
+    if (!dstPx) {
+        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
+        return nullptr;
+    }
+
+    size_t i = 0, j = 0;
+    while (j < dstLen) {
+        int rl = static_cast<int>(srcPx[i]);
+        if (i < srcLen - 1) {
+            i++;
+        }
+        int dl = static_cast<int>(srcPx[i] & 0x7f);
+        uint8_t c = 0;
+        if (srcPx[i] >> 7 != 0) {
+            if (i < srcLen - 1) {
+                i++;
+            }
+            c = srcPx[i];
+        }
+        if (i < srcLen - 1) {
+            i++;
+        }
+        while (true) {
+            if (j < dstLen) {
+                dstPx[j] = c;
+                j++;
+            }
+            rl--;
+            if (rl < 0) {
+                dl--;
+                if (dl < 0) {
+                    break;
+                }
+                c = srcPx[i] & 0x1f;
+                rl = static_cast<int>(srcPx[i] >> 5);
+                if (i < srcLen - 1) {
+                    i++;
+                }
+            }
+        }
+    }
+
+    return dstPx;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::Lz5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
+    if (srcLen == 0) {
+        fprintf(stderr, "Warning LZ5 data length is zero\n");
+        return nullptr;
+    }
+
+    size_t dstLen = static_cast<size_t>(s.Size[0]) * s.Size[1];
+    if (!ReserveDecodedBytes(s, dstLen, 1)) {
+        return nullptr;
+    }
+    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
+    if (!dstPx) {
+        fprintf(stderr, "Error allocating memory for LZ5 decoded data\n");
+        return nullptr;
+    }
+
+    // Initialize output buffer to zeros
+    memset(dstPx.get(), 0, dstLen);
+
+    // Decode the LZ5 data
+    size_t i = 0, j = 0;
+    long n = 0;
+    uint8_t ct = srcPx[i], cts = 0, rb = 0, rbc = 0;
+    if (i < srcLen - 1) {
+        i++;
+    }
+
+    while (j < dstLen) {
+        size_t d = static_cast<size_t>(srcPx[i]);
+        if (i < srcLen - 1) {
+            i++;
+        }
+
+        if (ct & (1 << cts)) {
+            if ((d & 0x3f) == 0) {
+                d = (d << 2 | static_cast<int>(srcPx[i])) + 1;
+                if (i < srcLen - 1) {
+                    i++;
+                }
+                n = static_cast<int>(srcPx[i]) + 2;
+                if (i < srcLen - 1) {
+                    i++;
+                }
+            } else {
+                rb |= static_cast<uint8_t>((d & 0xc0) >> rbc);
+                rbc += 2;
+                n = static_cast<int>(d & 0x3f);
+                if (rbc < 8) {
+                    d = static_cast<int>(srcPx[i]) + 1;
+                    if (i < srcLen - 1) {
+                        i++;
+                    }
+                } else {
+                    d = static_cast<int>(rb) + 1;
+                    rb = rbc = 0;
+                }
+            }
+            for (;;) {
+                if (j < dstLen && j >= d) {
+                    dstPx[j] = dstPx[j - d];
+                    j++;
+                } else if (j < dstLen) {
+                    // Handle case where we can't copy from previous data
+                    dstPx[j++] = 0;
+                }
+                n--;
+                if (n < 0) {
+                    break;
+                }
+            }
+        } else {
+            if ((d & 0xe0) == 0) {
+                n = static_cast<int>(srcPx[i]) + 8;
+                if (i < srcLen - 1) {
+                    i++;
+                }
+            } else {
+                n = d >> 5;
+                d &= 0x1f;
+            }
+            while (n-- > 0 && j < dstLen) {
+                dstPx[j] = static_cast<uint8_t>(d);
+                j++;
+            }
+        }
+        cts++;
+        if (cts >= 8) {
+            ct = srcPx[i];
+            cts = 0;
+            if (i < srcLen - 1) {
+                i++;
+            }
+        }
+    }
+
+    return dstPx;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::PngDecode(Sprite& s, const uint8_t* data, size_t datasize) {
+    PngDecoderContext& png = PngDecoderContext::ForThisThread();
+    PngImage image;
+
+    // Size already holds the IHDR dimensions, read by ScanPngHeader during the index pass
+    unsigned height = s.Size[1];
+    size_t pixels = static_cast<size_t>(s.Size[0]) * height;
+
+    // Paletted PNG keeps its indices, everything else is expanded to RGBA
+    if (!ReserveDecodedBytes(s, pixels, s.rle == -10 ? 1 : 4)) {
+        return nullptr;
+    }
+
+    // Filtered scanlines hold at most 8 bytes per pixel (16-bit RGBA), one filter byte
+    // per row, plus slack for the Adam7 passes
+    size_t maxScanlines = pixels * (s.rle == -10 ? 1 : 8) + 2 * static_cast<size_t>(height) + 8;
+
+    bool premultiply = premultiplyAlpha_ && s.rle != -10;
+    unsigned status = png.Decode(data, datasize, s.rle == -10 ? LCT_PALETTE : LCT_RGBA, maxScanlines,
+                                 premultiply, image);
+    if (status != 0) {
+        fprintf(stderr, "Could not decode PNG image(%s)\n", lodepng_error_text(status));
+        return nullptr;
+    }
+
+    // Update sprite dimensions
+    s.Size[0] = static_cast<uint16_t>(image.width);
+    s.Size[1] = static_cast<uint16_t>(image.height);
+    s.premultiplied = premultiply;
+
+    // The decoded pixels live in the context's scratch arena, so hand out a copy
+    auto result = std::make_unique<uint8_t[]>(image.size);
+    memcpy(result.get(), image.pixels, image.size);
+
+    return result;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::TrimTransparentBorders(Sprite& s, std::unique_ptr<uint8_t[]> px) {
+    int w = s.Size[0];
+    int h = s.Size[1];
+    int bpp = s.IsRGBA() ? 4 : 1;
+    int left, top, right, bottom;
+    if (!FindVisibleBounds(px.get(), w, h, bpp, left, top, right, bottom)) {
+        // Nothing visible, keep a single transparent pixel so the sprite still has a texture
+        left = top = right = bottom = 0;
+    }
+
+    int trimmedW = right - left + 1;
+    int trimmedH = bottom - top + 1;
+    if (trimmedW == w && trimmedH == h) {
+        return px;
+    }
+
+    size_t rowBytes = static_cast<size_t>(trimmedW) * bpp;
+    std::unique_ptr<uint8_t[]> trimmed(new uint8_t[rowBytes * trimmedH]);
+    for (int y = 0; y < trimmedH; y++) {
+        memcpy(trimmed.get() + y * rowBytes,
+               px.get() + (static_cast<size_t>(top + y) * w + left) * bpp, rowBytes);
+    }
+
+    trimmedBytes_ += (static_cast<size_t>(w) * h - static_cast<size_t>(trimmedW) * trimmedH) * bpp;
+    s.Size[0] = static_cast<uint16_t>(trimmedW);
+    s.Size[1] = static_cast<uint16_t>(trimmedH);
+    s.Offset[0] = static_cast<int16_t>(s.Offset[0] - left);
+    s.Offset[1] = static_cast<int16_t>(s.Offset[1] - top);
+    return trimmed;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::DecodeSprite(Sprite& sprite, FILE* file, SpriteIndexEntry& entry, Sprite* prev) {
+    std::unique_ptr<uint8_t[]> data;
+    bool character = true; // This should be determined properly
+
+    switch (header_.Ver0) {
+        case 1:
+            // The palette flag follows the 18 bytes ReadSpriteHeaderV1 consumed
+            fseek(file, entry.headerOffset + 18, SEEK_SET);
+            data = ReadSpriteDataV1(sprite, file, entry.headerOffset + 32, entry.dataSize,
+                                    entry.dataOffset, prev, character);
+            break;
+        case 2:
+            data = ReadSpriteDataV2(sprite, file, entry.dataOffset, entry.dataSize);
+            break;
+    }
+
+    if (data) {
+        entry.width = sprite.Size[0];
+        entry.height = sprite.Size[1];
+        if (trimBorders_) {
+            data = TrimTransparentBorders(sprite, std::move(data));
+        }
+    }
+    return data;
+}
+
+// Decodes sprite index again into scratch, a copy of it with the untrimmed size, so the
+// loaded sprite and the load statistics stay as they are
+std::unique_ptr<uint8_t[]> SffFile::DecodeSpriteCopy(FILE* file, uint32_t index, Sprite& scratch) {
+    scratch.CopyFrom(sprites_[index]);
+    scratch.texture.Reset();
+    scratch.Size[0] = index_[index].width;
+    scratch.Size[1] = index_[index].height;
+
+    size_t decodedBytes = decodedBytes_;
+    size_t trimmedBytes = trimmedBytes_;
+    size_t sharedPalettes = numSharedPalettes_;
+    bool premultiplyAlpha = premultiplyAlpha_;
+    // The load limit applies to this sprite alone, and the pixels are premultiplied the way
+    // the loaded sprite is blended, whatever SetPremultiplyAlpha() says now
+    decodedBytes_ = 0;
+    premultiplyAlpha_ = sprites_[index].premultiplied;
+    // v1 sprites reusing the previous palette read it from prev, which is the sprite itself here
+    std::unique_ptr<uint8_t[]> data = DecodeSprite(scratch, file, index_[index], &sprites_[index]);
+    decodedBytes_ = decodedBytes;
+    trimmedBytes_ = trimmedBytes;
+    numSharedPalettes_ = sharedPalettes;
+    premultiplyAlpha_ = premultiplyAlpha;
+    return data;
+}
+
+// Decodes sprite index again for a texture the VRAM budget evicted
+std::unique_ptr<uint8_t[]> SffFile::RedecodeSprite(FILE* file, uint32_t index) {
+    const Sprite& loaded = sprites_[index];
+    Sprite scratch;
+    std::unique_ptr<uint8_t[]> data = DecodeSpriteCopy(file, index, scratch);
+
+    if (data && (scratch.Size[0] != loaded.Size[0] || scratch.Size[1] != loaded.Size[1])) {
+        fprintf(stderr, "Error: sprite %d,%d changed size since it was loaded\n", loaded.Group, loaded.Number);
+        return nullptr;
+    }
+    return data;
+}
+
+std::unique_ptr<uint8_t[]> SffFile::DecodeSpritePixels(uint32_t index, int& width, int& height,
+                                                       int& offsetX, int& offsetY) {
+    width = height = offsetX = offsetY = 0;
+    if (index >= sprites_.size()) {
+        return nullptr;
+    }
+    // Links always point back, so this ends
+    while (index_[index].dataSize == 0 && index_[index].link < index) {
+        index = index_[index].link;
+    }
+    if (index_[index].dataSize == 0) {
+        return nullptr;
+    }
+
+    FILE* file = fopen(filename_.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot reopen %s to decode sprite %u\n", filename_.c_str(), index);
+        return nullptr;
+    }
+    Sprite scratch;
+    std::unique_ptr<uint8_t[]> data = DecodeSpriteCopy(file, index, scratch);
+    PngDecoderContext::ForThisThread().ReleaseScratch();
+    fclose(file);
+    if (data) {
+        width = scratch.Size[0];
+        height = scratch.Size[1];
+        // scratch started from the loaded offset, which a full load has trimmed already
+        const Sprite& loaded = decodeDeferred_ ? scratch : sprites_[index];
+        offsetX = loaded.Offset[0];
+        offsetY = loaded.Offset[1];
+    }
+    return data;
+}
+
+bool SffFile::ReloadSpriteTexture(uint32_t index, Texture2D& texture) {
+    FILE* file = fopen(filename_.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot reopen %s to reload sprite %u\n", filename_.c_str(), index);
+        return false;
+    }
+    std::unique_ptr<uint8_t[]> data = RedecodeSprite(file, index);
+    PngDecoderContext::ForThisThread().ReleaseScratch();
+    fclose(file);
+    if (!data) {
+        return false;
+    }
+
+    texture.id = rlLoadTexture(data.get(), texture.width, texture.height, texture.format, 1);
+    if (texture.format == PIXELFORMAT_UNCOMPRESSED_GRAYSCALE) {
+        SetTextureFilter(texture, TEXTURE_FILTER_POINT);
+    }
+    return texture.id != 0;
+}
+
+bool SffFile::ReloadAtlasPage(int page, Texture2D& texture) {
+    FILE* file = fopen(filename_.c_str(), "rb");
+    if (!file) {
+        fprintf(stderr, "Error: cannot reopen %s to reload atlas page %d\n", filename_.c_str(), page);
+        return false;
+    }
+
+    // Index 0 and alpha 0 are transparent, so the zero fill restores the padding as well
+    size_t bytesPerPixel = texture.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 ? 4 : 1;
+    std::vector<uint8_t> pixels(static_cast<size_t>(texture.width) * texture.height * bytesPerPixel, 0);
+    bool ok = true;
+    for (uint32_t i = 0; i < sprites_.size() && ok; i++) {
+        if (sprites_[i].atlasPage != page || index_[i].dataSize == 0) {
+            continue;
+        }
+        std::unique_ptr<uint8_t[]> data = RedecodeSprite(file, i);
+        if (!data) {
+            ok = false;
+            break;
+        }
+        const Rectangle& rect = sprites_[i].atlasRect;
+        int x = static_cast<int>(rect.x), y = static_cast<int>(rect.y);
+        int w = static_cast<int>(rect.width), h = static_cast<int>(rect.height);
+        size_t rowBytes = static_cast<size_t>(w) * bytesPerPixel;
+        for (int row = 0; row < h; row++) {
+            memcpy(pixels.data() + (static_cast<size_t>(y + row) * texture.width + x) * bytesPerPixel,
+                   data.get() + row * rowBytes, rowBytes);
+        }
+    }
+    PngDecoderContext::ForThisThread().ReleaseScratch();
+    fclose(file);
+    if (!ok) {
+        return false;
+    }
+
+    texture.id = rlLoadTexture(pixels.data(), texture.width, texture.height, texture.format, 1);
+    SetTextureFilter(texture, TEXTURE_FILTER_POINT);
+    return texture.id != 0;
+}
+
+void SffFile::ReleaseOwnedTextures() {
+    // Textures still shared elsewhere can no longer be reloaded from this file, so pin them
+    for (TextureHandle& texture : ownedTextures_) {
+        texture.SetReloader(nullptr);
+    }
+    ownedTextures_.clear();
+    VramBudget::Instance().RemoveSharedBytes(sharedBytes_);
+    sharedBytes_ = 0;
+}
+
+bool SffFile::HashPayload(FILE* file, SpriteIndexEntry& entry, std::vector<uint8_t>& buffer) {
+    if (!CheckPayload(entry.dataOffset, entry.dataSize)) {
+        return false;
+    }
+    buffer.resize(entry.dataSize);
+    fseek(file, entry.dataOffset, SEEK_SET);
+    if (fread(buffer.data(), 1, entry.dataSize, file) != entry.dataSize) {
+        fprintf(stderr, "Error reading sprite data at 0x%X\n", entry.dataOffset);
+        return false;
+    }
+    entry.payloadHash = HashBytes64(buffer.data(), buffer.size(), entry.dataSize);
+    return true;
+}
+
+SffReloadResult SffFile::Reload() {
+    if (filename_.empty()) {
+        return SFF_RELOAD_FAILED;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SffReloadResult result;
+    if (!trackChanges_) {
+        result = ReloadFull("change tracking is off");
+    } else if (header_.Ver0 != 2) {
+        result = ReloadFull("SFF v1 keeps its palettes in the sprite data");
+    } else {
+        FILE* file = fopen(filename_.c_str(), "rb");
+        if (!file) {
+            fprintf(stderr, "Error: cannot reopen %s to reload it\n", filename_.c_str());
+            return SFF_RELOAD_FAILED;
+        }
+        const char* fullReason = nullptr;
+        uint64_t loadedFileSize = fileSize_;
+        try {
+            result = ReloadChanged(file, fullReason);
+        } catch (const std::runtime_error& e) {
+            // Usually a file caught halfway through being written, the next change retries
+            fprintf(stderr, "Error: reloading %s: %s\n", filename_.c_str(), e.what());
+            fileSize_ = loadedFileSize;
+            result = SFF_RELOAD_FAILED;
+        }
+        PngDecoderContext::ForThisThread().ReleaseScratch();
+        fclose(file);
+        if (result == SFF_RELOAD_FULL) {
+            result = ReloadFull(fullReason);
+        }
+    }
+
+    if (result != SFF_RELOAD_FAILED) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        printf("Reload: %s %s in %.2f ms\n", filename_.c_str(),
+               result == SFF_RELOAD_INCREMENTAL ? "updated" : "loaded again", ms);
+    }
+    return result;
+}
+
+// Loads the file into a second SffFile with the same settings and swaps it in once it loaded,
+// so a broken file (or a full shared palette atlas) leaves what was loaded as it is
+SffReloadResult SffFile::ReloadFull(const char* reason) {
+    printf("Reload: %s, loading %s again\n", reason, filename_.c_str());
+    SffFile reloaded;
+    reloaded.limits_ = limits_;
+    reloaded.premultiplyAlpha_ = premultiplyAlpha_;
+    reloaded.trimBorders_ = trimBorders_;
+    reloaded.dedupImages_ = dedupImages_;
+    reloaded.deferDecode_ = deferDecode_;
+    reloaded.trackChanges_ = trackChanges_;
+    reloaded.atlasPageSize_ = atlasPageSize_;
+    if (!ownsPaletteAtlas_) {
+        reloaded.paletteAtlas_ = paletteAtlas_;
+    }
+    bool loaded = false;
+    try {
+        loaded = reloaded.Load(filename_);
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Error: reloading %s: %s\n", filename_.c_str(), e.what());
+    }
+    if (!loaded) {
+        return SFF_RELOAD_FAILED;
+    }
+
+    // The old contents leave with reloaded, which releases them like Clear()
+    Swap(reloaded);
+    BindReloaders();
+    return SFF_RELOAD_FULL;
+}
+
+void SffFile::Swap(SffFile& other) {
+    std::swap(filename_, other.filename_);
+    std::swap(header_, other.header_);
+    std::swap(sprites_, other.sprites_);
+    std::swap(index_, other.index_);
+    std::swap(lookup_, other.lookup_);
+    std::swap(palettes_, other.palettes_);
+    std::swap(paletteAtlas_, other.paletteAtlas_);
+    std::swap(atlasPages_, other.atlasPages_);
+    std::swap(ownedTextures_, other.ownedTextures_);
+    std::swap(palette_usage_, other.palette_usage_);
+    std::swap(paletteByRow_, other.paletteByRow_);
+    std::swap(compression_format_usage_, other.compression_format_usage_);
+    std::swap(numLinkedSprites_, other.numLinkedSprites_);
+    std::swap(limits_, other.limits_);
+    std::swap(fileSize_, other.fileSize_);
+    std::swap(decodedBytes_, other.decodedBytes_);
+    std::swap(trimmedBytes_, other.trimmedBytes_);
+    std::swap(dedupedBytes_, other.dedupedBytes_);
+    std::swap(numDedupedSprites_, other.numDedupedSprites_);
+    std::swap(numSharedPalettes_, other.numSharedPalettes_);
+    std::swap(sharedBytes_, other.sharedBytes_);
+    std::swap(premultiplyAlpha_, other.premultiplyAlpha_);
+    std::swap(trimBorders_, other.trimBorders_);
+    std::swap(dedupImages_, other.dedupImages_);
+    std::swap(deferDecode_, other.deferDecode_);
+    std::swap(decodeDeferred_, other.decodeDeferred_);
+    std::swap(trackChanges_, other.trackChanges_);
+    std::swap(ownsPaletteAtlas_, other.ownsPaletteAtlas_);
+    std::swap(atlasPageSize_, other.atlasPageSize_);
+    std::swap(paletteHashes_, other.paletteHashes_);
+    std::swap(pending_, other.pending_);
+}
+
+// Evicted textures are decoded again from this file. The reloaders point at this object, so
+// they are bound after Load() and again after Swap().
+void SffFile::BindReloaders() {
+    for (uint32_t i = 0; i < sprites_.size(); i++) {
+        // Sprites sharing a texture through dedup have identical pixels, any of them will do
+        if (index_[i].dataSize != 0 && sprites_[i].atlasPage < 0 && sprites_[i].texture) {
+            sprites_[i].texture.SetReloader([this, i](Texture2D& t) { return ReloadSpriteTexture(i, t); });
+        }
+    }
+    for (size_t page = 0; page < atlasPages_.size(); page++) {
+        atlasPages_[page].SetReloader([this, page](Texture2D& t) { return ReloadAtlasPage(static_cast<int>(page), t); });
+    }
+}
+
+// Compares the file on disk with what was loaded. Nothing is changed unless every difference
+// can be applied in place, otherwise the result is SFF_RELOAD_FULL with fullReason set.
+SffReloadResult SffFile::ReloadChanged(FILE* file, const char*& fullReason) {
+    fseek(file, 0, SEEK_END);
+    long endOfFile = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint64_t loadedFileSize = fileSize_;
+    fileSize_ = endOfFile > 0 ? static_cast<uint64_t>(endOfFile) : 0;
+
+    SffHeader loaded = header_;
+    uint32_t lofs, tofs;
+    bool headerRead = ReadHeader(file, lofs, tofs);
+    SffHeader changed = header_;
+    header_ = loaded;
+    if (!headerRead) {
+        fileSize_ = loadedFileSize;
+        return SFF_RELOAD_FAILED;
+    }
+    if (changed.Ver0 != 2 || changed.NumberOfSprites != loaded.NumberOfSprites ||
+        changed.NumberOfPalettes != loaded.NumberOfPalettes) {
+        fullReason = "the number of sprites or palettes changed";
+        return SFF_RELOAD_FULL;
+    }
+
+    // Palettes, repeated group and number pairs follow the first one like in Load()
+    std::unordered_map<std::array<int, 2>, int, ArrayHash> uniquePals;
+    std::vector<int> duplicateOf(changed.NumberOfPalettes, -1);
+    std::vector<uint64_t> paletteHashes(changed.NumberOfPalettes);
+    std::vector<std::pair<uint32_t, std::array<uint8_t, 256 * 4>>> changedPalettes;
+    int newRows = 0;
+    for (uint32_t i = 0; i < changed.NumberOfPalettes; i++) {
+        fseek(file, changed.FirstPaletteHeaderOffset + i * 16, SEEK_SET);
+        std::array<int, 2> key;
+        key[0] = static_cast<int16_t>(ReadU16LE(file));
+        key[1] = static_cast<int16_t>(ReadU16LE(file));
+        ReadU16LE(file);  // colnumber
+        ReadU16LE(file);  // link
+        uint32_t ofs = ReadU32LE(file);
+
+        auto it = uniquePals.find(key);
+        if (it != uniquePals.end()) {
+            duplicateOf[i] = it->second;
+            paletteHashes[i] = paletteHashes[it->second];
+        } else {
+            uniquePals[key] = static_cast<int>(i);
+            fseek(file, lofs + ofs, SEEK_SET);
+            std::array<uint32_t, 256> rgba;
+            if (fread(rgba.data(), sizeof(uint32_t), 256, file) != 256) {
+                fprintf(stderr, "Failed to read palette data: %s\n", filename_.c_str());
+                fileSize_ = loadedFileSize;
+                return SFF_RELOAD_FAILED;
+            }
+            std::array<uint8_t, 256 * 4> colors = ConvertPalette(rgba);
+            paletteHashes[i] = HashBytes64(colors.data(), colors.size(), 0);
+            if (paletteHashes[i] != paletteHashes_[i]) {
+                changedPalettes.emplace_back(i, colors);
+                newRows++;
+            }
+        }
+        if (duplicateOf[i] >= 0 && paletteHashes[i] != paletteHashes_[i]) {
+            changedPalettes.emplace_back(i, std::array<uint8_t, 256 * 4>());
+        }
+    }
+    // New colours get rows of their own, rows of other palettes (maybe of other files) keep theirs
+    if (newRows > paletteAtlas_->GetCapacity() - paletteAtlas_->GetRowCount()) {
+        fullReason = "the palette atlas has no spare rows left";
+        return SFF_RELOAD_FULL;
+    }
+
+    // Sprite index, the payload hashes tell which sprites have to be decoded again
+    std::vector<Sprite> headers(changed.NumberOfSprites);
+    std::vector<SpriteIndexEntry> entries(changed.NumberOfSprites);
+    std::vector<uint32_t> changedSprites;
+    std::vector<uint8_t> payload;
+    long shofs = changed.FirstSpriteHeaderOffset;
+    for (uint32_t i = 0; i < changed.NumberOfSprites; i++, shofs += 28) {
+        SpriteIndexEntry& entry = entries[i];
+        entry.headerOffset = static_cast<uint32_t>(shofs);
+        fseek(file, shofs, SEEK_SET);
+        bool success = ReadSpriteHeaderV2(headers[i], file, entry.dataOffset, entry.dataSize, lofs, tofs, entry.link);
+        if (success && entry.dataSize != 0 && headers[i].IsPng()) {
+            success = ScanPngHeader(headers[i], file, entry);
+        }
+        if (success && entry.dataSize != 0) {
+            success = HashPayload(file, entry, payload);
+        }
+        if (!success) {
+            fileSize_ = loadedFileSize;
+            return SFF_RELOAD_FAILED;
+        }
+
+        entry.headerHash = HashSpriteHeader(headers[i], entry);
+        if (entry.headerHash != index_[i].headerHash) {
+            fullReason = "a sprite header changed";
+            return SFF_RELOAD_FULL;
+        }
+        // An unchanged header decodes to the same size
+        entry.width = index_[i].width;
+        entry.height = index_[i].height;
+        if (entry.dataSize != 0 && entry.payloadHash != index_[i].payloadHash) {
+            changedSprites.push_back(i);
+        }
+    }
+
+    // Decode the changed sprites against the new index before touching any texture
+    index_.swap(entries);
+    std::vector<std::pair<uint32_t, std::unique_ptr<uint8_t[]>>> updates;
+    for (uint32_t i : changedSprites) {
+        const Sprite& sprite = sprites_[i];
+        if (!sprite.texture) {
+            continue;  // Decoding is deferred, DecodeSpritePixels() reads the new data
+        }
+        for (uint32_t j = 0; j < sprites_.size() && !fullReason; j++) {
+            const Sprite& other = sprites_[j];
+            if (j != i && index_[j].dataSize != 0 && &other.texture.Get() == &sprite.texture.Get() &&
+                other.atlasRect.x == sprite.atlasRect.x && other.atlasRect.y == sprite.atlasRect.y) {
+                fullReason = "a changed sprite shared its image with another sprite";
+            }
+        }
+
+        Sprite scratch;
+        std::unique_ptr<uint8_t[]> data;
+        try {
+            data = fullReason ? nullptr : DecodeSpriteCopy(file, i, scratch);
+        } catch (const std::runtime_error&) {
+            index_.swap(entries);
+            throw;
+        }
+        // Trimming crops the new pixels by themselves, they only fit if the crop is the same
+        if (data && (scratch.Size[0] != sprite.Size[0] || scratch.Size[1] != sprite.Size[1] ||
+                     headers[i].Offset[0] - (sprite.Offset[0] - scratch.Offset[0]) != sprite.Offset[0] ||
+                     headers[i].Offset[1] - (sprite.Offset[1] - scratch.Offset[1]) != sprite.Offset[1])) {
+            fullReason = "a changed sprite has a different size";
+        }
+        if (!data || fullReason) {
+            index_.swap(entries);
+            if (fullReason) {
+                return SFF_RELOAD_FULL;
+            }
+            fprintf(stderr, "Error: cannot decode the new data of sprite %d,%d\n", sprite.Group, sprite.Number);
+            fileSize_ = loadedFileSize;
+            return SFF_RELOAD_FAILED;
+        }
+        updates.emplace_back(i, std::move(data));
+    }
+
+    // Everything fits, apply it
+    header_ = changed;
+    for (const auto& update : changedPalettes) {
+        uint32_t i = update.first;
+        int row = duplicateOf[i] >= 0 ? palettes_[duplicateOf[i]].row : paletteAtlas_->FindOrAddRow(update.second.data());
+        if (row >= 0) {
+            palettes_[i].row = row;
+            paletteHashes_[i] = paletteHashes[i];
+        }
+    }
+    paletteAtlas_->Commit();
+
+    for (const auto& update : updates) {
+        const Sprite& sprite = sprites_[update.first];
+        const Texture2D& texture = sprite.texture.Get();
+        // Evicted textures are decoded from the new data whenever they are used again
+        if (texture.id != 0) {
+            rlUpdateTexture(texture.id, static_cast<int>(sprite.atlasRect.x), static_cast<int>(sprite.atlasRect.y),
+                            sprite.Size[0], sprite.Size[1], texture.format, update.second.get());
+        }
+    }
+    printf("Reload: %zu of %zu sprites and %zu palettes changed\n", changedSprites.size(), sprites_.size(),
+           changedPalettes.size());
+    return SFF_RELOAD_INCREMENTAL;
+}
+
+VramUsage SffFile::GetVramUsage() const {
+    VramUsage usage;
+    for (const TextureHandle& texture : ownedTextures_) {
+        if (texture.IsResident()) {
+            usage.bytes[texture.GetCategory()] += texture.GetBytes();
+        }
+    }
+    usage.sharedBytes = sharedBytes_;
+    return usage;
+}
+
+int SffFile::AddPalette(const std::array<uint8_t, 256 * 4>& pal_byte, bool reuseEntry) {
+    // Identical colour tables share one atlas row, also across files sharing the atlas
+    bool added = false;
+    int row = paletteAtlas_->FindOrAddRow(pal_byte.data(), &added);
+    if (row < 0) {
+        fprintf(stderr, "Error: palette atlas is full (%d rows)\n", paletteAtlas_->GetRowCount());
+        return -1;
+    }
+    if (!added) {
+        numSharedPalettes_++;
+    }
+
+    auto it = paletteByRow_.find(row);
+    if (reuseEntry && it != paletteByRow_.end()) {
+        return it->second;
+    }
+
+    // The atlas texture is assigned once all rows are committed at the end of Load()
+    int index = static_cast<int>(palettes_.size());
+    palettes_.emplace_back(TextureHandle(), row);
+    paletteByRow_.emplace(row, index);
+    return index;
+}
+
+std::array<uint8_t, 256 * 4> SffFile::ConvertPalette(const std::array<uint32_t, 256>& pal_rgba) {
+    std::array<uint8_t, 256 * 4> pal_byte;
+
+    // Convert the RGBA values into bytes (0-255 range for each channel)
+    for (int i = 0; i < 256; i++) {
+        pal_byte[i * 4 + 0] = (pal_rgba[i] >> 0) & 0xFF;  // R
+        pal_byte[i * 4 + 1] = (pal_rgba[i] >> 8) & 0xFF;  // G
+        pal_byte[i * 4 + 2] = (pal_rgba[i] >> 16) & 0xFF; // B
+        pal_byte[i * 4 + 3] = (pal_rgba[i] >> 24) & 0xFF; // A
+    }
+
+    return pal_byte;
+}
+
+std::array<uint8_t, 256 * 4> SffFile::ConvertPalette(const std::array<RGB, 256>& pal_rgb) {
+    std::array<uint8_t, 256 * 4> pal_byte;
+
+    // Convert the RGB values into bytes (0-255 range for each channel) in reverse order
+    for (int i = 0; i < 256; i++) {
+        pal_byte[i * 4 + 0] = pal_rgb[255 - i].r; // R
+        pal_byte[i * 4 + 1] = pal_rgb[255 - i].g; // G
+        pal_byte[i * 4 + 2] = pal_rgb[255 - i].b; // B
+        pal_byte[i * 4 + 3] = i ? 255 : 0;        // A (transparent for index 0)
+    }
+
+    return pal_byte;
+}
+
+// Most efficient version - relies on palette texture having proper alpha (it is working)
+// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
+// "precision mediump float;\n"
+// "in vec2 fragTexCoord;\n"
+// "in vec4 fragColor;\n"
+// "uniform sampler2D texture0;\n"
+// "uniform sampler2D paletteTex;\n"
+// "out vec4 finalColor;\n"
+// "void main()\n"
+// "{\n"
+// "    vec4 texel = texture(texture0, fragTexCoord);\n"
+// "    // Get palette index from grayscale texture (0-255 range)\n"
+// "    float index = texel.r * 255.0;\n"
+// "    \n"
+// "    // Convert to normalized texture coordinate\n"
+// "    float paletteCoord = (index + 0.5) / 256.0;\n"
+// "    // Sample the palette texture - it should have alpha=0 for index 0\n"
+// "    vec4 color = texture(paletteTex, vec2(paletteCoord, 0.5));\n"
+// "    \n"
+// "    // Use the palette's alpha channel directly\n"
+// "    finalColor = vec4(color.rgb * fragColor.rgb, color.a * fragColor.a);\n"
+// "}\n";
+
+// Shader optimized for NEAREST filtering (now it's working)
+// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
+// "in vec2 fragTexCoord;\n"
+// "in vec4 fragColor;\n"
+// "uniform sampler2D texture0;    // Indexed sprite texture\n"
+// "uniform sampler2D paletteTex;    // Palette texture\n"
+// "out vec4 finalColor;\n"
+// "void main()\n"
+// "{\n"
+// "    // Sample the indexed texture with NEAREST filtering\n"
+// "    vec4 texel = texture(texture0, fragTexCoord);\n"
+// "    \n"
+// "    // Get palette index (0-255) - use proper rounding for NEAREST\n"
+// "    int index = int(texel.r * 255.0 + 0.5);\n"
+// "    \n"
+// "    // Calculate EXACT texel center for palette texture with NEAREST filtering\n"
+// "    float paletteCoord = (float(index) + 0.5) / 256.0;\n"
+// "    \n"
+// "    // Sample the palette texture with NEAREST filtering\n"
+// "    vec4 color = texture(paletteTex, vec2(paletteCoord, 0.5));\n"
+// "    \n"
+// "    // Use palette alpha and apply vertex color\n"
+// "    finalColor = vec4(color.rgb, color.a) * fragColor;\n"
+// "}\n";
+
+// Alternative: Use texelFetch for maximum precision with NEAREST filtering (now it's working)
+// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
+// "in vec2 fragTexCoord;\n"
+// "in vec4 fragColor;\n"
+// "uniform sampler2D texture0;    // Indexed sprite texture\n"
+// "uniform sampler2D paletteTex;    // Palette texture\n"
+// "out vec4 finalColor;\n"
+// "void main()\n"
+// "{\n"
+// "    // Sample indexed texture\n"
+// "    vec4 texel = texture(texture0, fragTexCoord);\n"
+// "    \n"
+// "    // Convert to integer index (0-255)\n"
+// "    int index = int(texel.r * 255.0 + 0.5);\n"
+// "    \n"
+// "    // Use texelFetch for exact pixel access - perfect for NEAREST\n"
+// "    vec4 color = texelFetch(paletteTex, ivec2(index, 0), 0);\n"
+// "    \n"
+// "    // Output final color\n"
+// "    finalColor = vec4(color.rgb, color.a) * fragColor;\n"
+// "}\n";
+
+// PalFX (MUGEN palette effects) as GLSL. Like MUGEN, fxAdd.rgb is added first and the sum is
+// then scaled by 1 + fxMul.rgb (fxMul.rgb is the multiplier minus one). fxAdd.a inverts and
+// fxMul.a is the greyscale amount, so all-zero parameters change nothing.
+std::string GetPalFxFunction() {
+    return
+        "vec3 applyPalFx(vec3 c, vec4 fxAdd, vec4 fxMul) \n"
+        "{                                  \n"
+        "    c = mix(c, vec3(1.0) - c, fxAdd.a); \n"
+        "    float grey = (c.r + c.g + c.b) / 3.0; \n"
+        "    c = mix(c, vec3(grey), fxMul.a); \n"
+        "    return clamp((c + fxAdd.rgb) * (vec3(1.0) + fxMul.rgb), 0.0, 1.0); \n"
+        "}                                  \n";
+}
+
+// Feature bits selecting a sprite shader variant. Each variant only contains the code its
+// features need, so plain sprites don't pay for PalFX or the palette lookup.
+enum SpriteShaderFeature {
+    SHADER_PALETTED      = 1 << 0,  // Indexed texture looked up in paletteTex, otherwise RGBA
+    SHADER_PALETTE_ATLAS = 1 << 1,  // Palette row from paletteRow, otherwise a one-row palette
+    SHADER_PALFX         = 1 << 2,  // Apply PalFX, see GetPalFxFunction()
+    SHADER_ALPHA_TEST    = 1 << 3,  // Discard texels with alpha below 0.5
+    SHADER_VERTEX_PARAMS = 1 << 4   // Palette row and PalFX come from vertex attributes (SpriteBatch)
+};
 
-    // Read format
-    char format;
-    if (fread(&format, sizeof(char), 1, file) != 1) {
-        fprintf(stderr, "Error reading sprite format\n");
+// GLSL keywords that differ between the GL versions rlgl can run on
+struct GlslDialect {
+    std::string version;
+    std::string precision;
+    std::string attribute;   // Vertex shader input qualifier
+    std::string varyingOut;  // Vertex shader output qualifier
+    std::string varyingIn;   // Fragment shader input qualifier
+    std::string output;      // Fragment output declaration, empty for gl_FragColor
+    std::string textureFunc;
+    std::string outputVar;
+};
+
+static GlslDialect GetGlslDialect(int glVersion) {
+    GlslDialect dialect;
+    switch (glVersion) {
+        case RL_OPENGL_21: // OpenGL 2.1
+            dialect.version = "#version 120";
+            dialect.attribute = "attribute";
+            dialect.varyingOut = dialect.varyingIn = "varying";
+            dialect.textureFunc = "texture2D";
+            dialect.outputVar = "gl_FragColor";
+            break;
+
+        case RL_OPENGL_33: // OpenGL 3.3
+            dialect.version = "#version 330";
+            dialect.attribute = dialect.varyingIn = "in";
+            dialect.varyingOut = "out";
+            dialect.output = "out vec4 finalColor;";
+            dialect.textureFunc = "texture";
+            dialect.outputVar = "finalColor";
+            break;
+
+        case RL_OPENGL_ES_30: // OpenGL ES 3.0
+            dialect.version = "#version 300 es";
+            dialect.precision = "precision mediump float;\nprecision mediump sampler2D;";
+            dialect.attribute = dialect.varyingIn = "in";
+            dialect.varyingOut = "out";
+            dialect.output = "out vec4 finalColor;";
+            dialect.textureFunc = "texture";
+            dialect.outputVar = "finalColor";
+            break;
+
+        case RL_OPENGL_ES_20: // OpenGL ES 2.0
+        default:
+            dialect.version = "#version 100";
+            dialect.precision = "precision mediump float;";
+            dialect.attribute = "attribute";
+            dialect.varyingOut = dialect.varyingIn = "varying";
+            dialect.textureFunc = "texture2D";
+            dialect.outputVar = "gl_FragColor";
+            break;
+    }
+    return dialect;
+}
+
+// Builds the vertex shader of a variant for glVersion
+std::string BuildSpriteVertexShader(int glVersion, unsigned int features) {
+    GlslDialect dialect = GetGlslDialect(glVersion);
+    bool vertexRow = (features & SHADER_VERTEX_PARAMS) && (features & SHADER_PALETTED) &&
+                     (features & SHADER_PALETTE_ATLAS);
+    bool vertexFx = (features & SHADER_VERTEX_PARAMS) && (features & SHADER_PALFX);
+
+    std::string source = dialect.version + "\n";
+    if (!dialect.precision.empty()) {
+        source += dialect.precision + "\n";
+    }
+    source += dialect.attribute + " vec3 vertexPosition;\n" +
+              dialect.attribute + " vec2 vertexTexCoord;\n" +
+              dialect.attribute + " vec4 vertexColor;\n" +
+              dialect.varyingOut + " vec2 fragTexCoord;\n" +
+              dialect.varyingOut + " vec4 fragColor;\n";
+    if (vertexRow) {
+        source += dialect.attribute + " float vertexPaletteRow;\n" +
+                  dialect.varyingOut + " float fragPaletteRow;\n";
+    }
+    if (vertexFx) {
+        source += dialect.attribute + " vec4 vertexPalFxAdd;\n" +
+                  dialect.attribute + " vec4 vertexPalFxMul;\n" +
+                  dialect.varyingOut + " vec4 fragPalFxAdd;\n" +
+                  dialect.varyingOut + " vec4 fragPalFxMul;\n";
+    }
+    source += "uniform mat4 mvp;\n"
+              "void main()\n"
+              "{\n"
+              "    fragTexCoord = vertexTexCoord;\n"
+              "    fragColor = vertexColor;\n";
+    if (vertexRow) {
+        source += "    fragPaletteRow = vertexPaletteRow;\n";
+    }
+    if (vertexFx) {
+        source += "    fragPalFxAdd = vertexPalFxAdd;\n"
+                  "    fragPalFxMul = vertexPalFxMul;\n";
+    }
+    source += "    gl_Position = mvp * vec4(vertexPosition, 1.0);\n"
+              "}";
+    return source;
+}
+
+// Builds the fragment shader of a variant for glVersion
+std::string BuildSpriteFragmentShader(int glVersion, unsigned int features) {
+    GlslDialect dialect = GetGlslDialect(glVersion);
+    bool paletted = (features & SHADER_PALETTED) != 0;
+    bool atlas = paletted && (features & SHADER_PALETTE_ATLAS);
+    bool palfx = (features & SHADER_PALFX) != 0;
+    bool perVertex = (features & SHADER_VERTEX_PARAMS) != 0;
+    const std::string& tex = dialect.textureFunc;
+
+    std::string source = dialect.version + "\n";
+    if (!dialect.precision.empty()) {
+        source += dialect.precision + "\n";
+    }
+    source += dialect.varyingIn + " vec2 fragTexCoord;\n" +
+              dialect.varyingIn + " vec4 fragColor;\n";
+    if (!dialect.output.empty()) {
+        source += dialect.output + "\n";
+    }
+    source += "uniform sampler2D texture0;\n"  // Indexed or RGBA sprite texture
+              "uniform vec4 colDiffuse;\n";
+    if (paletted) {
+        source += "uniform sampler2D paletteTex;\n";  // Palette atlas, one palette per row
+    } else if (palfx) {
+        source += "uniform float premultipliedAlpha;\n";
+    }
+    if (atlas) {
+        // v coordinate of the palette row (Palette::GetRowCoord)
+        source += perVertex ? dialect.varyingIn + " float fragPaletteRow;\n" : "uniform float paletteRow;\n";
+    }
+    if (palfx) {
+        source += perVertex ? dialect.varyingIn + " vec4 fragPalFxAdd;\n" + dialect.varyingIn + " vec4 fragPalFxMul;\n"
+                            : "uniform vec4 palfxAdd;\nuniform vec4 palfxMul;\n";
+        source += GetPalFxFunction();
+    }
+    std::string fxArgs = perVertex ? "fragPalFxAdd, fragPalFxMul" : "palfxAdd, palfxMul";
+
+    source += "void main()\n"
+              "{\n";
+    if (paletted) {
+        std::string row = atlas ? (perVertex ? "fragPaletteRow" : "paletteRow") : "0.5";
+        source += "    float index = " + tex + "(texture0, fragTexCoord).r * 255.0;\n"
+                  "    vec4 color = " + tex + "(paletteTex, vec2((index + 0.5) / 256.0, " + row + "));\n";
+        if (palfx) {
+            source += "    color.rgb = applyPalFx(color.rgb, " + fxArgs + ");\n";
+        }
+    } else {
+        source += "    vec4 color = " + tex + "(texture0, fragTexCoord);\n";
+        if (palfx) {
+            // Premultiplied texels are unpremultiplied around the effect
+            source += "    bool premultiplied = premultipliedAlpha > 0.5 && color.a > 0.0;\n"
+                      "    vec3 rgb = premultiplied ? color.rgb / color.a : color.rgb;\n"
+                      "    rgb = applyPalFx(rgb, " + fxArgs + ");\n"
+                      "    color.rgb = premultiplied ? rgb * color.a : rgb;\n";
+        }
+    }
+    if (features & SHADER_ALPHA_TEST) {
+        source += "    if (color.a < 0.5) discard;\n";
+    }
+    source += "    " + dialect.outputVar + " = color * colDiffuse * fragColor;\n"
+              "}\n";
+    return source;
+}
+
+// Function to get the complete fragment shader based on rlGetVersion()
+// perVertexRow takes the palette row and PalFX from the attributes SpriteBatch feeds
+std::string GetPaletteFragmentShader(bool perVertexRow = false) {
+    return BuildSpriteFragmentShader(rlGetVersion(), SHADER_PALETTED | SHADER_PALETTE_ATLAS | SHADER_PALFX |
+                                                     (perVertexRow ? SHADER_VERTEX_PARAMS : 0));
+}
+
+// Function to get the complete vertex shader based on rlGetVersion()
+std::string GetPaletteVertexShader(bool perVertexRow = false) {
+    return BuildSpriteVertexShader(rlGetVersion(), SHADER_PALETTED | SHADER_PALETTE_ATLAS | SHADER_PALFX |
+                                                   (perVertexRow ? SHADER_VERTEX_PARAMS : 0));
+}
+
+// A compiled sprite shader variant, locations are -1 where the variant doesn't use them
+struct SpriteShader {
+    unsigned int id;
+    unsigned int features;
+    int mvpLoc;
+    int colDiffuseLoc;
+    int texture0Loc;
+    int paletteTexLoc;
+    int paletteRowLoc;
+    int palfxAddLoc;
+    int palfxMulLoc;
+    int premultipliedLoc;
+    int positionAttrib;
+    int texCoordAttrib;
+    int colorAttrib;
+    int paletteRowAttrib;
+    int palfxAddAttrib;
+    int palfxMulAttrib;
+};
+
+// Compiles each sprite shader variant once, keyed by GL version and feature bits, and looks
+// up its uniform and attribute locations at that point so drawing never queries them.
+// Programs belong to the GL context, call Unload() before closing the window.
+class SpriteShaderCache {
+public:
+    SpriteShaderCache() {}
+    ~SpriteShaderCache() { Unload(); }
+
+    // Variant for the current GL version, nullptr if it failed to compile (not retried)
+    const SpriteShader* Get(unsigned int features);
+    void Unload();
+
+    // Programs compiled so far, failures excluded
+    int GetProgramCount() const;
+
+private:
+    static uint32_t MakeKey(int glVersion, unsigned int features) {
+        return (static_cast<uint32_t>(glVersion) << 16) | (features & 0xFFFF);
+    }
+
+    std::unordered_map<uint32_t, SpriteShader> shaders_;
+
+    SpriteShaderCache(const SpriteShaderCache&) = delete;
+    SpriteShaderCache& operator=(const SpriteShaderCache&) = delete;
+};
+
+// Implementation of SpriteShaderCache methods
+const SpriteShader* SpriteShaderCache::Get(unsigned int features) {
+    int glVersion = rlGetVersion();
+    uint32_t key = MakeKey(glVersion, features);
+    auto it = shaders_.find(key);
+    if (it != shaders_.end()) {
+        return it->second.id != 0 ? &it->second : nullptr;
+    }
+
+    SpriteShader shader = {};
+    shader.features = features;
+    shader.id = rlLoadShaderCode(BuildSpriteVertexShader(glVersion, features).c_str(),
+                                 BuildSpriteFragmentShader(glVersion, features).c_str());
+    if (shader.id == 0) {
+        printf("Failed to compile sprite shader variant 0x%02X\n", features);
+        shaders_[key] = shader;
+        return nullptr;
+    }
+    shader.mvpLoc = rlGetLocationUniform(shader.id, "mvp");
+    shader.colDiffuseLoc = rlGetLocationUniform(shader.id, "colDiffuse");
+    shader.texture0Loc = rlGetLocationUniform(shader.id, "texture0");
+    shader.paletteTexLoc = rlGetLocationUniform(shader.id, "paletteTex");
+    shader.paletteRowLoc = rlGetLocationUniform(shader.id, "paletteRow");
+    shader.palfxAddLoc = rlGetLocationUniform(shader.id, "palfxAdd");
+    shader.palfxMulLoc = rlGetLocationUniform(shader.id, "palfxMul");
+    shader.premultipliedLoc = rlGetLocationUniform(shader.id, "premultipliedAlpha");
+    shader.positionAttrib = rlGetLocationAttrib(shader.id, "vertexPosition");
+    shader.texCoordAttrib = rlGetLocationAttrib(shader.id, "vertexTexCoord");
+    shader.colorAttrib = rlGetLocationAttrib(shader.id, "vertexColor");
+    shader.paletteRowAttrib = rlGetLocationAttrib(shader.id, "vertexPaletteRow");
+    shader.palfxAddAttrib = rlGetLocationAttrib(shader.id, "vertexPalFxAdd");
+    shader.palfxMulAttrib = rlGetLocationAttrib(shader.id, "vertexPalFxMul");
+    return &(shaders_[key] = shader);
+}
+
+void SpriteShaderCache::Unload() {
+    for (auto& entry : shaders_) {
+        if (entry.second.id != 0) {
+            rlUnloadShaderProgram(entry.second.id);
+        }
+    }
+    shaders_.clear();
+}
+
+int SpriteShaderCache::GetProgramCount() const {
+    int count = 0;
+    for (const auto& entry : shaders_) {
+        if (entry.second.id != 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// MUGEN-style palette effect. Colours are 0..1 (MUGEN values / 256).
+struct PalFx {
+    float add[3];       // Added to every colour channel, before mul
+    float mul[3];       // Channel multipliers of colour + add, 1 leaves it alone
+    float sinAdd[3];    // Amplitude of sinAdd * sin(2 pi t / sinPeriod), added on top of add
+    int sinPeriod;      // Frames, 0 disables sinAdd
+    float color;        // 1 = full colour, 0 = greyscale
+    bool invert;
+
+    PalFx() : add(), sinAdd(), sinPeriod(0), color(1.0f), invert(false) {
+        mul[0] = mul[1] = mul[2] = 1.0f;
+    }
+};
+
+// Shader parameters for one frame of a PalFx, encoded so that zero means no effect (see
+// GetPalFxFunction()). Fed to the palette shader as uniforms or per-vertex by SpriteBatch.
+struct PalFxParams {
+    float add[4];   // rgb add (before the multiplier), a = invert
+    float mul[4];   // rgb multiplier - 1 of colour + add, a = greyscale amount
+
+    PalFxParams() : add(), mul() {}
+
+    bool IsIdentity() const {
+        for (int i = 0; i < 4; i++) {
+            if (add[i] != 0.0f || mul[i] != 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// A timed PalFx, e.g. a hit flash or the darkening behind a super move. Update() once per
+// frame; nothing is uploaded to the GPU while it runs.
+class PalFxState {
+public:
+    PalFxState() : remaining_(0), time_(0) {}
+
+    // Runs fx for duration frames, -1 until Clear()
+    void Set(const PalFx& fx, int duration) {
+        fx_ = fx;
+        remaining_ = duration;
+        time_ = 0;
+    }
+
+    void Clear() { remaining_ = 0; }
+    bool IsActive() const { return remaining_ != 0; }
+
+    void Update() {
+        if (remaining_ == 0) {
+            return;
+        }
+        time_++;
+        if (remaining_ > 0) {
+            remaining_--;
+        }
+    }
+
+    PalFxParams Evaluate() const {
+        PalFxParams params;
+        if (remaining_ == 0) {
+            return params;
+        }
+        float wave = fx_.sinPeriod > 0 ? sinf(2.0f * PI * time_ / fx_.sinPeriod) : 0.0f;
+        for (int c = 0; c < 3; c++) {
+            params.add[c] = fx_.add[c] + fx_.sinAdd[c] * wave;
+            params.mul[c] = fx_.mul[c] - 1.0f;
+        }
+        params.add[3] = fx_.invert ? 1.0f : 0.0f;
+        params.mul[3] = 1.0f - fx_.color;
+        return params;
+    }
+
+private:
+    PalFx fx_;
+    int remaining_;
+    int time_;
+};
+
+// Parts of a frame FrameProfiler times separately
+enum ProfilePhase {
+    PROFILE_UPDATE = 0,   // Input, animation and PalFX updates
+    PROFILE_BUILD,        // Queueing sprites into SpriteBatch
+    PROFILE_BIND,         // Shader, blend mode and texture binding in SpriteBatch::Flush()
+    PROFILE_SUBMIT,       // Vertex upload and draw calls
+    PROFILE_PRESENT,      // EndDrawing(), including the buffer swap and frame rate wait
+    PROFILE_PHASE_COUNT
+};
+
+// Percentiles over the frames FrameProfiler has buffered, in milliseconds
+struct FrameStats {
+    size_t frames;
+    float p50;
+    float p95;
+    float p99;
+    float worst;
+    float phaseAverage[PROFILE_PHASE_COUNT];
+    float phaseWorst[PROFILE_PHASE_COUNT];
+};
+
+// CPU time per frame and per phase for the last kMaxFrames frames, cheap enough to leave on in
+// release builds. Times are CPU side: GPU work shows up wherever the driver makes us wait,
+// usually PROFILE_PRESENT.
+class FrameProfiler {
+public:
+    static const size_t kMaxFrames = 1024;
+
+    static FrameProfiler& Instance();
+
+    // Call at the top of the main loop and after EndDrawing()
+    void BeginFrame();
+    void EndFrame();
+
+    // Drops the buffered frames, e.g. after a warm-up
+    void Reset() {
+        next_ = 0;
+        count_ = 0;
+    }
+
+    void Add(ProfilePhase phase, double seconds) { current_[phase] += seconds; }
+
+    FrameStats GetStats() const;
+    size_t GetFrameCount() const { return count_; }
+
+    // Frame time percentiles and the worst phase times, drawn with raylib in the top-left corner
+    void DrawOverlay(int x, int y) const;
+
+    // One row (CSV) or object (JSON) per buffered frame, oldest first, times in milliseconds
+    bool WriteCsv(const std::string& filename) const;
+    bool WriteJson(const std::string& filename) const;
+
+    static const char* GetPhaseName(int phase);
+
+private:
+    struct Sample {
+        uint64_t frame;
+        float total;
+        float phases[PROFILE_PHASE_COUNT];
+    };
+
+    FrameProfiler() : next_(0), count_(0), frameNumber_(0), current_() {}
+
+    // Buffered samples oldest first
+    template <typename Callback>
+    void ForEachSample(Callback callback) const {
+        size_t first = (next_ + kMaxFrames - count_) % kMaxFrames;
+        for (size_t i = 0; i < count_; i++) {
+            callback(samples_[(first + i) % kMaxFrames]);
+        }
+    }
+
+    std::array<Sample, kMaxFrames> samples_;
+    size_t next_;
+    size_t count_;
+    uint64_t frameNumber_;
+    std::chrono::steady_clock::time_point frameStart_;
+    double current_[PROFILE_PHASE_COUNT];
+    mutable std::vector<float> scratch_;  // Percentile sorting space, allocated once
+};
+
+// Adds the time until the end of the scope (or Stop()) to a FrameProfiler phase
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfilePhase phase)
+        : phase_(phase), start_(std::chrono::steady_clock::now()), running_(true) {}
+    ~ProfileScope() { Stop(); }
+
+    void Stop() {
+        if (running_) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+            FrameProfiler::Instance().Add(phase_, elapsed.count());
+            running_ = false;
+        }
+    }
+
+private:
+    ProfilePhase phase_;
+    std::chrono::steady_clock::time_point start_;
+    bool running_;
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+// Implementation of FrameProfiler methods
+FrameProfiler& FrameProfiler::Instance() {
+    static FrameProfiler profiler;
+    return profiler;
+}
+
+const char* FrameProfiler::GetPhaseName(int phase) {
+    static const char* const names[PROFILE_PHASE_COUNT] = { "update", "build", "bind", "submit", "present" };
+    return (phase >= 0 && phase < PROFILE_PHASE_COUNT) ? names[phase] : "unknown";
+}
+
+void FrameProfiler::BeginFrame() {
+    frameStart_ = std::chrono::steady_clock::now();
+    for (double& phase : current_) {
+        phase = 0.0;
+    }
+}
+
+void FrameProfiler::EndFrame() {
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - frameStart_;
+    Sample& sample = samples_[next_];
+    sample.frame = frameNumber_++;
+    sample.total = static_cast<float>(total.count() * 1000.0);
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        sample.phases[phase] = static_cast<float>(current_[phase] * 1000.0);
+    }
+    next_ = (next_ + 1) % kMaxFrames;
+    if (count_ < kMaxFrames) {
+        count_++;
+    }
+}
+
+FrameStats FrameProfiler::GetStats() const {
+    FrameStats stats = {};
+    stats.frames = count_;
+    if (count_ == 0) {
+        return stats;
+    }
+
+    scratch_.clear();
+    scratch_.reserve(kMaxFrames);
+    ForEachSample([&](const Sample& sample) {
+        scratch_.push_back(sample.total);
+        for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+            stats.phaseAverage[phase] += sample.phases[phase];
+            stats.phaseWorst[phase] = std::max(stats.phaseWorst[phase], sample.phases[phase]);
+        }
+    });
+    for (float& average : stats.phaseAverage) {
+        average /= count_;
+    }
+
+    // Nearest-rank percentiles, each nth_element only reorders what lies above the previous one
+    auto percentile = [this](size_t from, double fraction) {
+        size_t rank = std::min(scratch_.size() - 1, static_cast<size_t>(fraction * scratch_.size()));
+        std::nth_element(scratch_.begin() + from, scratch_.begin() + rank, scratch_.end());
+        return rank;
+    };
+    size_t rank = percentile(0, 0.50);
+    stats.p50 = scratch_[rank];
+    rank = percentile(rank, 0.95);
+    stats.p95 = scratch_[rank];
+    rank = percentile(rank, 0.99);
+    stats.p99 = scratch_[rank];
+    stats.worst = *std::max_element(scratch_.begin() + rank, scratch_.end());
+    return stats;
+}
+
+void FrameProfiler::DrawOverlay(int x, int y) const {
+    FrameStats stats = GetStats();
+    const int fontSize = 10;
+    const int lineHeight = 12;
+    DrawRectangle(x, y, 250, (PROFILE_PHASE_COUNT + 2) * lineHeight + 8, Color{0, 0, 0, 180});
+    x += 4;
+    y += 4;
+    DrawText(TextFormat("%zu frames  p50 %.2f  p95 %.2f  p99 %.2f ms", stats.frames, stats.p50, stats.p95, stats.p99),
+             x, y, fontSize, WHITE);
+    y += lineHeight;
+    DrawText(TextFormat("worst frame %.2f ms", stats.worst), x, y, fontSize, stats.worst > 1000.0f / 60 ? RED : WHITE);
+    y += lineHeight;
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        DrawText(TextFormat("%-8s avg %6.3f  worst %6.3f ms", GetPhaseName(phase), stats.phaseAverage[phase],
+                            stats.phaseWorst[phase]), x, y, fontSize, LIGHTGRAY);
+        y += lineHeight;
+    }
+}
+
+bool FrameProfiler::WriteCsv(const std::string& filename) const {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (!file) {
+        printf("Error opening file %s\n", filename.c_str());
         return false;
     }
-    sprite.rle = -format;
+    fprintf(file, "frame,total_ms");
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        fprintf(file, ",%s_ms", GetPhaseName(phase));
+    }
+    fprintf(file, "\n");
+    ForEachSample([file](const Sample& sample) {
+        fprintf(file, "%llu,%.4f", static_cast<unsigned long long>(sample.frame), sample.total);
+        for (float phase : sample.phases) {
+            fprintf(file, ",%.4f", phase);
+        }
+        fprintf(file, "\n");
+    });
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    printf("Profile: %zu frames written to %s\n", count_, filename.c_str());
+    return ok;
+}
 
-    // Read color depth
-    if (fread(&sprite.coldepth, sizeof(uint8_t), 1, file) != 1) {
-        fprintf(stderr, "Error reading color depth\n");
+bool FrameProfiler::WriteJson(const std::string& filename) const {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (!file) {
+        printf("Error opening file %s\n", filename.c_str());
         return false;
     }
+    FrameStats stats = GetStats();
+    fprintf(file, "{\n  \"p50_ms\": %.4f,\n  \"p95_ms\": %.4f,\n  \"p99_ms\": %.4f,\n  \"worst_ms\": %.4f,\n",
+            stats.p50, stats.p95, stats.p99, stats.worst);
+    fprintf(file, "  \"frames\": [");
+    bool first = true;
+    ForEachSample([&](const Sample& sample) {
+        fprintf(file, "%s\n    {\"frame\": %llu, \"total_ms\": %.4f", first ? "" : ",",
+                static_cast<unsigned long long>(sample.frame), sample.total);
+        for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+            fprintf(file, ", \"%s_ms\": %.4f", GetPhaseName(phase), sample.phases[phase]);
+        }
+        fprintf(file, "}");
+        first = false;
+    });
+    fprintf(file, "\n  ]\n}\n");
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    printf("Profile: %zu frames written to %s\n", count_, filename.c_str());
+    return ok;
+}
 
-    // Read ofs and size
-    ofs = ReadU32LE(file);
-    size = ReadU32LE(file);
+enum SpriteFlip {
+    SPRITE_FLIP_NONE = 0,
+    SPRITE_FLIP_X    = 1,
+    SPRITE_FLIP_Y    = 2
+};
 
-    // Read palette index
-    uint16_t tmp = ReadU16LE(file);
-    sprite.palidx = tmp;
+// How SpriteBatch combines sprites with what is already drawn
+enum SpriteBlend {
+    SPRITE_BLEND_NORMAL = 0,  // Alpha blending
+    SPRITE_BLEND_ADD,         // Colour added to the background
+    SPRITE_BLEND_SUBTRACT     // Colour subtracted from the background
+};
 
-    // Read location flag and adjust offset
-    tmp = ReadU16LE(file);
-    if ((tmp & 1) == 0) {
-        ofs += lofs; // Local offset
-    } else {
-        ofs += tofs; // Global offset
+// Queues sprite draws and submits them through rlgl, one draw call per run of consecutive
+// sprites sharing an atlas page, palette atlas, blend mode and shader variant. Queue order is
+// draw order, so layered scenes stay correct and only split where the texture really changes.
+class SpriteBatch {
+public:
+    SpriteBatch() : vao_(0), vbo_(0), ebo_(0), blend_(SPRITE_BLEND_NORMAL), alphaTest_(false), drawCalls_(0),
+                    quadsDrawn_(0) {}
+    ~SpriteBatch() { Unload(); }
+
+    // Compiles the common shader variants and creates the vertex buffers, needs a GL context
+    bool Init();
+    void Unload();
+
+    // PalFX applied to the sprites queued after this call. The values go per vertex; only
+    // turning the effect on or off switches to the PalFX variant and starts a new run.
+    void SetPalFx(const PalFxParams& params) { palfx_ = params; }
+    void ResetPalFx() { palfx_ = PalFxParams(); }
+
+    // Discard texels below half alpha instead of blending them, for the sprites queued after this call
+    void SetAlphaTest(bool enabled) { alphaTest_ = enabled; }
+
+    // Blending for the sprites queued after this call, a change starts a new run
+    void SetBlend(SpriteBlend blend) { blend_ = blend; }
+
+    // Queues sprite with its axis (Offset) at position, flip mirrors it around the axis.
+    // palette is only used by indexed sprites and must live in the same palette atlas
+    // for the whole scene to batch into one call per page.
+    void Draw(const Sprite& sprite, const Palette* palette, Vector2 position,
+              int flip = SPRITE_FLIP_NONE, float scale = 1.0f, Color tint = WHITE);
+
+    // Submits everything queued, call before EndDrawing() and before drawing with raylib
+    // on top of the batch
+    void Flush();
+
+    // Draw calls and quads submitted since the last ResetStats()
+    int GetDrawCalls() const { return drawCalls_; }
+    int GetQuadsDrawn() const { return quadsDrawn_; }
+    void ResetStats() { drawCalls_ = quadsDrawn_ = 0; }
+
+private:
+    struct Vertex {
+        float x, y;
+        float u, v;
+        uint8_t r, g, b, a;
+        float paletteRow;
+        float palfxAdd[4];
+        float palfxMul[4];
+    };
+
+    struct Run {
+        unsigned int texture;
+        unsigned int palette;  // 0 for RGBA sprites
+        int blendMode;         // raylib BlendMode, BLEND_CUSTOM for subtraction
+        bool premultiplied;
+        unsigned int features; // SpriteShaderFeature bits
+        int firstQuad;
+        int quadCount;
+    };
+
+    // 4 vertices per quad, keeps every index within the 16-bit range rlgl draws with
+    static const int kMaxQuads = 8192;
+
+    void BindProgram(const SpriteShader& shader, const Matrix& mvp);
+    static void ApplyBlendMode(const Run& run);
+
+    std::vector<Vertex> vertices_;
+    std::vector<Run> runs_;
+    PalFxParams palfx_;
+    SpriteShaderCache shaders_;
+    unsigned int vao_;
+    unsigned int vbo_;
+    unsigned int ebo_;
+    SpriteBlend blend_;
+    bool alphaTest_;
+    int drawCalls_;
+    int quadsDrawn_;
+
+    SpriteBatch(const SpriteBatch&) = delete;
+    SpriteBatch& operator=(const SpriteBatch&) = delete;
+};
+
+// Implementation of SpriteBatch methods
+bool SpriteBatch::Init() {
+    if (vbo_ != 0) {
+        return true;
+    }
+    // Compile the variants every scene uses now rather than on the first frame that needs them
+    const unsigned int paletted = SHADER_PALETTED | SHADER_PALETTE_ATLAS | SHADER_VERTEX_PARAMS;
+    const unsigned int rgba = SHADER_VERTEX_PARAMS;
+    for (unsigned int features : { paletted, paletted | SHADER_PALFX, rgba, rgba | SHADER_PALFX }) {
+        if (shaders_.Get(features) == nullptr) {
+            printf("Failed to compile sprite batch shaders\n");
+            Unload();
+            return false;
+        }
+    }
+
+    std::vector<uint16_t> indices(kMaxQuads * 6);
+    for (int i = 0; i < kMaxQuads; i++) {
+        uint16_t v = static_cast<uint16_t>(i * 4);
+        indices[i * 6 + 0] = v;
+        indices[i * 6 + 1] = v + 1;
+        indices[i * 6 + 2] = v + 2;
+        indices[i * 6 + 3] = v;
+        indices[i * 6 + 4] = v + 2;
+        indices[i * 6 + 5] = v + 3;
+    }
+
+    // vao_ stays 0 where VAOs are unsupported (GL 2.1/ES 2.0 without the extension),
+    // BindProgram() then sets the attribute pointers itself
+    vao_ = rlLoadVertexArray();
+    rlEnableVertexArray(vao_);
+    vbo_ = rlLoadVertexBuffer(nullptr, kMaxQuads * 4 * sizeof(Vertex), true);
+    ebo_ = rlLoadVertexBufferElement(indices.data(), static_cast<int>(indices.size() * sizeof(uint16_t)), false);
+    rlDisableVertexArray();
+    rlDisableVertexBuffer();
+    rlDisableVertexBufferElement();
+
+    vertices_.reserve(kMaxQuads * 4);
+    return true;
+}
+
+void SpriteBatch::Unload() {
+    if (vao_ != 0) rlUnloadVertexArray(vao_);
+    if (vbo_ != 0) rlUnloadVertexBuffer(vbo_);
+    if (ebo_ != 0) rlUnloadVertexBuffer(ebo_);
+    shaders_.Unload();
+    vao_ = vbo_ = ebo_ = 0;
+    vertices_.clear();
+    runs_.clear();
+}
+
+void SpriteBatch::Draw(const Sprite& sprite, const Palette* palette, Vector2 position,
+                       int flip, float scale, Color tint) {
+    // Use() brings back textures the VRAM budget evicted and keeps them resident this frame
+    if (vbo_ == 0 || !sprite.texture.Use() || sprite.texture->width <= 0 || sprite.texture->height <= 0) {
+        return;
+    }
+    bool indexed = !sprite.IsRGBA();
+    if (indexed && (palette == nullptr || !palette->texture.Use())) {
+        return;
+    }
+    if (vertices_.size() >= static_cast<size_t>(kMaxQuads) * 4) {
+        Flush();
+    }
+
+    unsigned int paletteId = indexed ? palette->texture->id : 0;
+    // Premultiplied texels already carry their alpha, so they blend with ONE as source factor
+    int blendMode = sprite.premultiplied ? BLEND_ALPHA_PREMULTIPLY : BLEND_ALPHA;
+    if (blend_ == SPRITE_BLEND_ADD) {
+        blendMode = sprite.premultiplied ? BLEND_ADD_COLORS : BLEND_ADDITIVE;
+    } else if (blend_ == SPRITE_BLEND_SUBTRACT) {
+        blendMode = BLEND_CUSTOM;
+    }
+    unsigned int features = SHADER_VERTEX_PARAMS;
+    if (indexed) features |= SHADER_PALETTED | SHADER_PALETTE_ATLAS;
+    if (!palfx_.IsIdentity()) features |= SHADER_PALFX;
+    if (alphaTest_) features |= SHADER_ALPHA_TEST;
+    if (runs_.empty() || runs_.back().texture != sprite.texture->id || runs_.back().palette != paletteId ||
+        runs_.back().blendMode != blendMode || runs_.back().premultiplied != sprite.premultiplied ||
+        runs_.back().features != features) {
+        runs_.push_back(Run{sprite.texture->id, paletteId, blendMode, sprite.premultiplied, features,
+                            static_cast<int>(vertices_.size() / 4), 0});
+    }
+    runs_.back().quadCount++;
+
+    const Rectangle& src = sprite.atlasRect;
+    float width = src.width * scale;
+    float height = src.height * scale;
+    float left = (flip & SPRITE_FLIP_X) ? position.x - (src.width - sprite.Offset[0]) * scale
+                                        : position.x - sprite.Offset[0] * scale;
+    float top = (flip & SPRITE_FLIP_Y) ? position.y - (src.height - sprite.Offset[1]) * scale
+                                       : position.y - sprite.Offset[1] * scale;
+
+    float u0 = src.x / sprite.texture->width;
+    float u1 = (src.x + src.width) / sprite.texture->width;
+    float v0 = src.y / sprite.texture->height;
+    float v1 = (src.y + src.height) / sprite.texture->height;
+    if (flip & SPRITE_FLIP_X) std::swap(u0, u1);
+    if (flip & SPRITE_FLIP_Y) std::swap(v0, v1);
+
+    // Premultiplied sprites need a premultiplied tint, or a translucent tint would brighten them
+    if (sprite.premultiplied && tint.a < 255) {
+        tint.r = static_cast<uint8_t>(tint.r * tint.a / 255);
+        tint.g = static_cast<uint8_t>(tint.g * tint.a / 255);
+        tint.b = static_cast<uint8_t>(tint.b * tint.a / 255);
+    }
+    Vertex vertex = {};
+    vertex.r = tint.r;
+    vertex.g = tint.g;
+    vertex.b = tint.b;
+    vertex.a = tint.a;
+    vertex.paletteRow = indexed ? palette->GetRowCoord() : 0.0f;
+    memcpy(vertex.palfxAdd, palfx_.add, sizeof(vertex.palfxAdd));
+    memcpy(vertex.palfxMul, palfx_.mul, sizeof(vertex.palfxMul));
+
+    const float corners[4][4] = {
+        { left,         top,          u0, v0 },
+        { left,         top + height, u0, v1 },
+        { left + width, top + height, u1, v1 },
+        { left + width, top,          u1, v0 },
+    };
+    for (const auto& corner : corners) {
+        vertex.x = corner[0];
+        vertex.y = corner[1];
+        vertex.u = corner[2];
+        vertex.v = corner[3];
+        vertices_.push_back(vertex);
+    }
+}
+
+void SpriteBatch::BindProgram(const SpriteShader& program, const Matrix& mvp) {
+    const float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    const int textureSlot = 0;
+    const int paletteSlot = 1;
+
+    rlEnableShader(program.id);
+    rlSetUniformMatrix(program.mvpLoc, mvp);
+    rlSetUniform(program.colDiffuseLoc, white, RL_SHADER_UNIFORM_VEC4, 1);
+    rlSetUniform(program.texture0Loc, &textureSlot, RL_SHADER_UNIFORM_INT, 1);
+    if (program.paletteTexLoc >= 0) {
+        rlSetUniform(program.paletteTexLoc, &paletteSlot, RL_SHADER_UNIFORM_INT, 1);
+    }
+
+    rlEnableVertexArray(vao_);
+    rlEnableVertexBuffer(vbo_);
+    rlEnableVertexBufferElement(ebo_);
+    const int stride = sizeof(Vertex);
+    const struct { int location; int size; int type; bool normalized; size_t offset; } attributes[] = {
+        { program.positionAttrib,   2, RL_FLOAT,         false, offsetof(Vertex, x) },
+        { program.texCoordAttrib,   2, RL_FLOAT,         false, offsetof(Vertex, u) },
+        { program.colorAttrib,      4, RL_UNSIGNED_BYTE, true,  offsetof(Vertex, r) },
+        { program.paletteRowAttrib, 1, RL_FLOAT,         false, offsetof(Vertex, paletteRow) },
+        { program.palfxAddAttrib,   4, RL_FLOAT,         false, offsetof(Vertex, palfxAdd) },
+        { program.palfxMulAttrib,   4, RL_FLOAT,         false, offsetof(Vertex, palfxMul) },
+    };
+    for (const auto& attribute : attributes) {
+        if (attribute.location >= 0) {
+            rlSetVertexAttribute(attribute.location, attribute.size, attribute.type, attribute.normalized,
+                                 stride, static_cast<int>(attribute.offset));
+            rlEnableVertexAttribute(attribute.location);
+        }
     }
+}
+
+void SpriteBatch::ApplyBlendMode(const Run& run) {
+    if (run.blendMode == BLEND_CUSTOM) {
+        // raylib's BLEND_SUBTRACT_COLORS is source minus destination, sprites darken the background
+        rlSetBlendFactors(run.premultiplied ? RL_ONE : RL_SRC_ALPHA, RL_ONE, RL_FUNC_REVERSE_SUBTRACT);
+    }
+    rlSetBlendMode(run.blendMode);
+}
+
+void SpriteBatch::Flush() {
+    if (runs_.empty()) {
+        return;
+    }
+
+    {
+        ProfileScope profile(PROFILE_SUBMIT);
+        // Anything raylib queued before us has to reach the screen first
+        rlDrawRenderBatchActive();
+        rlUpdateVertexBuffer(vbo_, vertices_.data(), static_cast<int>(vertices_.size() * sizeof(Vertex)), 0);
+    }
+    Matrix mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+
+    const SpriteShader* bound = nullptr;
+    std::vector<const SpriteShader*> used;
+    const Run* blended = nullptr;
+    for (const Run& run : runs_) {
+        ProfileScope bindProfile(PROFILE_BIND);
+        // rlSetBlendMode() flushes rlgl's own batch, which resets the bound program and buffers
+        if (blended == nullptr || run.blendMode != blended->blendMode ||
+            (run.blendMode == BLEND_CUSTOM && run.premultiplied != blended->premultiplied)) {
+            ApplyBlendMode(run);
+            blended = &run;
+            bound = nullptr;
+        }
+        const SpriteShader* program = shaders_.Get(run.features);
+        if (program == nullptr) {
+            continue;
+        }
+        if (bound != program) {
+            BindProgram(*program, mvp);
+            bound = program;
+            if (std::find(used.begin(), used.end(), program) == used.end()) {
+                used.push_back(program);
+            }
+        }
+
+        if (program->premultipliedLoc >= 0) {
+            float premultiplied = run.premultiplied ? 1.0f : 0.0f;
+            rlSetUniform(program->premultipliedLoc, &premultiplied, RL_SHADER_UNIFORM_FLOAT, 1);
+        }
+
+        rlActiveTextureSlot(0);
+        rlEnableTexture(run.texture);
+        if (run.palette) {
+            rlActiveTextureSlot(1);
+            rlEnableTexture(run.palette);
+        }
+        bindProfile.Stop();
+
+        ProfileScope submitProfile(PROFILE_SUBMIT);
+        rlDrawVertexArrayElements(run.firstQuad * 6, run.quadCount * 6, nullptr);
+        drawCalls_++;
+        quadsDrawn_ += run.quadCount;
+    }
+
+    ProfileScope profile(PROFILE_BIND);
+    rlActiveTextureSlot(1);
+    rlDisableTexture();
+    rlActiveTextureSlot(0);
+    rlDisableTexture();
+    rlDisableVertexArray();
+    rlDisableVertexBuffer();
+    rlDisableVertexBufferElement();
+    if (vao_ == 0) {
+        // Without a VAO the extra attributes would stay enabled for raylib's own draws
+        for (const SpriteShader* program : used) {
+            for (int attribute : { program->paletteRowAttrib, program->palfxAddAttrib, program->palfxMulAttrib }) {
+                if (attribute >= 0) {
+                    rlDisableVertexAttribute(attribute);
+                }
+            }
+        }
+    }
+    rlDisableShader();
+    rlSetBlendMode(BLEND_ALPHA);
+
+    vertices_.clear();
+    runs_.clear();
+}
+
+// Shares SffFiles between the characters, stages and effects that use them. Files are keyed
+// by canonical path and by content (a hash match is confirmed byte by byte), so a file reached
+// through another path or copied under another name still loads once. Handles are shared_ptrs and a file unloads (releasing its
+// textures) when the last handle goes; the manager only keeps weak references.
+class SffManager {
+public:
+    typedef std::shared_ptr<SffFile> Handle;
+
+    SffManager() {}
+
+    // Applied to every SffFile before it loads, e.g. SetPremultiplyAlpha() or a shared palette atlas
+    void SetConfigure(const std::function<void(SffFile&)>& configure) { configure_ = configure; }
+
+    // The file at path, loaded if no live handle has the same content. nullptr if it fails to load
+    Handle Acquire(const std::string& path);
+
+    // Acquire() for several files. Files are hashed and new ones decoded on worker threads,
+    // one per file; only the texture uploads run on this thread, which owns the GL context.
+    std::vector<Handle> AcquireAll(const std::vector<std::string>& paths);
+
+    // Files with at least one live handle
+    size_t GetLoadedCount() const;
 
-    return true;
-}
+private:
+    struct FileKey {
+        std::string path;     // Canonical path
+        uint64_t hash;        // HashBytes64 of the content
+        uint64_t size;
+        bool ok;
+    };
+
+    struct PathInfo {
+        uint64_t hash;
+        uint64_t size;
+        std::filesystem::file_time_type modified;
+    };
+
+    struct Entry {
+        std::weak_ptr<SffFile> file;
+        std::string path;  // Canonical path it was loaded from
+        uint64_t size;
+    };
+
+    // Runs on worker threads, touches no member state
+    static FileKey ComputeKey(const std::string& path, const PathInfo* known);
+    static bool SameContent(const FileKey& a, const FileKey& b);
+    Handle AcquireKey(const std::string& path, const FileKey& key);
+    Handle FindLoaded(const FileKey& key);
+    void Remember(const FileKey& key);
+    Handle NewFile();
+    const PathInfo* FindPathInfo(const std::string& path) const;
+
+    std::function<void(SffFile&)> configure_;
+    std::unordered_map<std::string, PathInfo> paths_;  // Canonical path -> content last seen there
+    std::unordered_multimap<uint64_t, Entry> files_;   // Content hash -> live files
+
+    SffManager(const SffManager&) = delete;
+    SffManager& operator=(const SffManager&) = delete;
+};
 
-std::unique_ptr<uint8_t[]> SffFile::ReadSpriteDataV1(Sprite& sprite, FILE* file, uint64_t offset, uint32_t datasize,
-                                                   uint32_t nextSubheader, Sprite* prev, bool c00) {
-    if (nextSubheader > offset) {
-        // Ignore datasize except last
-        datasize = nextSubheader - offset;
+// Implementation of SffManager methods
+SffManager::FileKey SffManager::ComputeKey(const std::string& path, const PathInfo* known) {
+    FileKey key = {};
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    key.path = error ? path : canonical.string();
+
+    // Unchanged size and modification time since the last hash: skip reading the file
+    std::filesystem::file_time_type modified = std::filesystem::last_write_time(key.path, error);
+    uint64_t size = error ? 0 : std::filesystem::file_size(key.path, error);
+    if (error) {
+        return key;
+    }
+    if (known != nullptr && known->size == size && known->modified == modified) {
+        key.hash = known->hash;
+        key.size = size;
+        key.ok = true;
+        return key;
     }
 
-    uint8_t ps;
-    if (fread(&ps, sizeof(uint8_t), 1, file) != 1) {
-        fprintf(stderr, "Error reading sprite ps data\n");
-        return nullptr;
+    FILE* file = fopen(key.path.c_str(), "rb");
+    if (!file) {
+        return key;
+    }
+    std::vector<uint8_t> content(static_cast<size_t>(size));
+    bool read = content.empty() || fread(content.data(), 1, content.size(), file) == content.size();
+    fclose(file);
+    if (read) {
+        key.hash = HashBytes64(content.data(), content.size(), size);
+        key.size = size;
+        key.ok = true;
     }
+    return key;
+}
 
-    bool paletteSame = (ps != 0) && (prev != nullptr);
+const SffManager::PathInfo* SffManager::FindPathInfo(const std::string& path) const {
+    std::error_code error;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, error);
+    auto it = paths_.find(error ? path : canonical.string());
+    return it != paths_.end() ? &it->second : nullptr;
+}
 
-    if (!ReadPcxHeader(sprite, file, offset)) {
-        fprintf(stderr, "Error reading sprite PCX header\n");
-        return nullptr;
+// Byte comparison behind a hash match, files_ never shares a file on the hash alone
+bool SffManager::SameContent(const FileKey& a, const FileKey& b) {
+    if (a.size != b.size) {
+        return false;
     }
-
-    if (fseek(file, offset + 128, SEEK_SET) != 0) {
-        fprintf(stderr, "Error seeking to sprite data\n");
-        return nullptr;
+    if (a.path == b.path) {
+        return true;
     }
+    FILE* fileA = fopen(a.path.c_str(), "rb");
+    FILE* fileB = fopen(b.path.c_str(), "rb");
+    bool same = fileA != nullptr && fileB != nullptr;
+    std::vector<uint8_t> chunkA(64 * 1024), chunkB(64 * 1024);
+    for (uint64_t left = a.size; same && left > 0;) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(left, chunkA.size()));
+        same = fread(chunkA.data(), 1, count, fileA) == count && fread(chunkB.data(), 1, count, fileB) == count &&
+               memcmp(chunkA.data(), chunkB.data(), count) == 0;
+        left -= count;
+    }
+    if (fileA) {
+        fclose(fileA);
+    }
+    if (fileB) {
+        fclose(fileB);
+    }
+    return same;
+}
 
-    uint32_t palSize;
-    if (c00 || paletteSame) {
-        palSize = 0;
-    } else {
-        palSize = 768; // 256 colors * 3 bytes per color
+SffManager::Handle SffManager::FindLoaded(const FileKey& key) {
+    auto range = files_.equal_range(key.hash);
+    for (auto it = range.first; it != range.second;) {
+        Handle shared = it->second.file.lock();
+        if (!shared) {
+            it = files_.erase(it);
+            continue;
+        }
+        FileKey loaded = { it->second.path, key.hash, it->second.size, true };
+        if (SameContent(loaded, key)) {
+            return shared;
+        }
+        ++it;
     }
+    return nullptr;
+}
 
-    if (datasize < 128 + palSize) {
-        datasize = 128 + palSize;
+void SffManager::Remember(const FileKey& key) {
+    std::error_code error;
+    PathInfo info = { key.hash, key.size, std::filesystem::last_write_time(key.path, error) };
+    paths_[key.path] = info;
+}
+
+SffManager::Handle SffManager::NewFile() {
+    Handle file = std::make_shared<SffFile>();
+    if (configure_) {
+        configure_(*file);
     }
+    return file;
+}
 
-    size_t srcLen = datasize - (128 + palSize);
-    auto srcPx = std::make_unique<uint8_t[]>(srcLen);
-    if (!srcPx) {
-        fprintf(stderr, "Error allocating memory for sprite data\n");
+SffManager::Handle SffManager::AcquireKey(const std::string& path, const FileKey& key) {
+    if (!key.ok) {
+        printf("Error: cannot open file %s\n", path.c_str());
         return nullptr;
     }
+    Remember(key);
+    if (Handle shared = FindLoaded(key)) {
+        return shared;
+    }
 
-    if (fread(srcPx.get(), srcLen, 1, file) != 1) {
-        fprintf(stderr, "Error reading sprite PCX data pixel\n");
+    Handle file = NewFile();
+    if (!file->Load(key.path)) {
         return nullptr;
     }
+    files_.emplace(key.hash, Entry{file, key.path, key.size});
+    return file;
+}
 
-    std::unique_ptr<uint8_t[]> px;
+SffManager::Handle SffManager::Acquire(const std::string& path) {
+    return AcquireKey(path, ComputeKey(path, FindPathInfo(path)));
+}
 
-    if (paletteSame) {
-        if (prev != nullptr) {
-            sprite.palidx = prev->palidx;
+std::vector<SffManager::Handle> SffManager::AcquireAll(const std::vector<std::string>& paths) {
+    std::vector<std::future<FileKey>> futureKeys;
+    futureKeys.reserve(paths.size());
+    for (const std::string& path : paths) {
+        // Workers get a copy, paths_ changes while they run
+        const PathInfo* known = FindPathInfo(path);
+        PathInfo copy = known ? *known : PathInfo{};
+        bool hasKnown = known != nullptr;
+        futureKeys.push_back(std::async(std::launch::async, [path, copy, hasKnown]() {
+            return ComputeKey(path, hasKnown ? &copy : nullptr);
+        }));
+    }
+    std::vector<FileKey> keys;
+    keys.reserve(paths.size());
+    for (auto& key : futureKeys) {
+        keys.push_back(key.get());
+    }
+
+    // Files already loaded or repeated in this batch are shared, the others are configured here
+    // and decoded concurrently
+    std::vector<Handle> handles(paths.size());
+    std::vector<size_t> sameAs(paths.size(), SIZE_MAX);
+    std::vector<size_t> decoding;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!keys[i].ok) {
+            printf("Error: cannot open file %s\n", paths[i].c_str());
+            continue;
         }
-        if (sprite.palidx < 0) {
-            fprintf(stderr, "Error: invalid prev palette index %d\n", (prev ? prev->palidx : -1));
-            return nullptr;
+        Remember(keys[i]);
+        handles[i] = FindLoaded(keys[i]);
+        if (handles[i]) {
+            continue;
         }
-        px = RlePcxDecode(sprite, srcPx.get(), srcLen);
-    } else {
-        if (c00) {
-            if (fseek(file, offset + datasize - 768, SEEK_SET) != 0) {
-                fprintf(stderr, "Error seeking to palette data\n");
-                return nullptr;
+        for (size_t j : decoding) {
+            if (keys[j].hash == keys[i].hash && SameContent(keys[j], keys[i])) {
+                sameAs[i] = j;
+                break;
             }
         }
-
-        std::array<RGB, 256> pal_rgb;
-        if (fread(pal_rgb.data(), sizeof(RGB), 256, file) != 256) {
-            fprintf(stderr, "Error reading palette rgb data\n");
-            return nullptr;
+        if (sameAs[i] == SIZE_MAX) {
+            handles[i] = NewFile();
+            decoding.push_back(i);
         }
+    }
 
-        palettes_.emplace_back(GeneratePaletteTexture(pal_rgb));
-        sprite.palidx = static_cast<int>(palettes_.size() - 1);
-        px = RlePcxDecode(sprite, srcPx.get(), srcLen);
+    std::vector<std::future<bool>> decoded;
+    decoded.reserve(decoding.size());
+    for (size_t i : decoding) {
+        SffFile* file = handles[i].get();
+        std::string path = keys[i].path;
+        decoded.push_back(std::async(std::launch::async, [file, path]() { return file->Decode(path); }));
+    }
+    for (size_t n = 0; n < decoding.size(); n++) {
+        size_t i = decoding[n];
+        if (decoded[n].get() && handles[i]->Upload()) {
+            files_.emplace(keys[i].hash, Entry{handles[i], keys[i].path, keys[i].size});
+        } else {
+            handles[i].reset();
+        }
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (sameAs[i] != SIZE_MAX) {
+            handles[i] = handles[sameAs[i]];
+        }
     }
+    return handles;
+}
 
-    return px;
+size_t SffManager::GetLoadedCount() const {
+    size_t count = 0;
+    for (const auto& entry : files_) {
+        if (!entry.second.file.expired()) {
+            count++;
+        }
+    }
+    return count;
 }
 
-std::unique_ptr<uint8_t[]> SffFile::ReadSpriteDataV2(Sprite& sprite, FILE* file, uint64_t offset, uint32_t datasize) {
-    if (sprite.rle > 0) {
-        return nullptr;
+// Reloads SFF files when they change on disk (see SffFile::Reload()). On Linux the parent
+// directories are watched with inotify, which also catches editors that save by renaming a
+// new file over the old one; elsewhere Poll() compares modification times.
+class SffWatcher {
+public:
+    typedef std::function<void(SffFile&, SffReloadResult)> ReloadCallback;
+
+    SffWatcher();
+    ~SffWatcher();
+
+    // The file must stay alive until it is unwatched. Call SetTrackChanges(true) before
+    // loading it, otherwise every change is a full Load().
+    bool Watch(SffFile& sff);
+    void Unwatch(SffFile& sff);
+
+    // Reloads the files changed since the last call without blocking, once a frame is plenty.
+    // onReload sees every reload, FULL ones invalidate pointers to the file's sprites. It must
+    // not watch or unwatch files.
+    int Poll(const ReloadCallback& onReload = nullptr);
+
+private:
+    struct Entry {
+        SffFile* sff;
+        std::filesystem::path path;
+        int watch;  // inotify watch of the parent directory, shared by files in the same directory
+        std::filesystem::file_time_type modified;
+        bool changed;
+    };
+
+    std::vector<Entry> entries_;
+    int fd_;  // inotify instance, -1 when polling
+
+    SffWatcher(const SffWatcher&) = delete;
+    SffWatcher& operator=(const SffWatcher&) = delete;
+};
+
+// Implementation of SffWatcher methods
+SffWatcher::SffWatcher() : fd_(-1) {
+#ifdef __linux__
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+        fprintf(stderr, "Warning: inotify unavailable, polling modification times instead\n");
     }
+#endif
+}
 
-    std::unique_ptr<uint8_t[]> px;
+SffWatcher::~SffWatcher() {
+#ifdef __linux__
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+#endif
+}
 
-    if (sprite.rle == 0) {
-        // Uncompressed data
-        px = std::make_unique<uint8_t[]>(datasize);
-        if (!px) {
-            fprintf(stderr, "Error allocating memory for sprite data\n");
-            return nullptr;
+bool SffWatcher::Watch(SffFile& sff) {
+    std::error_code error;
+    std::filesystem::path path = std::filesystem::absolute(sff.GetFilename(), error);
+    if (sff.GetFilename().empty() || error) {
+        fprintf(stderr, "Error: cannot watch %s\n", sff.GetFilename().c_str());
+        return false;
+    }
+    Entry entry{&sff, path, -1, std::filesystem::last_write_time(path, error), false};
+#ifdef __linux__
+    if (fd_ >= 0) {
+        entry.watch = inotify_add_watch(fd_, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (entry.watch < 0) {
+            fprintf(stderr, "Error: cannot watch %s: %s\n", path.parent_path().c_str(), strerror(errno));
+            return false;
         }
+    }
+#endif
+    entries_.push_back(entry);
+    return true;
+}
 
-        if (fseek(file, offset, SEEK_SET) != 0) {
-            fprintf(stderr, "Error seeking to sprite data\n");
-            return nullptr;
+void SffWatcher::Unwatch(SffFile& sff) {
+    for (size_t i = 0; i < entries_.size(); i++) {
+        if (entries_[i].sff != &sff) {
+            continue;
         }
+        int watch = entries_[i].watch;
+        entries_.erase(entries_.begin() + i);
+#ifdef __linux__
+        bool shared = false;
+        for (const Entry& entry : entries_) {
+            shared = shared || entry.watch == watch;
+        }
+        if (watch >= 0 && !shared) {
+            inotify_rm_watch(fd_, watch);
+        }
+#endif
+        return;
+    }
+}
 
-        if (fread(px.get(), datasize, 1, file) != 1) {
-            fprintf(stderr, "Error reading V2 uncompress sprite data\n");
-            return nullptr;
+int SffWatcher::Poll(const ReloadCallback& onReload) {
+    if (fd_ >= 0) {
+#ifdef __linux__
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(fd_, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < length;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                for (Entry& entry : entries_) {
+                    if (entry.watch == event->wd && event->len > 0 && entry.path.filename() == event->name) {
+                        entry.changed = true;
+                    }
+                }
+            }
         }
+#endif
     } else {
-        // Compressed data
-        if (datasize < 4) {
-            datasize = 4;
+        for (Entry& entry : entries_) {
+            std::error_code error;
+            std::filesystem::file_time_type modified = std::filesystem::last_write_time(entry.path, error);
+            if (!error && modified != entry.modified) {
+                entry.modified = modified;
+                entry.changed = true;
+            }
         }
+    }
 
-        size_t srcLen = datasize - 4;
-        auto srcPx = std::make_unique<uint8_t[]>(srcLen);
-        if (!srcPx) {
-            fprintf(stderr, "Error allocating memory for sprite data\n");
-            return nullptr;
+    int reloaded = 0;
+    for (Entry& entry : entries_) {
+        if (!entry.changed) {
+            continue;
+        }
+        entry.changed = false;
+        SffReloadResult result = entry.sff->Reload();
+        if (result != SFF_RELOAD_FAILED) {
+            reloaded++;
         }
+        if (onReload) {
+            onReload(*entry.sff, result);
+        }
+    }
+    return reloaded;
+}
 
-        if (fseek(file, offset + 4, SEEK_SET) != 0) {
-            fprintf(stderr, "Error seeking to compressed sprite data\n");
-            return nullptr;
+// Collision box of an animation frame, relative to the sprite axis
+struct ClsnBox {
+    int16_t left;
+    int16_t top;
+    int16_t right;
+    int16_t bottom;
+};
+
+// One compiled AIR frame. Clsn boxes are ranges of AirFile::GetClsnBoxes(), frames sharing a
+// ClsnDefault share the range.
+struct AnimFrame {
+    const Sprite* sprite;     // nullptr when the sprite is missing or the group is -1 (draw nothing)
+    int16_t group;
+    int16_t number;
+    int16_t x;                // Added to the axis, mirrored by the facing direction
+    int16_t y;
+    int32_t duration;         // Ticks, -1 holds the frame forever
+    uint8_t flip;             // SpriteFlip bits
+    uint8_t blend;            // SpriteBlend
+    uint8_t alpha;            // Source alpha for AS###D### translucency, 255 otherwise
+    uint16_t clsn1Count;      // Attack boxes
+    uint16_t clsn2Count;      // Hurt boxes
+    uint32_t clsn1First;
+    uint32_t clsn2First;
+};
+
+// One [Begin Action] block, a range of AirFile::GetFrames()
+struct AnimAction {
+    int number;
+    uint32_t firstFrame;
+    uint32_t frameCount;
+    uint32_t loopStart;       // Frame played after the last one, relative to firstFrame
+    int32_t totalTime;        // Sum of the durations, -1 if a frame holds forever
+};
+
+// Parses a MUGEN .air file and compiles its actions into flat frame and Clsn tables, with the
+// sprites resolved against an SffFile once at load. Frames point into that file's sprite
+// vector, so load the AIR file again after reloading the SFF.
+class AirFile {
+public:
+    AirFile() {}
+
+    bool Load(const std::string& filename, const SffFile& sff);
+    void Clear();
+
+    // nullptr if there is no such action. Resolve once, e.g. on a state change, not per tick
+    const AnimAction* GetAction(int number) const {
+        auto it = actionsByNumber_.find(number);
+        return it != actionsByNumber_.end() ? &actions_[it->second] : nullptr;
+    }
+
+    const std::vector<AnimAction>& GetActions() const { return actions_; }
+    const std::vector<AnimFrame>& GetFrames() const { return frames_; }
+    const std::vector<ClsnBox>& GetClsnBoxes() const { return clsn_; }
+
+    // Frames whose group/number has no sprite in the SFF, they draw nothing
+    size_t GetMissingSpriteCount() const { return numMissingSprites_; }
+
+private:
+    bool ParseFrame(const char* line, const char* end, const SffFile& sff, AnimFrame& frame);
+
+    std::vector<AnimAction> actions_;
+    std::vector<AnimFrame> frames_;
+    std::vector<ClsnBox> clsn_;
+    std::unordered_map<int, uint32_t> actionsByNumber_;
+    size_t numMissingSprites_ = 0;
+};
+
+// Plays one action of an AirFile. Update() is plain arithmetic on the compiled frame table, so
+// thousands of players can advance every tick without lookups or allocation.
+class AnimationPlayer {
+public:
+    AnimationPlayer() : air_(nullptr), action_(nullptr), frame_(0), frameTime_(0), elapsed_(0) {}
+
+    // Starts action from its first frame, false (and nothing playing) if air doesn't have it
+    bool SetAction(const AirFile& air, int action);
+
+    // Advances one tick
+    void Update();
+
+    // Current frame, nullptr when no action is playing
+    const AnimFrame* GetFrame() const {
+        return action_ ? &air_->GetFrames()[action_->firstFrame + frame_] : nullptr;
+    }
+
+    const AnimAction* GetAction() const { return action_; }
+    int GetFrameIndex() const { return static_cast<int>(frame_); }
+    int GetElapsed() const { return elapsed_; }
+
+    // True once a finite action has played through its last frame, like MUGEN's AnimTime = 0
+    bool IsFinished() const { return action_ && action_->totalTime >= 0 && elapsed_ >= action_->totalTime; }
+
+    // Queues the current frame with its axis at position, facing SPRITE_FLIP_X for facing left
+    void Draw(SpriteBatch& batch, const std::vector<Palette>& palettes, Vector2 position,
+              int facing = SPRITE_FLIP_NONE, float scale = 1.0f) const;
+
+    // Outlines the current frame's Clsn boxes with raylib, Flush() the batch first
+    void DrawClsn(Vector2 position, int facing = SPRITE_FLIP_NONE, float scale = 1.0f) const;
+
+private:
+    const AirFile* air_;
+    const AnimAction* action_;
+    uint32_t frame_;
+    int32_t frameTime_;  // Ticks spent on the current frame
+    int32_t elapsed_;    // Ticks since the action started
+};
+
+// Implementation of AirFile methods
+
+// Case-insensitive check that [text, end) starts with prefix
+static bool StartsWithNoCase(const char* text, const char* end, const char* prefix) {
+    for (; *prefix; prefix++, text++) {
+        if (text == end || tolower(static_cast<unsigned char>(*text)) != tolower(static_cast<unsigned char>(*prefix))) {
+            return false;
         }
+    }
+    return true;
+}
 
-        int rc = fread(srcPx.get(), srcLen, 1, file);
-        if (rc != 1) {
-            fprintf(stderr, "Error reading V2 RLE sprite data\n");
-            return nullptr;
+static const char* SkipSpaces(const char* text, const char* end) {
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        text++;
+    }
+    return text;
+}
+
+// Parses "name: count" or "Clsn1[0] = l, t, r, b" style numbers, leaves value untouched on failure
+static const char* ParseInt(const char* text, const char* end, long& value) {
+    text = SkipSpaces(text, end);
+    char* parsed = nullptr;
+    long result = strtol(text, &parsed, 10);
+    if (parsed == text || parsed > end) {
+        return nullptr;
+    }
+    value = result;
+    return parsed;
+}
+
+bool AirFile::ParseFrame(const char* line, const char* end, const SffFile& sff, AnimFrame& frame) {
+    // group, number, x, y, time[, flip[, blend]]
+    long values[5];
+    const char* text = line;
+    for (int i = 0; i < 5; i++) {
+        text = ParseInt(text, end, values[i]);
+        if (text == nullptr) {
+            return false;
+        }
+        text = SkipSpaces(text, end);
+        if (i < 4) {
+            if (text == end || *text != ',') {
+                return false;
+            }
+            text++;
         }
+    }
 
-        int format = -sprite.rle;
-        switch (format) {
-            case 2:
-                px = Rle8Decode(sprite, srcPx.get(), srcLen);
-                break;
-            case 3:
-                px = Rle5Decode(sprite, srcPx.get(), srcLen);
-                break;
-            case 4:
-                px = Lz5Decode(sprite, srcPx.get(), srcLen);
-                break;
-            case 10:
-            case 11:
-            case 12:
-                px = PngDecode(sprite, srcPx.get(), static_cast<uint32_t>(srcLen));
-                break;
-            default:
-                fprintf(stderr, "Unknown compression format: %d\n", format);
-                return nullptr;
+    frame = AnimFrame{};
+    frame.group = static_cast<int16_t>(values[0]);
+    frame.number = static_cast<int16_t>(values[1]);
+    frame.x = static_cast<int16_t>(values[2]);
+    frame.y = static_cast<int16_t>(values[3]);
+    frame.duration = values[4] < 0 ? -1 : static_cast<int32_t>(values[4]);
+    frame.blend = SPRITE_BLEND_NORMAL;
+    frame.alpha = 255;
+    if (frame.group >= 0 && frame.number >= 0) {
+        frame.sprite = sff.GetSprite(static_cast<uint16_t>(frame.group), static_cast<uint16_t>(frame.number));
+        if (frame.sprite == nullptr) {
+            numMissingSprites_++;
         }
     }
 
-    return px;
-}
+    // Optional flip field: H, V, HV or VH (may be empty)
+    if (text < end && *text == ',') {
+        text = SkipSpaces(text + 1, end);
+        for (; text < end && *text != ','; text++) {
+            char c = static_cast<char>(toupper(static_cast<unsigned char>(*text)));
+            if (c == 'H') frame.flip |= SPRITE_FLIP_X;
+            else if (c == 'V') frame.flip |= SPRITE_FLIP_Y;
+        }
+    }
 
-bool SffFile::ReadPcxHeader(Sprite& sprite, FILE* file, uint64_t offset) {
-    if (fseek(file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error seeking to PCX header offset\n");
-        return false;
+    // Optional blend field: A, A1, S or AS<src>D<dst>. AS/D modes without a full destination
+    // are drawn as alpha blending with the source alpha, A1 (half background) as A
+    if (text < end && *text == ',') {
+        text = SkipSpaces(text + 1, end);
+        if (StartsWithNoCase(text, end, "AS")) {
+            long src = 256;
+            long dst = 256;
+            const char* d = ParseInt(text + 2, end, src);
+            if (d != nullptr && d < end && toupper(static_cast<unsigned char>(*d)) == 'D') {
+                ParseInt(d + 1, end, dst);
+            }
+            frame.blend = dst >= 256 ? SPRITE_BLEND_ADD : SPRITE_BLEND_NORMAL;
+            frame.alpha = static_cast<uint8_t>(std::max(0L, std::min(255L, src)));
+        } else if (StartsWithNoCase(text, end, "A")) {
+            frame.blend = SPRITE_BLEND_ADD;
+        } else if (StartsWithNoCase(text, end, "S")) {
+            frame.blend = SPRITE_BLEND_SUBTRACT;
+        }
     }
+    return true;
+}
 
-    uint16_t dummy = ReadU16LE(file); (void)dummy;
-    uint8_t encoding, bpp;
+bool AirFile::Load(const std::string& filename, const SffFile& sff) {
+    Clear();
 
-    if (fread(&encoding, sizeof(uint8_t), 1, file) != 1) {
-        fprintf(stderr, "Error reading uint8_t encoding\n");
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        printf("Error opening file %s\n", filename.c_str());
         return false;
     }
-    if (fread(&bpp, sizeof(uint8_t), 1, file) != 1) {
-        fprintf(stderr, "Error reading uint8_t bpp\n");
-        return false;
+    std::vector<char> text;
+    char chunk[64 * 1024];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        text.insert(text.end(), chunk, chunk + read);
     }
+    fclose(file);
+    text.push_back('\0');  // strtol() stops here at the latest
+
+    AnimAction* action = nullptr;
+    // Clsn1/Clsn2 boxes: the Default ranges carry over to later frames, the others apply to
+    // the next frame only. Counts grow with the box lines actually present, pendingClsn is
+    // how many more the last header announced and clsnCount the count they go to
+    uint32_t defaultFirst[2] = {0, 0};
+    uint16_t defaultCount[2] = {0, 0};
+    uint32_t nextFirst[2] = {0, 0};
+    uint16_t nextCount[2] = {0, 0};
+    bool hasNext[2] = {false, false};
+    int pendingClsn = 0;
+    uint16_t* clsnCount = nullptr;
+    size_t numDuplicateActions = 0;
+    int lineNumber = 0;
+
+    const char* cursor = text.data();
+    const char* fileEnd = cursor + text.size() - 1;
+    while (cursor < fileEnd) {
+        const char* lineEnd = static_cast<const char*>(memchr(cursor, '\n', fileEnd - cursor));
+        if (lineEnd == nullptr) {
+            lineEnd = fileEnd;
+        }
+        const char* line = SkipSpaces(cursor, lineEnd);
+        const char* end = std::find(line, lineEnd, ';');
+        while (end > line && isspace(static_cast<unsigned char>(end[-1]))) {
+            end--;
+        }
+        cursor = lineEnd + 1;
+        lineNumber++;
+        if (line == end) {
+            continue;
+        }
+
+        if (*line == '[') {
+            action = nullptr;
+            pendingClsn = 0;
+            const char* name = SkipSpaces(line + 1, end);
+            if (!StartsWithNoCase(name, end, "Begin")) {
+                continue;
+            }
+            name = SkipSpaces(name + 5, end);
+            long number = 0;
+            if (!StartsWithNoCase(name, end, "Action") || ParseInt(name + 6, end, number) == nullptr) {
+                printf("Warning: %s:%d: bad action header\n", filename.c_str(), lineNumber);
+                continue;
+            }
+            // First definition wins like in MUGEN, the frames of later ones are parsed and dropped
+            if (!actionsByNumber_.emplace(static_cast<int>(number), static_cast<uint32_t>(actions_.size())).second) {
+                numDuplicateActions++;
+            }
+            actions_.push_back(AnimAction{static_cast<int>(number), static_cast<uint32_t>(frames_.size()), 0, 0, 0});
+            action = &actions_.back();
+            defaultCount[0] = defaultCount[1] = 0;
+            hasNext[0] = hasNext[1] = false;
+            continue;
+        }
+        if (action == nullptr) {
+            continue;
+        }
+
+        if (StartsWithNoCase(line, end, "Clsn")) {
+            // Shortest valid line is "Clsn1:" or "Clsn1[", a bare "Clsn" has no rest to parse
+            if (line + 5 > end) {
+                printf("Warning: %s:%d: bad Clsn header\n", filename.c_str(), lineNumber);
+                continue;
+            }
+            int type = line[4] == '1' ? 0 : 1;
+            const char* rest = line + 5;
+            if (rest < end && *rest == '[') {
+                // Clsn1[0] = left, top, right, bottom
+                const char* equals = static_cast<const char*>(memchr(rest, '=', end - rest));
+                long box[4];
+                const char* values = equals ? equals + 1 : nullptr;
+                for (int i = 0; i < 4 && values != nullptr; i++) {
+                    values = ParseInt(values, end, box[i]);
+                    if (values != nullptr && i < 3) {
+                        values = SkipSpaces(values, end);
+                        values = (values < end && *values == ',') ? values + 1 : nullptr;
+                    }
+                }
+                if (values == nullptr || pendingClsn <= 0) {
+                    printf("Warning: %s:%d: bad Clsn box\n", filename.c_str(), lineNumber);
+                    continue;
+                }
+                // Boxes may be given with any corner first
+                clsn_.push_back(ClsnBox{static_cast<int16_t>(std::min(box[0], box[2])),
+                                        static_cast<int16_t>(std::min(box[1], box[3])),
+                                        static_cast<int16_t>(std::max(box[0], box[2])),
+                                        static_cast<int16_t>(std::max(box[1], box[3]))});
+                pendingClsn--;
+                (*clsnCount)++;
+                continue;
+            }
+            // Clsn2Default: count or Clsn2: count
+            bool isDefault = StartsWithNoCase(rest, end, "Default");
+            const char* colon = static_cast<const char*>(memchr(rest, ':', end - rest));
+            long count = 0;
+            if (colon == nullptr || ParseInt(colon + 1, end, count) == nullptr || count < 0) {
+                printf("Warning: %s:%d: bad Clsn header\n", filename.c_str(), lineNumber);
+                continue;
+            }
+            uint32_t first = static_cast<uint32_t>(clsn_.size());
+            if (isDefault) {
+                defaultFirst[type] = first;
+                clsnCount = &defaultCount[type];
+            } else {
+                nextFirst[type] = first;
+                clsnCount = &nextCount[type];
+                hasNext[type] = true;
+            }
+            *clsnCount = 0;
+            pendingClsn = static_cast<int>(std::min(count, 0xFFFFL));
+            continue;
+        }
+
+        if (StartsWithNoCase(line, end, "Loopstart")) {
+            action->loopStart = action->frameCount;
+            continue;
+        }
 
-    if (bpp != 8) {
-        fprintf(stderr, "Invalid PCX color depth: expected 8-bit, got %d\n", bpp);
-        return false;
+        if (isdigit(static_cast<unsigned char>(*line)) || *line == '-') {
+            AnimFrame frame;
+            if (!ParseFrame(line, end, sff, frame)) {
+                printf("Warning: %s:%d: bad frame\n", filename.c_str(), lineNumber);
+                continue;
+            }
+            for (int type = 0; type < 2; type++) {
+                uint32_t first = hasNext[type] ? nextFirst[type] : defaultFirst[type];
+                uint16_t count = hasNext[type] ? nextCount[type] : defaultCount[type];
+                (type == 0 ? frame.clsn1First : frame.clsn2First) = first;
+                (type == 0 ? frame.clsn1Count : frame.clsn2Count) = count;
+                hasNext[type] = false;
+            }
+            frames_.push_back(frame);
+            action->frameCount++;
+            pendingClsn = 0;
+            if (action->totalTime >= 0) {
+                action->totalTime = frame.duration < 0 ? -1 : action->totalTime + frame.duration;
+            }
+        }
+        // Interpolate and other Ikemen extensions are skipped
     }
 
-    // Read rectangle coordinates
-    uint16_t rect[4];
-    for (int i = 0; i < 4; i++) {
-        rect[i] = ReadU16LE(file);
+    // Drop the frames of duplicate actions and of actions without frames
+    size_t numEmptyActions = 0;
+    for (size_t i = 0; i < actions_.size(); i++) {
+        AnimAction& a = actions_[i];
+        auto it = actionsByNumber_.find(a.number);
+        if (it == actionsByNumber_.end() || it->second != i) {
+            a.frameCount = 0;
+        } else if (a.frameCount == 0) {
+            numEmptyActions++;
+            actionsByNumber_.erase(it);
+        } else if (a.loopStart >= a.frameCount) {
+            a.loopStart = 0;
+        }
     }
-
-    if (fseek(file, offset + 66, SEEK_SET) != 0) {
-        fprintf(stderr, "Error seeking to bytes per line position\n");
-        return false;
+    if (numDuplicateActions > 0 || numEmptyActions > 0) {
+        std::vector<AnimAction> kept;
+        std::vector<AnimFrame> keptFrames;
+        kept.reserve(actionsByNumber_.size());
+        keptFrames.reserve(frames_.size());
+        for (const AnimAction& a : actions_) {
+            auto it = actionsByNumber_.find(a.number);
+            if (a.frameCount == 0) {
+                continue;
+            }
+            it->second = static_cast<uint32_t>(kept.size());
+            kept.push_back(a);
+            kept.back().firstFrame = static_cast<uint32_t>(keptFrames.size());
+            keptFrames.insert(keptFrames.end(), frames_.begin() + a.firstFrame,
+                              frames_.begin() + a.firstFrame + a.frameCount);
+        }
+        actions_.swap(kept);
+        frames_.swap(keptFrames);
     }
 
-    uint16_t bpl = ReadU16LE(file); (void)bpl;
+    printf("AIR: %zu actions, %zu frames, %zu Clsn boxes\n", actions_.size(), frames_.size(), clsn_.size());
+    if (numDuplicateActions > 0) {
+        printf("Warning: %zu actions are defined twice, the first definition is kept\n", numDuplicateActions);
+    }
+    if (numMissingSprites_ > 0) {
+        printf("Warning: %zu frames use sprites missing from the SFF\n", numMissingSprites_);
+    }
+    return true;
+}
 
-    sprite.Size[0] = rect[2] - rect[0] + 1;
-    sprite.Size[1] = rect[3] - rect[1] + 1;
-    sprite.rle = -1; // -1 for PCX
+void AirFile::Clear() {
+    actions_.clear();
+    frames_.clear();
+    clsn_.clear();
+    actionsByNumber_.clear();
+    numMissingSprites_ = 0;
+}
 
-    return true;
+// Implementation of AnimationPlayer methods
+bool AnimationPlayer::SetAction(const AirFile& air, int action) {
+    air_ = &air;
+    action_ = air.GetAction(action);
+    frame_ = 0;
+    frameTime_ = 0;
+    elapsed_ = 0;
+    return action_ != nullptr;
 }
 
-std::unique_ptr<uint8_t[]> SffFile::RlePcxDecode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
-    if (srcLen == 0) {
-        fprintf(stderr, "Warning: PCX data length is zero\n");
-        return nullptr;
+void AnimationPlayer::Update() {
+    if (action_ == nullptr) {
+        return;
     }
-
-    size_t dstLen = s.Size[0] * s.Size[1];
-    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for PCX decoded data dstLen=%zu srcLen=%zu (%dx%d)\n",
-                dstLen, srcLen, s.Size[0], s.Size[1]);
-        return nullptr;
+    elapsed_++;
+    int32_t duration = air_->GetFrames()[action_->firstFrame + frame_].duration;
+    if (duration < 0 || ++frameTime_ < duration) {
+        return;
     }
+    frameTime_ = 0;
+    frame_ = (frame_ + 1 < action_->frameCount) ? frame_ + 1 : action_->loopStart;
+}
 
-    size_t i = 0; // input pointer
-    size_t j = 0; // output pointer
-
-    while (i < srcLen && j < dstLen) {
-        uint8_t byte = srcPx[i++];
-        int count = 1;
-
-        if ((byte & 0xC0) == 0xC0) { // RLE marker
-            count = byte & 0x3F;
-            if (i < srcLen) {
-                byte = srcPx[i++];
-            } else {
-                fprintf(stderr, "Warning: RLE marker at end of data\n");
-                break;
-            }
+void AnimationPlayer::Draw(SpriteBatch& batch, const std::vector<Palette>& palettes, Vector2 position,
+                           int facing, float scale) const {
+    const AnimFrame* frame = GetFrame();
+    if (frame == nullptr || frame->sprite == nullptr) {
+        return;
+    }
+    const Sprite& sprite = *frame->sprite;
+    const Palette* palette = nullptr;
+    if (!sprite.IsRGBA()) {
+        if (sprite.palidx < 0 || static_cast<size_t>(sprite.palidx) >= palettes.size()) {
+            return;
         }
+        palette = &palettes[sprite.palidx];
+    }
+    float x = (facing & SPRITE_FLIP_X) ? -frame->x : frame->x;
+    float y = (facing & SPRITE_FLIP_Y) ? -frame->y : frame->y;
+    Color tint = WHITE;
+    tint.a = frame->alpha;
+    batch.SetBlend(static_cast<SpriteBlend>(frame->blend));
+    batch.Draw(sprite, palette, Vector2{position.x + x * scale, position.y + y * scale},
+               frame->flip ^ facing, scale, tint);
+    batch.SetBlend(SPRITE_BLEND_NORMAL);
+}
 
-        while (count-- > 0 && j < dstLen) {
-            dstPx[j++] = byte;
+void AnimationPlayer::DrawClsn(Vector2 position, int facing, float scale) const {
+    const AnimFrame* frame = GetFrame();
+    if (frame == nullptr) {
+        return;
+    }
+    const std::vector<ClsnBox>& boxes = air_->GetClsnBoxes();
+    const struct { uint32_t first; uint16_t count; Color color; } sets[] = {
+        { frame->clsn2First, frame->clsn2Count, Color{0, 0, 255, 255} },  // Hurt boxes blue
+        { frame->clsn1First, frame->clsn1Count, Color{255, 0, 0, 255} },  // Attack boxes red
+    };
+    for (const auto& set : sets) {
+        for (uint32_t i = set.first; i < set.first + set.count; i++) {
+            const ClsnBox& box = boxes[i];
+            float left = (facing & SPRITE_FLIP_X) ? -box.right : box.left;
+            float right = (facing & SPRITE_FLIP_X) ? -box.left : box.right;
+            float top = (facing & SPRITE_FLIP_Y) ? -box.bottom : box.top;
+            float bottom = (facing & SPRITE_FLIP_Y) ? -box.top : box.bottom;
+            DrawRectangleLines(static_cast<int>(position.x + left * scale), static_cast<int>(position.y + top * scale),
+                               static_cast<int>((right - left) * scale) + 1, static_cast<int>((bottom - top) * scale) + 1,
+                               set.color);
         }
     }
+}
 
-    if (j < dstLen) {
-        fprintf(stderr, "Warning: decoded PCX data shorter than expected (%zu vs %zu)\n", j, dstLen);
-        // Fill the remaining bytes with 0 (or a background color)
-        memset(dstPx.get() + j, 0, dstLen - j);
+#ifdef SFF_SPRITE_EXPORT
+// Undoes PremultiplyRGBA8(), PNG stores straight alpha
+static void UnpremultiplyRGBA8(uint8_t* px, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) {
+        uint8_t* p = px + i * 4;
+        unsigned a = p[3];
+        for (int c = 0; c < 3; c++) {
+            p[c] = a == 0 ? 0 : static_cast<uint8_t>(std::min(255u, (p[c] * 255u + a / 2) / a));
+        }
     }
-
-    return dstPx;
 }
 
-std::unique_ptr<uint8_t[]> SffFile::Rle8Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
-    if (srcLen == 0) {
-        fprintf(stderr, "Warning RLE8 data length is zero\n");
-        return nullptr;
+// Reads a sprite back from the GPU and saves it as PNG. Paletted sprites take their colours
+// from the palette's row of atlas, or from the palette texture when it isn't an atlas row.
+static bool ExportSprite(const Sprite& sprite, const Palette& palette, const PaletteAtlas* atlas,
+                         const std::string& filename) {
+    Image pixels = LoadImageFromTexture(sprite.texture.Get());
+    if (!pixels.data) {
+        printf("Failed to read back sprite %d,%d\n", sprite.Group, sprite.Number);
+        return false;
     }
-
-    size_t dstLen = s.Size[0] * s.Size[1];
-    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-        return nullptr;
+    if (sprite.atlasPage >= 0) {
+        ImageCrop(&pixels, sprite.atlasRect);
     }
 
-    size_t i = 0, j = 0;
-    // Decode the RLE data
-    while (j < dstLen) {
-        long n = 1;
-        uint8_t d = srcPx[i];
-        if (i < (srcLen - 1)) {
-            i++;
-        }
-        if ((d & 0xc0) == 0x40) {
-            n = d & 0x3f;
-            d = srcPx[i];
-            if (i < (srcLen - 1)) {
-                i++;
-            }
+    bool ok = false;
+    if (sprite.IsRGBA()) {
+        if (sprite.premultiplied) {
+            UnpremultiplyRGBA8(static_cast<uint8_t*>(pixels.data), static_cast<size_t>(pixels.width) * pixels.height);
         }
-        for (; n > 0; n--) {
-            if (j < dstLen) {
-                dstPx[j] = d;
-                j++;
-            }
+        ok = ExportRGBAPng(filename, static_cast<const uint8_t*>(pixels.data), pixels.width, pixels.height);
+    } else if (const uint8_t* colors = atlas ? atlas->GetRow(palette.row) : nullptr) {
+        ok = ExportIndexedPng(filename, static_cast<const uint8_t*>(pixels.data), pixels.width, pixels.height, colors);
+    } else {
+        Image pal = LoadImageFromTexture(palette.texture.Get());
+        if (pal.data && palette.row < pal.height) {
+            ok = ExportIndexedPng(filename, static_cast<const uint8_t*>(pixels.data), pixels.width, pixels.height,
+                                  static_cast<const uint8_t*>(pal.data) + static_cast<size_t>(palette.row) * 256 * 4);
         }
+        UnloadImage(pal);
     }
 
-    return dstPx;
+    UnloadImage(pixels);
+    if (ok) {
+        printf("Exported sprite %d,%d to %s\n", sprite.Group, sprite.Number, filename.c_str());
+    }
+    return ok;
 }
+#endif
 
-std::unique_ptr<uint8_t[]> SffFile::Rle5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
-    if (srcLen == 0) {
-        fprintf(stderr, "Warning RLE5 data length is zero\n");
-        return nullptr;
+// Fixed-rate simulation clock. Advance() once per rendered frame with the wall clock, then run
+// one simulation tick for every Tick() that returns true. GetAlpha() tells how far the frame
+// lies between the last two ticks, for interpolating what is drawn.
+class FixedTimestep {
+public:
+    // A frame never runs more than maxTicksPerFrame ticks, after a stall the rest is dropped
+    explicit FixedTimestep(double tickRate = 60.0, int maxTicksPerFrame = 5)
+        : tickSeconds_(1.0 / tickRate), maxTicksPerFrame_(maxTicksPerFrame), lastTime_(-1.0),
+          accumulator_(0.0), ticksThisFrame_(0), tickCount_(0), droppedTicks_(0) {}
+
+    void Advance(double now) {
+        if (lastTime_ >= 0.0) {
+            accumulator_ += std::max(0.0, now - lastTime_);
+        }
+        lastTime_ = now;
+        ticksThisFrame_ = 0;
+        double limit = tickSeconds_ * maxTicksPerFrame_;
+        if (accumulator_ > limit) {
+            droppedTicks_ += static_cast<uint64_t>((accumulator_ - limit) / tickSeconds_);
+            accumulator_ = limit;
+        }
     }
 
-    size_t dstLen = s.Size[0] * s.Size[1];
-    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for RLE decoded data\n");
-        return nullptr;
+    bool Tick() {
+        if (accumulator_ < tickSeconds_ || ticksThisFrame_ >= maxTicksPerFrame_) {
+            return false;
+        }
+        accumulator_ -= tickSeconds_;
+        ticksThisFrame_++;
+        tickCount_++;
+        return true;
     }
 
-    size_t i = 0, j = 0;
-    while (j < dstLen) {
-        int rl = static_cast<int>(srcPx[i]);
-        if (i < srcLen - 1) {
-            i++;
-        }
-        int dl = static_cast<int>(srcPx[i] & 0x7f);
-        uint8_t c = 0;
-        if (srcPx[i] >> 7 != 0) {
-            if (i < srcLen - 1) {
-                i++;
-            }
-            c = srcPx[i];
-        }
-        if (i < srcLen - 1) {
-            i++;
-        }
-        while (true) {
-            if (j < dstLen) {
-                dstPx[j] = c;
-                j++;
-            }
-            rl--;
-            if (rl < 0) {
-                dl--;
-                if (dl < 0) {
-                    break;
-                }
-                c = srcPx[i] & 0x1f;
-                rl = static_cast<int>(srcPx[i] >> 5);
-                if (i < srcLen - 1) {
-                    i++;
-                }
-            }
+    float GetAlpha() const { return static_cast<float>(std::min(1.0, accumulator_ / tickSeconds_)); }
+    uint64_t GetTickCount() const { return tickCount_; }
+    uint64_t GetDroppedTicks() const { return droppedTicks_; }
+
+private:
+    double tickSeconds_;
+    int maxTicksPerFrame_;
+    double lastTime_;
+    double accumulator_;
+    int ticksThisFrame_;
+    uint64_t tickCount_;
+    uint64_t droppedTicks_;
+};
+
+// Keyboard keys and gamepad buttons as the simulation sees them. Sample() once per rendered
+// frame; a press is held until a tick reads it and calls EndTick(), so every press reaches
+// exactly one tick however many ticks (zero included) a frame runs.
+class TickInput {
+public:
+    void WatchKey(int key) { inputs_.push_back(Input{key, -1, false, false}); }
+    void WatchGamepadButton(int gamepad, int button) { inputs_.push_back(Input{button, gamepad, false, false}); }
+
+    void Sample() {
+        for (Input& input : inputs_) {
+            bool pressed = input.gamepad < 0 ? IsKeyPressed(input.code) : IsGamepadButtonPressed(input.gamepad, input.code);
+            input.down = input.gamepad < 0 ? IsKeyDown(input.code) : IsGamepadButtonDown(input.gamepad, input.code);
+            input.pressed = input.pressed || pressed;
         }
     }
 
-    return dstPx;
-}
+    bool IsPressed(int key, int gamepad = -1) const {
+        const Input* input = Find(key, gamepad);
+        return input && input->pressed;
+    }
 
-std::unique_ptr<uint8_t[]> SffFile::Lz5Decode(const Sprite& s, const uint8_t* srcPx, size_t srcLen) {
-    if (srcLen == 0) {
-        fprintf(stderr, "Warning LZ5 data length is zero\n");
-        return nullptr;
+    // Held presses count as down for the tick that sees them, even if released within the frame
+    bool IsDown(int key, int gamepad = -1) const {
+        const Input* input = Find(key, gamepad);
+        return input && (input->down || input->pressed);
     }
 
-    size_t dstLen = s.Size[0] * s.Size[1];
-    auto dstPx = std::make_unique<uint8_t[]>(dstLen);
-    if (!dstPx) {
-        fprintf(stderr, "Error allocating memory for LZ5 decoded data\n");
+    void EndTick() {
+        for (Input& input : inputs_) {
+            input.pressed = false;
+        }
+    }
+
+private:
+    struct Input {
+        int code;
+        int gamepad;   // -1 for keyboard keys
+        bool down;
+        bool pressed;  // Since the last EndTick()
+    };
+
+    const Input* Find(int code, int gamepad) const {
+        for (const Input& input : inputs_) {
+            if (input.code == code && input.gamepad == gamepad) {
+                return &input;
+            }
+        }
         return nullptr;
     }
 
-    // Initialize output buffer to zeros
-    memset(dstPx.get(), 0, dstLen);
+    std::vector<Input> inputs_;
+};
 
-    // Decode the LZ5 data
-    size_t i = 0, j = 0;
-    long n = 0;
-    uint8_t ct = srcPx[i], cts = 0, rb = 0, rbc = 0;
-    if (i < srcLen - 1) {
-        i++;
-    }
+// Rounded c / 255 for c up to 255 * 255, the same rounding as PremultiplyRGBA8()
+static inline uint8_t Div255(unsigned c) {
+    c += 128;
+    return static_cast<uint8_t>((c + (c >> 8)) >> 8);
+}
 
-    while (j < dstLen) {
-        size_t d = static_cast<size_t>(srcPx[i]);
-        if (i < srcLen - 1) {
-            i++;
-        }
+// Looks count palette indices up in a 256 entry colour table, 8 per iteration with AVX2
+// gathers. SSE2 and NEON have no gather, the scalar loop is as fast there.
+static void LookupPaletteRow(uint32_t* dst, const uint8_t* indices, int count, const uint32_t* lut) {
+    int i = 0;
+#if defined(SFF_SIMD_AVX2)
+    for (; i + 8 <= count; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices + i)));
+        __m256i color = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), color);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = lut[indices[i]];
+    }
+}
 
-        if (ct & (1 << cts)) {
-            if ((d & 0x3f) == 0) {
-                d = (d << 2 | static_cast<int>(srcPx[i])) + 1;
-                if (i < srcLen - 1) {
-                    i++;
-                }
-                n = static_cast<int>(srcPx[i]) + 2;
-                if (i < srcLen - 1) {
-                    i++;
-                }
-            } else {
-                rb |= static_cast<uint8_t>((d & 0xc0) >> rbc);
-                rbc += 2;
-                n = static_cast<int>(d & 0x3f);
-                if (rbc < 8) {
-                    d = static_cast<int>(srcPx[i]) + 1;
-                    if (i < srcLen - 1) {
-                        i++;
-                    }
-                } else {
-                    d = static_cast<int>(rb) + 1;
-                    rb = rbc = 0;
-                }
+// Blends count RGBA pixels of src into dst. Normal is src over dst by the source alpha, add
+// and subtract scale the source by its alpha and saturate, leaving subtract's dst alpha as it
+// is (BLEND_ADDITIVE and the reverse subtract SpriteBatch uses). 8 pixels per iteration on
+// AVX2 and NEON, 4 on SSE2; runs that are fully transparent, or opaque for normal blending,
+// skip the arithmetic.
+static void BlendRow(uint8_t* dst, const uint8_t* src, int count, int blend) {
+    int i = 0;
+#if defined(SFF_SIMD_AVX2)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i alphaMask = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+        const __m256i rgbMask = _mm256_set1_epi64x(0x0000FFFFFFFFFFFFLL);
+        const __m256i alphaOne = _mm256_set1_epi64x(0x00FF000000000000LL);
+        const __m256i full = _mm256_set1_epi16(255);
+        const __m256i bias = _mm256_set1_epi16(128);
+        for (; i + 8 <= count; i += 8) {
+            __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+            __m256i alpha = _mm256_and_si256(s, alphaMask);
+            if (_mm256_testz_si256(alpha, alpha)) {
+                continue;
             }
-            for (;;) {
-                if (j < dstLen && j >= d) {
-                    dstPx[j] = dstPx[j - d];
-                    j++;
-                } else if (j < dstLen) {
-                    // Handle case where we can't copy from previous data
-                    dstPx[j++] = 0;
+            if (blend == SPRITE_BLEND_NORMAL && _mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaMask)) == -1) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), s);
+                continue;
+            }
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i * 4));
+            __m256i sh[2] = {_mm256_unpacklo_epi8(s, zero), _mm256_unpackhi_epi8(s, zero)};
+            __m256i dh[2] = {_mm256_unpacklo_epi8(d, zero), _mm256_unpackhi_epi8(d, zero)};
+            for (int h = 0; h < 2; h++) {
+                __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sh[h], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                // Alpha goes through as 255 * a, except for subtract which keeps dst alpha
+                __m256i color = _mm256_and_si256(sh[h], rgbMask);
+                if (blend != SPRITE_BLEND_SUBTRACT) {
+                    color = _mm256_or_si256(color, alphaOne);
                 }
-                n--;
-                if (n < 0) {
-                    break;
+                __m256i t = _mm256_mullo_epi16(color, a);
+                if (blend == SPRITE_BLEND_NORMAL) {
+                    t = _mm256_add_epi16(t, _mm256_mullo_epi16(dh[h], _mm256_sub_epi16(full, a)));
                 }
+                t = _mm256_add_epi16(t, bias);
+                sh[h] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
             }
-        } else {
-            if ((d & 0xe0) == 0) {
-                n = static_cast<int>(srcPx[i]) + 8;
-                if (i < srcLen - 1) {
-                    i++;
-                }
-            } else {
-                n = d >> 5;
-                d &= 0x1f;
+            __m256i result = _mm256_packus_epi16(sh[0], sh[1]);
+            if (blend == SPRITE_BLEND_ADD) {
+                result = _mm256_adds_epu8(d, result);
+            } else if (blend == SPRITE_BLEND_SUBTRACT) {
+                result = _mm256_subs_epu8(d, result);
             }
-            while (n-- > 0 && j < dstLen) {
-                dstPx[j] = static_cast<uint8_t>(d);
-                j++;
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), result);
+        }
+    }
+#endif
+#if defined(SFF_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alphaMask = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    const __m128i rgbMask = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i alphaOne = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i bias = _mm_set1_epi16(128);
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        __m128i alpha = _mm_and_si128(s, alphaMask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xFFFF) {
+            continue;
+        }
+        if (blend == SPRITE_BLEND_NORMAL && _mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) == 0xFFFF) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i * 4));
+        __m128i sh[2] = {_mm_unpacklo_epi8(s, zero), _mm_unpackhi_epi8(s, zero)};
+        __m128i dh[2] = {_mm_unpacklo_epi8(d, zero), _mm_unpackhi_epi8(d, zero)};
+        for (int h = 0; h < 2; h++) {
+            __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sh[h], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            // Alpha goes through as 255 * a, except for subtract which keeps dst alpha
+            __m128i color = _mm_and_si128(sh[h], rgbMask);
+            if (blend != SPRITE_BLEND_SUBTRACT) {
+                color = _mm_or_si128(color, alphaOne);
+            }
+            __m128i t = _mm_mullo_epi16(color, a);
+            if (blend == SPRITE_BLEND_NORMAL) {
+                t = _mm_add_epi16(t, _mm_mullo_epi16(dh[h], _mm_sub_epi16(full, a)));
             }
+            t = _mm_add_epi16(t, bias);
+            sh[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
         }
-        cts++;
-        if (cts >= 8) {
-            ct = srcPx[i];
-            cts = 0;
-            if (i < srcLen - 1) {
-                i++;
+        __m128i result = _mm_packus_epi16(sh[0], sh[1]);
+        if (blend == SPRITE_BLEND_ADD) {
+            result = _mm_adds_epu8(d, result);
+        } else if (blend == SPRITE_BLEND_SUBTRACT) {
+            result = _mm_subs_epu8(d, result);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), result);
+    }
+#elif defined(SFF_SIMD_NEON)
+    const uint8x8_t full = vdup_n_u8(255);
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(src + i * 4);
+        uint64_t alphaBits = vget_lane_u64(vreinterpret_u64_u8(s.val[3]), 0);
+        if (alphaBits == 0) {
+            continue;
+        }
+        if (blend == SPRITE_BLEND_NORMAL && alphaBits == ~0ULL) {
+            vst4_u8(dst + i * 4, s);
+            continue;
+        }
+        uint8x8x4_t d = vld4_u8(dst + i * 4);
+        uint8x8_t a = s.val[3];
+        uint8x8_t inverse = vsub_u8(full, a);
+        for (int c = 0; c < 3; c++) {
+            uint16x8_t t = vmull_u8(s.val[c], a);
+            if (blend == SPRITE_BLEND_NORMAL) {
+                t = vmlal_u8(t, d.val[c], inverse);
             }
+            uint8x8_t scaled = vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+            d.val[c] = blend == SPRITE_BLEND_ADD ? vqadd_u8(d.val[c], scaled) :
+                       blend == SPRITE_BLEND_SUBTRACT ? vqsub_u8(d.val[c], scaled) : scaled;
+        }
+        if (blend == SPRITE_BLEND_NORMAL) {
+            uint16x8_t t = vmlal_u8(vmull_u8(full, a), d.val[3], inverse);
+            d.val[3] = vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+        } else if (blend == SPRITE_BLEND_ADD) {
+            d.val[3] = vqadd_u8(d.val[3], a);
+        }
+        vst4_u8(dst + i * 4, d);
+    }
+#endif
+    for (; i < count; i++) {
+        const uint8_t* s = src + i * 4;
+        uint8_t* d = dst + i * 4;
+        unsigned a = s[3];
+        if (a == 0) {
+            continue;
+        }
+        for (int c = 0; c < 3; c++) {
+            if (blend == SPRITE_BLEND_NORMAL) {
+                d[c] = Div255(s[c] * a + d[c] * (255 - a));
+            } else if (blend == SPRITE_BLEND_ADD) {
+                d[c] = static_cast<uint8_t>(std::min(255, d[c] + Div255(s[c] * a)));
+            } else {
+                d[c] = static_cast<uint8_t>(std::max(0, d[c] - Div255(s[c] * a)));
+            }
+        }
+        if (blend == SPRITE_BLEND_NORMAL) {
+            d[3] = Div255(255 * a + d[3] * (255 - a));
+        } else if (blend == SPRITE_BLEND_ADD) {
+            d[3] = static_cast<uint8_t>(std::min(255u, d[3] + a));
         }
     }
-
-    return dstPx;
 }
 
-std::unique_ptr<uint8_t[]> SffFile::PngDecode(Sprite& s, const uint8_t* data, size_t datasize) {
-    lodepng::State state;
-    unsigned int width = 0, height = 0;
+// Draws paletted sprites on the CPU into an RGBA framebuffer: no GPU involved, so it runs
+// headless, gives exact pixels to compare against golden images and works where the palette
+// shader doesn't. Sprites are clipped, flipped and scaled by whole numbers, index 0 is
+// transparent and the blend modes match SpriteBatch. RGBA sprites and PalFX are not drawn.
+class SoftwareRenderer {
+public:
+    SoftwareRenderer() : width_(0), height_(0), blend_(SPRITE_BLEND_NORMAL) {}
 
-    // Inspect PNG to get dimensions and format
-    unsigned status = lodepng_inspect(&width, &height, &state, data, datasize);
-    if (status) {
-        fprintf(stderr, "Error inspecting PNG data: %s\n", lodepng_error_text(status));
-        return nullptr;
-    }
+    bool Init(int width, int height);
+    void Clear(Color color);
 
-    // Configure decoding based on sprite format
-    if (s.rle == -10) {  // Paletted PNG
-        state.info_raw.colortype = LCT_PALETTE;
-    } else {  // RGBA PNG
-        state.info_raw.colortype = LCT_RGBA;
-    }
+    // Drawing is limited to this rectangle (and the framebuffer)
+    void SetClipRect(int x, int y, int width, int height);
+    void ResetClipRect() { SetClipRect(0, 0, width_, height_); }
 
-    // Set bit depth
-    if (state.info_png.color.bitdepth == 16) {
-        state.info_raw.bitdepth = 16;
-    } else {
-        state.info_raw.bitdepth = 8;
+    void SetBlend(SpriteBlend blend) { blend_ = blend; }
+
+    // Sprite index of sff with its axis at x, y like SpriteBatch::Draw(), in the palette of
+    // its palidx. Pixels are decoded on first use and kept until ClearCache(), call it after
+    // the file is reloaded. alpha scales the palette alpha (AS###D### translucency).
+    bool Draw(SffFile& sff, uint32_t index, int x, int y, int flip = SPRITE_FLIP_NONE, int scale = 1,
+              uint8_t alpha = 255);
+
+    // width * height palette indices with their top left corner at x, y. paletteRGBA holds
+    // 256 RGBA entries like the palette atlas rows.
+    void DrawIndexed(const uint8_t* indices, int width, int height, const uint8_t* paletteRGBA, int x, int y,
+                     int flip = SPRITE_FLIP_NONE, int scale = 1, uint8_t alpha = 255);
+
+    void ClearCache() { cache_.clear(); }
+
+    // width * height RGBA pixels, rows top to bottom
+    const uint8_t* GetPixels() const { return pixels_.data(); }
+    int GetWidth() const { return width_; }
+    int GetHeight() const { return height_; }
+
+#ifdef SFF_SPRITE_EXPORT
+    bool WritePng(const std::string& filename) const {
+        return ExportRGBAPng(filename, pixels_.data(), static_cast<unsigned>(width_), static_cast<unsigned>(height_));
     }
+#endif
 
-    // Decode PNG
-    unsigned char* dstPx = nullptr;
-    status = lodepng_decode(&dstPx, &width, &height, &state, data, datasize);
+private:
+    struct DecodedSprite {
+        std::unique_ptr<uint8_t[]> indices;
+        int width;
+        int height;
+        int offsetX;  // Axis within the decoded pixels
+        int offsetY;
+    };
+
+    std::vector<uint8_t> pixels_;
+    std::vector<uint8_t> indexRow_;   // Source indices of one flipped or scaled destination row
+    std::vector<uint32_t> colorRow_;  // That row looked up in the palette
+    std::map<std::pair<const SffFile*, uint32_t>, DecodedSprite> cache_;
+    int width_;
+    int height_;
+    int clipX0_, clipY0_, clipX1_, clipY1_;
+    SpriteBlend blend_;
+};
 
-    if (status != 0) {
-        fprintf(stderr, "Could not decode PNG image(%s)\n", lodepng_error_text(status));
-        return nullptr;
+// Implementation of SoftwareRenderer methods
+bool SoftwareRenderer::Init(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error: invalid framebuffer size %dx%d\n", width, height);
+        return false;
     }
+    width_ = width;
+    height_ = height;
+    pixels_.assign(static_cast<size_t>(width) * height * 4, 0);
+    ResetClipRect();
+    return true;
+}
 
-    // Update sprite dimensions
-    s.Size[0] = static_cast<uint16_t>(width);
-    s.Size[1] = static_cast<uint16_t>(height);
+void SoftwareRenderer::Clear(Color color) {
+    const uint8_t rgba[4] = {color.r, color.g, color.b, color.a};
+    uint32_t value;
+    memcpy(&value, rgba, 4);
+    std::fill(reinterpret_cast<uint32_t*>(pixels_.data()), reinterpret_cast<uint32_t*>(pixels_.data() + pixels_.size()), value);
+}
+
+void SoftwareRenderer::SetClipRect(int x, int y, int width, int height) {
+    clipX0_ = std::max(x, 0);
+    clipY0_ = std::max(y, 0);
+    clipX1_ = std::min(x + width, width_);
+    clipY1_ = std::min(y + height, height_);
+}
 
-    // Copy to a properly allocated unique_ptr (safe approach)
-    size_t pixelSize = (state.info_raw.colortype == LCT_RGBA) ? 4 : 1;
-    size_t imageSize = width * height * pixelSize;
+bool SoftwareRenderer::Draw(SffFile& sff, uint32_t index, int x, int y, int flip, int scale, uint8_t alpha) {
+    const Sprite* sprite = sff.GetSprite(index);
+    const Palette* palette = sprite ? sff.GetPalette(sprite->palidx) : nullptr;
+    if (!sprite || sprite->IsRGBA() || !palette || !sff.GetPaletteAtlas()) {
+        return false;
+    }
+    const uint8_t* colors = sff.GetPaletteAtlas()->GetRow(palette->row);
 
-    auto result = std::make_unique<uint8_t[]>(imageSize);
-    memcpy(result.get(), dstPx, imageSize);
-    free(dstPx);  // Free the lodepng-allocated memory
+    auto it = cache_.find(std::make_pair(&sff, index));
+    if (it == cache_.end()) {
+        DecodedSprite decoded;
+        decoded.indices = sff.DecodeSpritePixels(index, decoded.width, decoded.height, decoded.offsetX, decoded.offsetY);
+        if (!decoded.indices) {
+            return false;
+        }
+        it = cache_.emplace(std::make_pair(&sff, index), std::move(decoded)).first;
+    }
+    const DecodedSprite& decoded = it->second;
 
-    return result;
+    int left = (flip & SPRITE_FLIP_X) ? x - (decoded.width - decoded.offsetX) * scale : x - decoded.offsetX * scale;
+    int top = (flip & SPRITE_FLIP_Y) ? y - (decoded.height - decoded.offsetY) * scale : y - decoded.offsetY * scale;
+    DrawIndexed(decoded.indices.get(), decoded.width, decoded.height, colors, left, top, flip, scale, alpha);
+    return true;
 }
 
-Texture2D SffFile::GeneratePaletteTexture(const std::array<uint32_t, 256>& pal_rgba) {
-    Texture2D texture = {};
-    std::array<uint8_t, 256 * 4> pal_byte;
+void SoftwareRenderer::DrawIndexed(const uint8_t* indices, int width, int height, const uint8_t* paletteRGBA,
+                                   int x, int y, int flip, int scale, uint8_t alpha) {
+    if (!indices || !paletteRGBA || width <= 0 || height <= 0 || scale < 1 || alpha == 0) {
+        return;
+    }
+    int x0 = std::max(x, clipX0_);
+    int y0 = std::max(y, clipY0_);
+    int x1 = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(x) + static_cast<int64_t>(width) * scale, clipX1_));
+    int y1 = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(y) + static_cast<int64_t>(height) * scale, clipY1_));
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
 
-    // Convert the RGBA values into bytes (0-255 range for each channel)
-    for (int i = 0; i < 256; i++) {
-        pal_byte[i * 4 + 0] = (pal_rgba[i] >> 0) & 0xFF;  // R
-        pal_byte[i * 4 + 1] = (pal_rgba[i] >> 8) & 0xFF;  // G
-        pal_byte[i * 4 + 2] = (pal_rgba[i] >> 16) & 0xFF; // B
-        pal_byte[i * 4 + 3] = (pal_rgba[i] >> 24) & 0xFF; // A
+    // Index 0 is transparent whatever colour the palette gives it
+    uint32_t lut[256];
+    memcpy(lut, paletteRGBA, sizeof(lut));
+    if (alpha < 255) {
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(lut);
+        for (int i = 0; i < 256; i++) {
+            bytes[i * 4 + 3] = Div255(bytes[i * 4 + 3] * alpha);
+        }
+    }
+    lut[0] = 0;
+
+    int span = x1 - x0;
+    indexRow_.resize(span);
+    colorRow_.resize(span);
+    int lastRow = -1;
+    for (int dy = y0; dy < y1; dy++) {
+        int sy = (dy - y) / scale;
+        if (flip & SPRITE_FLIP_Y) {
+            sy = height - 1 - sy;
+        }
+        // Rows repeated by scaling are looked up once
+        if (sy != lastRow) {
+            const uint8_t* row = indices + static_cast<size_t>(sy) * width;
+            if (scale == 1 && !(flip & SPRITE_FLIP_X)) {
+                row += x0 - x;
+            } else {
+                for (int i = 0; i < span; i++) {
+                    int sx = (x0 + i - x) / scale;
+                    indexRow_[i] = row[(flip & SPRITE_FLIP_X) ? width - 1 - sx : sx];
+                }
+                row = indexRow_.data();
+            }
+            LookupPaletteRow(colorRow_.data(), row, span, lut);
+            lastRow = sy;
+        }
+        BlendRow(&pixels_[(static_cast<size_t>(dy) * width_ + x0) * 4], reinterpret_cast<const uint8_t*>(colorRow_.data()),
+                 span, blend_);
     }
+}
 
-    texture.id = rlLoadTexture(pal_byte.data(), 256, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, 1);
-    texture.width = 256;
-    texture.height = 1;
-    texture.mipmaps = 1;
-    texture.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+// Scrollable grid of every sprite of a file, meant for files loaded with SetDeferDecode().
+// Only cells in view are decoded, a few per frame, into RGBA thumbnails with the sprite's
+// palette applied. Thumbnails stay in an LRU cache, so huge files open at once and scroll
+// without decoding anything twice.
+class SpriteBrowser {
+public:
+    explicit SpriteBrowser(SffFile& sff, int cellSize = 96, size_t maxThumbnails = 1024, int decodesPerFrame = 16)
+        : sff_(sff), cellSize_(cellSize), maxThumbnails_(maxThumbnails), decodesPerFrame_(decodesPerFrame),
+          scroll_(0.0f), frame_(0), numDecodes_(0) {}
+
+    // Scrolls with the mouse wheel, arrow keys, Page Up/Down and Home/End
+    void Update(int width, int height);
+
+    // Draws the cells in view and a status line for the sprite under the mouse
+    void Draw(int width, int height);
+
+    void Clear() { thumbnails_.clear(); }
+    size_t GetThumbnailCount() const { return thumbnails_.size(); }
+    size_t GetDecodeCount() const { return numDecodes_; }
 
-    // CRITICAL: Set palette texture to NEAREST filtering
-    rlTextureParameters(texture.id, RL_TEXTURE_MIN_FILTER, RL_TEXTURE_FILTER_NEAREST);
-    rlTextureParameters(texture.id, RL_TEXTURE_MAG_FILTER, RL_TEXTURE_FILTER_NEAREST);
-    rlTextureParameters(texture.id, RL_TEXTURE_WRAP_S, RL_TEXTURE_WRAP_CLAMP);
-    rlTextureParameters(texture.id, RL_TEXTURE_WRAP_T, RL_TEXTURE_WRAP_CLAMP);
+private:
+    struct Thumbnail {
+        TextureHandle texture;  // Empty if the sprite could not be decoded
+        uint64_t lastUsed;
+    };
+
+    static const int kLabelHeight = 12;
+    static const int kStatusHeight = 16;
+
+    int GetColumns(int width) const { return std::max(1, width / cellSize_); }
+    float GetMaxScroll(int width, int height) const;
+    Thumbnail MakeThumbnail(uint32_t index);
+    void EvictThumbnails();
+
+    SffFile& sff_;
+    int cellSize_;
+    size_t maxThumbnails_;
+    int decodesPerFrame_;
+    float scroll_;
+    uint64_t frame_;
+    size_t numDecodes_;
+    std::unordered_map<uint32_t, Thumbnail> thumbnails_;
+};
 
-    return texture;
+// Implementation of SpriteBrowser methods
+float SpriteBrowser::GetMaxScroll(int width, int height) const {
+    int columns = GetColumns(width);
+    int rows = static_cast<int>((sff_.GetSprites().size() + columns - 1) / columns);
+    return std::max(0.0f, static_cast<float>(rows * cellSize_ - (height - kStatusHeight)));
 }
 
-Texture2D SffFile::GeneratePaletteTexture(const std::array<RGB, 256>& pal_rgb) {
-    Texture2D texture = {};
-    std::array<uint8_t, 256 * 4> pal_byte;
+void SpriteBrowser::Update(int width, int height) {
+    float page = static_cast<float>(height - kStatusHeight - cellSize_);
+    scroll_ -= GetMouseWheelMove() * cellSize_;
+    if (IsKeyDown(KEY_DOWN)) scroll_ += cellSize_ / 4.0f;
+    if (IsKeyDown(KEY_UP)) scroll_ -= cellSize_ / 4.0f;
+    if (IsKeyPressed(KEY_PAGE_DOWN)) scroll_ += page;
+    if (IsKeyPressed(KEY_PAGE_UP)) scroll_ -= page;
+    if (IsKeyPressed(KEY_HOME)) scroll_ = 0.0f;
+    if (IsKeyPressed(KEY_END)) scroll_ = GetMaxScroll(width, height);
+    scroll_ = std::max(0.0f, std::min(scroll_, GetMaxScroll(width, height)));
+}
 
-    // Convert the RGB values into bytes (0-255 range for each channel) in reverse order
-    for (int i = 0; i < 256; i++) {
-        pal_byte[i * 4 + 0] = pal_rgb[255 - i].r; // R
-        pal_byte[i * 4 + 1] = pal_rgb[255 - i].g; // G
-        pal_byte[i * 4 + 2] = pal_rgb[255 - i].b; // B
-        pal_byte[i * 4 + 3] = i ? 255 : 0;        // A (transparent for index 0)
+SpriteBrowser::Thumbnail SpriteBrowser::MakeThumbnail(uint32_t index) {
+    Thumbnail thumbnail;
+    thumbnail.lastUsed = frame_;
+    numDecodes_++;
+
+    int width = 0;
+    int height = 0;
+    int offsetX = 0;
+    int offsetY = 0;
+    std::unique_ptr<uint8_t[]> data = sff_.DecodeSpritePixels(index, width, height, offsetX, offsetY);
+    if (!data || width <= 0 || height <= 0) {
+        return thumbnail;
+    }
+    const Sprite& sprite = sff_.GetSprites()[index];
+    const uint8_t* colors = nullptr;
+    if (!sprite.IsRGBA()) {
+        const Palette* palette = sff_.GetPalette(static_cast<size_t>(sprite.palidx));
+        colors = palette ? sff_.GetPaletteAtlas()->GetRow(palette->row) : nullptr;
+        if (colors == nullptr) {
+            return thumbnail;
+        }
+    }
+
+    // Nearest-neighbour downscale to fit the cell, small sprites keep their size
+    float scale = std::min(1.0f, std::min(static_cast<float>(cellSize_ - 4) / width,
+                                          static_cast<float>(cellSize_ - kLabelHeight - 4) / height));
+    int thumbWidth = std::max(1, static_cast<int>(width * scale));
+    int thumbHeight = std::max(1, static_cast<int>(height * scale));
+    std::vector<uint8_t> pixels(static_cast<size_t>(thumbWidth) * thumbHeight * 4);
+    for (int y = 0; y < thumbHeight; y++) {
+        int srcY = y * height / thumbHeight;
+        for (int x = 0; x < thumbWidth; x++) {
+            size_t src = static_cast<size_t>(srcY) * width + x * width / thumbWidth;
+            const uint8_t* texel = colors ? colors + data[src] * 4 : data.get() + src * 4;
+            memcpy(&pixels[(static_cast<size_t>(y) * thumbWidth + x) * 4], texel, 4);
+        }
     }
 
-    texture.id = rlLoadTexture(pal_byte.data(), 256, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, 1);
-    texture.width = 256;
-    texture.height = 1;
+    if (!VramBudget::Instance().Reserve(pixels.size())) {
+        return thumbnail;
+    }
+    Texture2D texture = {};
+    texture.id = rlLoadTexture(pixels.data(), thumbWidth, thumbHeight, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, 1);
+    texture.width = thumbWidth;
+    texture.height = thumbHeight;
     texture.mipmaps = 1;
     texture.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
-
-    // CRITICAL: Set palette texture to NEAREST filtering
-    rlTextureParameters(texture.id, RL_TEXTURE_MIN_FILTER, RL_TEXTURE_FILTER_NEAREST);
-    rlTextureParameters(texture.id, RL_TEXTURE_MAG_FILTER, RL_TEXTURE_FILTER_NEAREST);
-    rlTextureParameters(texture.id, RL_TEXTURE_WRAP_S, RL_TEXTURE_WRAP_CLAMP);
-    rlTextureParameters(texture.id, RL_TEXTURE_WRAP_T, RL_TEXTURE_WRAP_CLAMP);
-
-    return texture;
+    if (texture.id != 0) {
+        thumbnail.texture = TextureHandle(texture, VRAM_RGBA_SPRITES);
+    }
+    return thumbnail;
 }
 
-// Most efficient version - relies on palette texture having proper alpha (it is working)
-// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
-// "precision mediump float;\n"
-// "in vec2 fragTexCoord;\n"
-// "in vec4 fragColor;\n"
-// "uniform sampler2D texture0;\n"
-// "uniform sampler2D paletteTex;\n"
-// "out vec4 finalColor;\n"
-// "void main()\n"
-// "{\n"
-// "    vec4 texel = texture(texture0, fragTexCoord);\n"
-// "    // Get palette index from grayscale texture (0-255 range)\n"
-// "    float index = texel.r * 255.0;\n"
-// "    \n"
-// "    // Convert to normalized texture coordinate\n"
-// "    float paletteCoord = (index + 0.5) / 256.0;\n"
-// "    // Sample the palette texture - it should have alpha=0 for index 0\n"
-// "    vec4 color = texture(paletteTex, vec2(paletteCoord, 0.5));\n"
-// "    \n"
-// "    // Use the palette's alpha channel directly\n"
-// "    finalColor = vec4(color.rgb * fragColor.rgb, color.a * fragColor.a);\n"
-// "}\n";
-
-// Shader optimized for NEAREST filtering (now it's working)
-// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
-// "in vec2 fragTexCoord;\n"
-// "in vec4 fragColor;\n"
-// "uniform sampler2D texture0;    // Indexed sprite texture\n"
-// "uniform sampler2D paletteTex;    // Palette texture\n"
-// "out vec4 finalColor;\n"
-// "void main()\n"
-// "{\n"
-// "    // Sample the indexed texture with NEAREST filtering\n"
-// "    vec4 texel = texture(texture0, fragTexCoord);\n"
-// "    \n"
-// "    // Get palette index (0-255) - use proper rounding for NEAREST\n"
-// "    int index = int(texel.r * 255.0 + 0.5);\n"
-// "    \n"
-// "    // Calculate EXACT texel center for palette texture with NEAREST filtering\n"
-// "    float paletteCoord = (float(index) + 0.5) / 256.0;\n"
-// "    \n"
-// "    // Sample the palette texture with NEAREST filtering\n"
-// "    vec4 color = texture(paletteTex, vec2(paletteCoord, 0.5));\n"
-// "    \n"
-// "    // Use palette alpha and apply vertex color\n"
-// "    finalColor = vec4(color.rgb, color.a) * fragColor;\n"
-// "}\n";
+void SpriteBrowser::EvictThumbnails() {
+    if (thumbnails_.size() <= maxThumbnails_) {
+        return;
+    }
+    // Drop down to three quarters at once, so a long scroll evicts in a few batches
+    std::vector<std::pair<uint64_t, uint32_t>> byAge;
+    byAge.reserve(thumbnails_.size());
+    for (const auto& entry : thumbnails_) {
+        if (entry.second.lastUsed < frame_) {
+            byAge.emplace_back(entry.second.lastUsed, entry.first);
+        }
+    }
+    std::sort(byAge.begin(), byAge.end());
+    size_t target = maxThumbnails_ * 3 / 4;
+    for (size_t i = 0; i < byAge.size() && thumbnails_.size() > target; i++) {
+        thumbnails_.erase(byAge[i].second);
+    }
+}
 
-// Alternative: Use texelFetch for maximum precision with NEAREST filtering (now it's working)
-// static const char *FRAGMENT_SHADER_SRC = "#version 330\n"
-// "in vec2 fragTexCoord;\n"
-// "in vec4 fragColor;\n"
-// "uniform sampler2D texture0;    // Indexed sprite texture\n"
-// "uniform sampler2D paletteTex;    // Palette texture\n"
-// "out vec4 finalColor;\n"
-// "void main()\n"
-// "{\n"
-// "    // Sample indexed texture\n"
-// "    vec4 texel = texture(texture0, fragTexCoord);\n"
-// "    \n"
-// "    // Convert to integer index (0-255)\n"
-// "    int index = int(texel.r * 255.0 + 0.5);\n"
-// "    \n"
-// "    // Use texelFetch for exact pixel access - perfect for NEAREST\n"
-// "    vec4 color = texelFetch(paletteTex, ivec2(index, 0), 0);\n"
-// "    \n"
-// "    // Output final color\n"
-// "    finalColor = vec4(color.rgb, color.a) * fragColor;\n"
-// "}\n";
+void SpriteBrowser::Draw(int width, int height) {
+    frame_++;
+    const std::vector<Sprite>& sprites = sff_.GetSprites();
+    int columns = GetColumns(width);
+    int firstRow = static_cast<int>(scroll_) / cellSize_;
+    int lastRow = (static_cast<int>(scroll_) + height - kStatusHeight) / cellSize_;
+    Vector2 mouse = GetMousePosition();
+    int decodes = 0;
+    int hovered = -1;
+
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int column = 0; column < columns; column++) {
+            size_t index = static_cast<size_t>(row) * columns + column;
+            if (index >= sprites.size()) {
+                break;
+            }
+            int x = column * cellSize_;
+            int y = row * cellSize_ - static_cast<int>(scroll_);
+            if (mouse.x >= x && mouse.x < x + cellSize_ && mouse.y >= y && mouse.y < y + cellSize_ &&
+                mouse.y < height - kStatusHeight) {
+                hovered = static_cast<int>(index);
+            }
+            DrawRectangleLines(x, y, cellSize_, cellSize_, hovered == static_cast<int>(index) ? YELLOW : DARKGRAY);
 
-// Helper function to create the common shader body
-std::string GetPaletteShaderBody(const std::string& textureFunc, const std::string& outputVar) {
-    return
-        "uniform sampler2D texture0;        \n"  // Indexed sprite texture
-        "uniform sampler2D paletteTex;      \n"  // Palette texture
-        "uniform vec4 colDiffuse;           \n"
-        "void main()                        \n"
-        "{                                  \n"
-        "    vec4 texelColor = " + textureFunc + "(texture0, fragTexCoord); \n"
-        "    float index = texelColor.r * 255.0; \n"
-        "    float paletteCoord = (index + 0.5) / 256.0; \n"
-        "    vec4 paletteColor = " + textureFunc + "(paletteTex, vec2(paletteCoord, 0.5)); \n"
-        "    " + outputVar + " = vec4(paletteColor.rgb, paletteColor.a) * colDiffuse * fragColor; \n"
-        "}                                  \n";
+            auto it = thumbnails_.find(static_cast<uint32_t>(index));
+            if (it == thumbnails_.end() && decodes < decodesPerFrame_) {
+                it = thumbnails_.emplace(static_cast<uint32_t>(index), MakeThumbnail(static_cast<uint32_t>(index))).first;
+                decodes++;
+            }
+            if (it != thumbnails_.end()) {
+                it->second.lastUsed = frame_;
+                if (it->second.texture.Use()) {
+                    const Texture2D& texture = it->second.texture.Get();
+                    DrawTexture(texture, x + (cellSize_ - texture.width) / 2,
+                                y + (cellSize_ - kLabelHeight - texture.height) / 2, WHITE);
+                }
+            } else {
+                DrawText("...", x + cellSize_ / 2 - 6, y + cellSize_ / 2 - 10, 10, GRAY);
+            }
+            DrawText(TextFormat("%d,%d", sprites[index].Group, sprites[index].Number),
+                     x + 3, y + cellSize_ - kLabelHeight, 10, LIGHTGRAY);
+        }
+    }
+    EvictThumbnails();
+
+    DrawRectangle(0, height - kStatusHeight, width, kStatusHeight, Color{0, 0, 0, 220});
+    if (hovered >= 0) {
+        const Sprite& sprite = sprites[hovered];
+        const SpriteIndexEntry& entry = sff_.GetSpriteIndex()[hovered];
+        DrawText(TextFormat("#%d  %d,%d  %dx%d  axis %d,%d  %s  pal %d%s", hovered, sprite.Group, sprite.Number,
+                            sprite.Size[0], sprite.Size[1], sprite.Offset[0], sprite.Offset[1],
+                            sprite.IsRGBA() ? "RGBA" : "indexed", sprite.palidx,
+                            entry.dataSize == 0 ? TextFormat("  linked to #%d", entry.link) : ""),
+                 4, height - kStatusHeight + 3, 10, WHITE);
+    } else {
+        DrawText(TextFormat("%zu sprites  %zu thumbnails  %zu decoded", sprites.size(), thumbnails_.size(), numDecodes_),
+                 4, height - kStatusHeight + 3, 10, WHITE);
+    }
 }
 
-// Function to get the complete fragment shader based on rlGetVersion()
-std::string GetPaletteFragmentShader() {
-    int glVersion = rlGetVersion();
-    std::string version, precision, input, output, textureFunc, outputVar;
+// Browses every sprite of the given files in a resizable window, decoding only what is on
+// screen. The files load together through SffManager, Tab switches between them.
+static int RunBrowser(const std::vector<std::string>& sffPaths) {
+    SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+    InitWindow(960, 720, "MugenX - Sprite Browser");
+
+    SffManager manager;
+    manager.SetConfigure([](SffFile& sff) { sff.SetDeferDecode(true); });
+    std::vector<SffManager::Handle> files;
+    std::vector<SffManager::Handle> acquired = manager.AcquireAll(sffPaths);
+    for (size_t i = 0; i < acquired.size(); i++) {
+        if (acquired[i]) {
+            files.push_back(acquired[i]);
+        } else {
+            printf("Failed to load Mugen Sprite %s\n", sffPaths[i].c_str());
+        }
+    }
+    if (files.empty()) {
+        CloseWindow();
+        return 1;
+    }
+    printf("Browser: %zu files, %zu loaded\n", files.size(), manager.GetLoadedCount());
 
-    switch (glVersion) {
-        case RL_OPENGL_21: // OpenGL 2.1
-            version = "#version 120";
-            input = "varying vec2 fragTexCoord;\nvarying vec4 fragColor;";
-            textureFunc = "texture2D";
-            outputVar = "gl_FragColor";
-            break;
+    size_t current = 0;
+    std::unique_ptr<SpriteBrowser> browser(new SpriteBrowser(*files[current]));
+    SetWindowTitle(TextFormat("MugenX - Sprite Browser - %s", files[current]->GetFilename().c_str()));
+    SetTargetFPS(60);
+    while (!WindowShouldClose()) {
+        VramBudget::Instance().NextFrame();
+        if (IsKeyPressed(KEY_TAB) && files.size() > 1) {
+            current = (current + 1) % files.size();
+            browser.reset(new SpriteBrowser(*files[current]));
+            SetWindowTitle(TextFormat("MugenX - Sprite Browser - %s", files[current]->GetFilename().c_str()));
+        }
+        browser->Update(GetScreenWidth(), GetScreenHeight());
 
-        case RL_OPENGL_33: // OpenGL 3.3
-            version = "#version 330";
-            input = "in vec2 fragTexCoord;\nin vec4 fragColor;";
-            output = "out vec4 finalColor;";
-            textureFunc = "texture";
-            outputVar = "finalColor";
-            break;
+        BeginDrawing();
+        ClearBackground(Color{30, 30, 30, 255});
+        browser->Draw(GetScreenWidth(), GetScreenHeight());
+        EndDrawing();
+    }
 
-        case RL_OPENGL_ES_30: // OpenGL ES 3.0
-            version = "#version 300 es";
-            precision = "precision mediump float;\nprecision mediump sampler2D;";
-            input = "in vec2 fragTexCoord;\nin vec4 fragColor;";
-            output = "out vec4 finalColor;";
-            textureFunc = "texture";
-            outputVar = "finalColor";
-            break;
+    browser.reset();
+    files.clear();
+    acquired.clear();
+    CloseWindow();
+    return 0;
+}
 
-        case RL_OPENGL_ES_20: // OpenGL ES 2.0
-        default:
-            version = "#version 100";
-            precision = "precision mediump float;";
-            input = "varying vec2 fragTexCoord;\nvarying vec4 fragColor;";
-            textureFunc = "texture2D";
-            outputVar = "gl_FragColor";
-            break;
+#ifdef SFF_SPRITE_EXPORT
+// Draws sprite spriteIndex of sffPath where the viewer puts it, scaled by scale, with
+// SoftwareRenderer and writes the frame to outPath, e.g. to compare against a golden image.
+// The file is only decoded, never uploaded, so no window or GL context is needed.
+static int RunRender(const char* sffPath, int spriteIndex, const char* outPath, int scale) {
+    SffFile sff;
+    sff.SetTrimTransparentBorders(true);
+    sff.SetDeferDecode(true);
+    SoftwareRenderer renderer;
+    bool ok = sff.Decode(sffPath) && renderer.Init(640, 480);
+    if (ok) {
+        renderer.Clear(Color{30, 30, 30, 255});
+        ok = renderer.Draw(sff, static_cast<uint32_t>(spriteIndex), 320, 240, SPRITE_FLIP_NONE, scale);
+        if (!ok) {
+            printf("Sprite %d of %s is not a paletted sprite\n", spriteIndex, sffPath);
+        }
+    }
+    ok = ok && renderer.WritePng(outPath);
+    if (ok) {
+        printf("Render: sprite %d written to %s\n", spriteIndex, outPath);
     }
 
-    return version + "\n" +
-           precision + (precision.empty() ? "" : "\n") +
-           input + "\n" +
-           output + (output.empty() ? "" : "\n") +
-           GetPaletteShaderBody(textureFunc, outputVar);
+    sff.Clear();
+    return ok ? 0 : 1;
 }
+#endif
 
-// Function to get the complete vertex shader based on rlGetVersion()
-std::string GetPaletteVertexShader() {
-    int glVersion = rlGetVersion();
-    std::string version, precision, attributes, varyings;
+// Offscreen throughput benchmark: draws spriteCount randomly placed sprites with random
+// palettes from sffPath into a render texture for frameCount frames, uncapped, and prints
+// sprites/s, draw calls per frame and frame time percentiles. The window stays hidden, so
+// it runs on a software GL too (e.g. Mesa llvmpipe with LIBGL_ALWAYS_SOFTWARE=1).
+static int RunBenchmark(const char* sffPath, int spriteCount, int frameCount) {
+    const int targetWidth = 1280;
+    const int targetHeight = 720;
+    const int warmupFrames = 10;
 
-    switch (glVersion) {
-        case RL_OPENGL_21:
-            version = "#version 120";
-            attributes = "attribute vec3 vertexPosition;\nattribute vec2 vertexTexCoord;\nattribute vec4 vertexColor;";
-            varyings = "varying vec2 fragTexCoord;\nvarying vec4 fragColor;";
-            break;
+    SetConfigFlags(FLAG_WINDOW_HIDDEN);
+    InitWindow(320, 240, "MugenX - Benchmark");
+    SetTargetFPS(0);
 
-        case RL_OPENGL_33:
-            version = "#version 330";
-            attributes = "in vec3 vertexPosition;\nin vec2 vertexTexCoord;\nin vec4 vertexColor;";
-            varyings = "out vec2 fragTexCoord;\nout vec4 fragColor;";
-            break;
+    SffFile sff;
+    if (!sff.Load(sffPath)) {
+        printf("Failed to load Mugen Sprite %s\n", sffPath);
+        CloseWindow();
+        return 1;
+    }
+    const std::vector<Sprite>& sprites = sff.GetSprites();
+    const std::vector<Palette>& palettes = sff.GetPalettes();
+
+    std::vector<uint32_t> drawable;
+    for (size_t i = 0; i < sprites.size(); i++) {
+        if (sprites[i].texture && sprites[i].Size[0] > 0 && sprites[i].Size[1] > 0 &&
+            (sprites[i].IsRGBA() || !palettes.empty())) {
+            drawable.push_back(static_cast<uint32_t>(i));
+        }
+    }
 
-        case RL_OPENGL_ES_30:
-            version = "#version 300 es";
-            precision = "precision mediump float;";
-            attributes = "in vec3 vertexPosition;\nin vec2 vertexTexCoord;\nin vec4 vertexColor;";
-            varyings = "out vec2 fragTexCoord;\nout vec4 fragColor;";
-            break;
+    SpriteBatch batch;
+    if (drawable.empty() || !batch.Init()) {
+        printf("Nothing to benchmark in %s\n", sffPath);
+        sff.Clear();
+        CloseWindow();
+        return 1;
+    }
+    RenderTexture2D target = LoadRenderTexture(targetWidth, targetHeight);
+
+    // Same seed every run so results compare across builds
+    struct Instance {
+        uint32_t sprite;
+        uint32_t palette;
+        Vector2 position;
+        int flip;
+    };
+    std::vector<Instance> instances(spriteCount);
+    SetRandomSeed(12345);
+    for (Instance& instance : instances) {
+        instance.sprite = drawable[GetRandomValue(0, static_cast<int>(drawable.size()) - 1)];
+        instance.palette = palettes.empty() ? 0 : GetRandomValue(0, static_cast<int>(palettes.size()) - 1);
+        instance.position = Vector2{static_cast<float>(GetRandomValue(0, targetWidth)),
+                                    static_cast<float>(GetRandomValue(0, targetHeight))};
+        instance.flip = GetRandomValue(0, 1) ? SPRITE_FLIP_X : SPRITE_FLIP_NONE;
+    }
 
-        case RL_OPENGL_ES_20:
-        default:
-            version = "#version 100";
-            precision = "precision mediump float;";
-            attributes = "attribute vec3 vertexPosition;\nattribute vec2 vertexTexCoord;\nattribute vec4 vertexColor;";
-            varyings = "varying vec2 fragTexCoord;\nvarying vec4 fragColor;";
-            break;
+    FrameProfiler& profiler = FrameProfiler::Instance();
+    std::chrono::steady_clock::time_point start;
+    for (int frame = -warmupFrames; frame < frameCount; frame++) {
+        if (frame == 0) {
+            profiler.Reset();
+            batch.ResetStats();
+            start = std::chrono::steady_clock::now();
+        }
+        profiler.BeginFrame();
+        BeginTextureMode(target);
+        ClearBackground(Color{30, 30, 30, 255});
+        {
+            ProfileScope profile(PROFILE_BUILD);
+            for (const Instance& instance : instances) {
+                const Sprite& sprite = sprites[instance.sprite];
+                batch.Draw(sprite, sprite.IsRGBA() ? nullptr : &palettes[instance.palette],
+                           instance.position, instance.flip);
+            }
+        }
+        batch.Flush();
+        {
+            ProfileScope profile(PROFILE_PRESENT);
+            EndTextureMode();
+        }
+        profiler.EndFrame();
+    }
+
+    // Reading the target back waits for the GPU to finish every queued frame
+    Image image = LoadImageFromTexture(target.texture);
+    UnloadImage(image);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    FrameStats stats = profiler.GetStats();
+    double seconds = std::max(elapsed.count(), 1e-9);
+    printf("Benchmark: %d sprites x %d frames in %.3f s, %zu distinct sprites, %zu palettes\n",
+           spriteCount, frameCount, seconds, drawable.size(), palettes.size());
+    printf("Benchmark: %.0f sprites/s, %.1f frames/s, %.1f draw calls/frame\n",
+           static_cast<double>(spriteCount) * frameCount / seconds, frameCount / seconds,
+           frameCount > 0 ? static_cast<double>(batch.GetDrawCalls()) / frameCount : 0.0);
+    printf("Benchmark: frame p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, worst %.3f ms (last %zu frames)\n",
+           stats.p50, stats.p95, stats.p99, stats.worst, stats.frames);
+    for (int phase = 0; phase < PROFILE_PHASE_COUNT; phase++) {
+        if (stats.phaseWorst[phase] > 0.0f) {
+            printf("Benchmark: %-8s avg %.3f ms, worst %.3f ms\n", FrameProfiler::GetPhaseName(phase),
+                   stats.phaseAverage[phase], stats.phaseWorst[phase]);
+        }
     }
 
-    return version + "\n" +
-           precision + (precision.empty() ? "" : "\n") +
-           attributes + "\n" +
-           varyings + "\n"
-           "uniform mat4 mvp;\n"
-           "void main()\n"
-           "{\n"
-           "    fragTexCoord = vertexTexCoord;\n"
-           "    fragColor = vertexColor;\n"
-           "    gl_Position = mvp * vec4(vertexPosition, 1.0);\n"
-           "}";
+    UnloadRenderTexture(target);
+    batch.Unload();
+    sff.Clear();
+    CloseWindow();
+    return 0;
 }
 
 // Main program
@@ -1355,20 +6226,61 @@ int main(int argc, char *argv[]) {
     const int screenHeight = 480;
     int sprite_no = 1;
 
+    if (argc >= 3 && strcmp(argv[1], "--bench") == 0) {
+        int spriteCount = argc >= 4 ? atoi(argv[3]) : 10000;
+        int frameCount = argc >= 5 ? atoi(argv[4]) : 600;
+        return RunBenchmark(argv[2], std::max(spriteCount, 1), std::max(frameCount, 1));
+    }
+    if (argc >= 3 && strcmp(argv[1], "--browse") == 0) {
+        return RunBrowser(std::vector<std::string>(argv + 2, argv + argc));
+    }
+#ifdef SFF_SPRITE_EXPORT
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "--render") == 0) {
+        return RunRender(argv[2], atoi(argv[3]), argv[4], argc == 6 ? std::max(atoi(argv[5]), 1) : 1);
+    }
+#endif
+
     InitWindow(screenWidth, screenHeight, "MugenX - C++ Version");
 
     SffFile sff;
-    if (argc == 3) {
+    sff.SetPremultiplyAlpha(true);
+    sff.SetTrimTransparentBorders(true);
+    sff.SetTrackChanges(true);
+    if (argc == 3 || argc == 4) {
         if (!sff.Load(argv[1])) {
             printf("Failed to load Mugen Sprite %s\n", argv[1]);
             return 1;
         }
         sprite_no = atoi(argv[2]);
     } else {
-        printf("%s [sff] [no]\n", argv[0]);
+        printf("%s [sff] [no] [air]\n", argv[0]);
+        printf("  no is the sprite index, or the action number when an AIR file is given\n");
+        printf("%s --bench [sff] [sprites] [frames]\n", argv[0]);
+        printf("%s --browse [sff] [sff...]\n", argv[0]);
+#ifdef SFF_SPRITE_EXPORT
+        printf("%s --render [sff] [no] [png] [scale]\n", argv[0]);
+#endif
         return 1;
     }
 
+    // With an AIR file the action plays instead of the single sprite
+    AirFile air;
+    AnimationPlayer player;
+    bool animated = false;
+    int action = sprite_no;
+    if (argc == 4) {
+        if (!air.Load(argv[3], sff)) {
+            printf("Failed to load Mugen Animation %s\n", argv[3]);
+            return 1;
+        }
+        if (!player.SetAction(air, sprite_no)) {
+            printf("Action %d not found in %s\n", sprite_no, argv[3]);
+            return 1;
+        }
+        animated = true;
+        sprite_no = 0;
+    }
+
     // Use sprites and palettes - FIXED: Use non-const accessors or const references
     auto& sprites = sff.GetSprites();  // This returns non-const reference
     auto& palettes = sff.GetPalettes(); // This returns non-const reference
@@ -1378,49 +6290,153 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Option 1: Use non-const references (if you need to modify them)
-    // Sprite& currentSprite = sprites[6];  // Example sprite
-    // Palette& currentPalette = palettes[0]; // Example palette
+    // Saving the SFF in an editor shows the change right away. Sprites are looked up every
+    // frame, a reload that changed the file's layout builds them again.
+    SffWatcher watcher;
+    watcher.Watch(sff);
 
-    // Option 2: Use const references (if you only need read access)
-    const Sprite& currentSprite = sprites[sprite_no];
-    const Palette& currentPalette = palettes[currentSprite.palidx];
-
-    // Load shader
-    // Shader shader = LoadShaderFromMemory(0, FRAGMENT_SHADER_SRC);
-    Shader shader = LoadShaderFromMemory(GetPaletteVertexShader().c_str(),
-                                        GetPaletteFragmentShader().c_str());
+    // Indexed and RGBA sprites both go through the batch, which brings its own shaders
+    SpriteBatch batch;
+    if (!batch.Init()) {
+        CloseWindow();
+        return 1;
+    }
+    PalFxState palfx;
+    bool showClsn = false;
+    bool showProfile = false;
+    FrameProfiler& profiler = FrameProfiler::Instance();
+
+    // The simulation (input, PalFX, animation, movement) ticks at a fixed 60 Hz whatever the
+    // render rate. V switches rendering between the display refresh rate and uncapped.
+    FixedTimestep timestep(60.0);
+    TickInput input;
+    for (int key : { KEY_F, KEY_G, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN }) {
+        input.WatchKey(key);
+    }
+    input.WatchGamepadButton(0, GAMEPAD_BUTTON_LEFT_FACE_UP);
+    int refreshRate = GetMonitorRefreshRate(GetCurrentMonitor());
+    bool uncapped = false;
+    SetTargetFPS(refreshRate > 0 ? refreshRate : 60);
+
+    // Arrow keys move the sprite, drawn between the last two ticks' positions
+    Vector2 origin = animated ? Vector2{320, 400} : Vector2{320, 240};
+    Vector2 position = origin;
+    Vector2 previousPosition = position;
+
+    bool quit = false;
+    while (!quit && !WindowShouldClose()) {
+        profiler.BeginFrame();
+        ProfileScope updateProfile(PROFILE_UPDATE);
+        VramBudget::Instance().NextFrame();
+        watcher.Poll([&](SffFile& file, SffReloadResult result) {
+            // AIR frames point at the sprites a full load replaced
+            if (result == SFF_RELOAD_FULL && animated) {
+                if (!air.Load(argv[3], file) || !player.SetAction(air, action)) {
+                    printf("Action %d not found after reloading %s\n", action, file.GetFilename().c_str());
+                }
+            }
+        });
+        const Sprite* currentSprite = sff.GetSprite(sprite_no);
+        const Palette* currentPalette = currentSprite ? sff.GetPalette(currentSprite->palidx) : nullptr;
+        input.Sample();
+        timestep.Advance(GetTime());
+
+        while (timestep.Tick()) {
+            previousPosition = position;
+            if (input.IsPressed(GAMEPAD_BUTTON_LEFT_FACE_UP, 0)) {
+                quit = true;
+            }
 
-    int paletteTexLoc = GetShaderLocation(shader, "paletteTex");
-    SetShaderValueTexture(shader, paletteTexLoc, currentPalette.texture);
-    SetTargetFPS(60);
+            // F flashes the sprite white like a hit, G fades it to grey for a second
+            if (input.IsPressed(KEY_F)) {
+                PalFx flash;
+                flash.add[0] = flash.add[1] = flash.add[2] = 0.75f;
+                palfx.Set(flash, 8);
+            }
+            if (input.IsPressed(KEY_G)) {
+                PalFx grey;
+                grey.color = 0.0f;
+                grey.mul[0] = grey.mul[1] = grey.mul[2] = 0.6f;
+                palfx.Set(grey, 60);
+            }
+            const float speed = 4.0f;
+            if (input.IsDown(KEY_LEFT)) position.x -= speed;
+            if (input.IsDown(KEY_RIGHT)) position.x += speed;
+            if (input.IsDown(KEY_UP)) position.y -= speed;
+            if (input.IsDown(KEY_DOWN)) position.y += speed;
+
+            palfx.Update();
+            player.Update();
+            input.EndTick();
+        }
 
-    // Force shader initialization by drawing a dummy texture
-    // This ensures texture units are properly bound before using our custom shader
-    Texture2D dummy_texture;
-    DrawTexture(dummy_texture, 0, 0, WHITE);
+        // Viewer toggles act once per rendered frame
+        // C shows the Clsn boxes of the playing animation
+        if (IsKeyPressed(KEY_C)) {
+            showClsn = !showClsn;
+        }
+        // F3 shows frame times, F4 writes the buffered frames to frame_profile.csv/.json
+        if (IsKeyPressed(KEY_F3)) {
+            showProfile = !showProfile;
+        }
+        if (IsKeyPressed(KEY_F4)) {
+            profiler.WriteCsv("frame_profile.csv");
+            profiler.WriteJson("frame_profile.json");
+        }
+        if (IsKeyPressed(KEY_V)) {
+            uncapped = !uncapped;
+            SetTargetFPS(uncapped ? 0 : (refreshRate > 0 ? refreshRate : 60));
+        }
 
-    while (!WindowShouldClose()) {
-        if (IsGamepadButtonPressed(0, GAMEPAD_BUTTON_LEFT_FACE_UP)) {
-            break;
+#ifdef SFF_SPRITE_EXPORT
+        if (IsKeyPressed(KEY_S) && currentSprite && currentPalette) {
+            ExportSprite(*currentSprite, *currentPalette, sff.GetPaletteAtlas().get(),
+                         TextFormat("sprite_%d_%d.png", currentSprite->Group, currentSprite->Number));
         }
+#endif
+        updateProfile.Stop();
+
+        float alpha = timestep.GetAlpha();
+        Vector2 drawPosition = Vector2{previousPosition.x + (position.x - previousPosition.x) * alpha,
+                                       previousPosition.y + (position.y - previousPosition.y) * alpha};
 
         BeginDrawing();
         ClearBackground(Color{30,30,30,255});
 
-        if (currentSprite.IsPaletted()) {
-            BeginShaderMode(shader);
-            DrawTexture(currentSprite.texture, 320, 240, WHITE);
-            EndShaderMode();
-        } else {
-            DrawTexture(currentSprite.texture, 320, 240, WHITE);
+        ProfileScope buildProfile(PROFILE_BUILD);
+        batch.SetPalFx(palfx.Evaluate());
+        if (animated) {
+            player.Draw(batch, palettes, drawPosition);
+        } else if (currentSprite) {
+            batch.Draw(*currentSprite, currentPalette, drawPosition);
+        }
+        buildProfile.Stop();
+        batch.Flush();
+        if (animated && showClsn) {
+            player.DrawClsn(drawPosition);
         }
 
         DrawFPS(550, 10);
-        EndDrawing();
+        if (uncapped) {
+            DrawText("uncapped", 550, 30, 10, LIGHTGRAY);
+        }
+        if (showProfile) {
+            profiler.DrawOverlay(10, 10);
+        }
+        {
+            ProfileScope presentProfile(PROFILE_PRESENT);
+            EndDrawing();
+        }
+        profiler.EndFrame();
+    }
+
+    // Closing with the overlay open keeps what was being looked at
+    if (showProfile) {
+        profiler.WriteCsv("frame_profile.csv");
+        profiler.WriteJson("frame_profile.json");
     }
 
-    UnloadShader(shader);
+    batch.Unload();
     sff.Clear();
     CloseWindow();
 
@@ -0,0 +1,74 @@
+/*******************************************************************************************
+ *
+ *   Sprite export - writes decoded SFF sprites back out as PNG files
+ *
+ ********************************************************************************************/
+#include "sff_export.h"
+#include "lodepng.h"
+#include <cstdio>
+#include <cstdlib>
+
+static bool WritePngFile(const std::string& filename, const unsigned char* png, size_t size) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        printf("Error: cannot create file %s\n", filename.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(png, 1, size, file) == size;
+    fclose(file);
+    if (!ok) {
+        printf("Error: writing %s\n", filename.c_str());
+    }
+    return ok;
+}
+
+static bool Encode(const std::string& filename, const uint8_t* pixels, unsigned width, unsigned height,
+                   LodePNGState& state) {
+    unsigned char* png = nullptr;
+    size_t pngSize = 0;
+    unsigned status = lodepng_encode(&png, &pngSize, pixels, width, height, &state);
+    if (status != 0) {
+        fprintf(stderr, "Could not encode PNG image(%s)\n", lodepng_error_text(status));
+        free(png);
+        return false;
+    }
+
+    bool ok = WritePngFile(filename, png, pngSize);
+    free(png);
+    return ok;
+}
+
+bool ExportIndexedPng(const std::string& filename, const uint8_t* indices, unsigned width, unsigned height,
+                      const uint8_t* paletteRGBA) {
+    LodePNGState state;
+    lodepng_state_init(&state);
+
+    // Keep the original indices instead of letting the encoder pick a color type
+    state.encoder.auto_convert = 0;
+    state.info_raw.colortype = LCT_PALETTE;
+    state.info_raw.bitdepth = 8;
+    state.info_png.color.colortype = LCT_PALETTE;
+    state.info_png.color.bitdepth = 8;
+
+    for (int i = 0; i < 256; i++) {
+        const uint8_t* c = paletteRGBA + i * 4;
+        lodepng_palette_add(&state.info_raw, c[0], c[1], c[2], c[3]);
+        lodepng_palette_add(&state.info_png.color, c[0], c[1], c[2], c[3]);
+    }
+
+    bool ok = Encode(filename, indices, width, height, state);
+    lodepng_state_cleanup(&state);
+    return ok;
+}
+
+bool ExportRGBAPng(const std::string& filename, const uint8_t* pixels, unsigned width, unsigned height) {
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.info_raw.colortype = LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+
+    bool ok = Encode(filename, pixels, width, height, state);
+    lodepng_state_cleanup(&state);
+    return ok;
+}
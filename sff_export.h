@@ -0,0 +1,23 @@
+/*******************************************************************************************
+ *
+ *   Sprite export - writes decoded SFF sprites back out as PNG files
+ *
+ *   Optional module: built with `make SPRITE_EXPORT=1`, which also compiles the lodepng
+ *   encoder that the default decode-only build leaves out.
+ *
+ ********************************************************************************************/
+#ifndef SFF_EXPORT_H
+#define SFF_EXPORT_H
+
+#include <stdint.h>
+#include <string>
+
+// Writes an 8-bit indexed sprite as a paletted PNG. paletteRGBA holds 256 RGBA entries,
+// in the same layout as the palette textures.
+bool ExportIndexedPng(const std::string& filename, const uint8_t* indices, unsigned width, unsigned height,
+                      const uint8_t* paletteRGBA);
+
+// Writes an 8-bit RGBA image as a truecolor PNG
+bool ExportRGBAPng(const std::string& filename, const uint8_t* pixels, unsigned width, unsigned height);
+
+#endif // SFF_EXPORT_H